@@ -0,0 +1,86 @@
+# Low overhead binary logging of host activity
+#
+# Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import logging, struct
+import chelper
+
+BUFFER_SIZE = 4 * 1024 * 1024
+MAX_FILE_SIZE = 64 * 1024 * 1024
+BACKUP_COUNT = 5
+MAX_RECORD_SIZE = 0xffff
+
+# Record types (must match klippy/chelper/binlog.h)
+BLR_SOURCE = 1
+BLR_SENT = 2
+BLR_RETRANSMIT = 3
+BLR_RECEIVE = 4
+BLR_STATS = 5
+BLR_THC_SAMPLE = 6
+BLR_GCODE = 7
+BLR_TEXT = 8
+RECORD_NAMES = {
+    BLR_SOURCE: "source", BLR_SENT: "sent", BLR_RETRANSMIT: "retransmit",
+    BLR_RECEIVE: "receive", BLR_STATS: "stats", BLR_THC_SAMPLE: "thc_sample",
+    BLR_GCODE: "gcode", BLR_TEXT: "text",
+}
+
+FILE_HEADER = struct.Struct('<4sIdd')
+RECORD_HEADER = struct.Struct('<HBB4xd')
+# Receive time, z position (mm), torch voltage (V), xy speed (mm/s) - a
+# thc_sample record may hold several samples
+THC_SAMPLE = struct.Struct('<dddd')
+
+# Binary log writer (records are written to disk by a C thread)
+class BinaryLog:
+    def __init__(self, filename, max_size=MAX_FILE_SIZE,
+                 backup_count=BACKUP_COUNT):
+        self.ffi_main, self.ffi_lib = chelper.get_ffi()
+        self.binlog = self.ffi_lib.binlog_alloc(filename, max_size,
+                                                backup_count, BUFFER_SIZE)
+        if self.binlog == self.ffi_main.NULL:
+            raise IOError("Unable to open binary log '%s'" % (filename,))
+        self.sources = {}
+        self.stats_buf = self.ffi_main.new('char[256]')
+    def get_handle(self):
+        return self.binlog
+    def register_source(self, eventtime, name, identify_data):
+        # Assign a source id to an mcu connection and store its data
+        # dictionary so that its messages can be decoded offline
+        source = self.sources.get(name)
+        if source is None:
+            source = self.sources[name] = len(self.sources) + 1
+        data = name + '\0' + identify_data
+        if len(data) > MAX_RECORD_SIZE:
+            logging.warning("Data dictionary of '%s' too large for the"
+                            " binary log", name)
+            data = name + '\0'
+        self.write(BLR_SOURCE, eventtime, data, source)
+        return source
+    def write(self, rtype, eventtime, data, source=0):
+        self.ffi_lib.binlog_write(self.binlog, rtype, source, eventtime,
+                                  data, len(data))
+    def stats(self, eventtime):
+        self.ffi_lib.binlog_get_stats(self.binlog, self.stats_buf,
+                                      len(self.stats_buf))
+        return self.ffi_main.string(self.stats_buf)
+    def stop(self):
+        self.ffi_lib.binlog_free(self.binlog)
+        self.binlog = None
+
+MainBinaryLog = None
+
+def setup_binary_log(filename):
+    global MainBinaryLog
+    MainBinaryLog = BinaryLog(filename)
+    return MainBinaryLog
+
+def get_binary_log():
+    return MainBinaryLog
+
+def clear_binary_log():
+    global MainBinaryLog
+    if MainBinaryLog is not None:
+        MainBinaryLog.stop()
+        MainBinaryLog = None
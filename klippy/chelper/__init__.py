@@ -17,15 +17,15 @@ COMPILE_ARGS = ("-Wall -g -O2 -shared -fPIC"
                 " -o %s %s")
 SSE_FLAGS = "-mfpmath=sse -msse2"
 SOURCE_FILES = [
-    'pyhelper.c', 'serialqueue.c', 'stepcompress.c', 'itersolve.c', 'trapq.c',
-    'kin_cartesian.c', 'kin_corexy.c', 'kin_corexz.c', 'kin_delta.c',
-    'kin_polar.c', 'kin_rotary_delta.c', 'kin_winch.c', 'kin_extruder.c',
-    'kin_shaper.c',
+    'pyhelper.c', 'serialqueue.c', 'msgdecode.c', 'binlog.c', 'stepcompress.c',
+    'itersolve.c', 'trapq.c', 'kin_cartesian.c', 'kin_corexy.c',
+    'kin_corexz.c', 'kin_delta.c', 'kin_polar.c', 'kin_rotary_delta.c',
+    'kin_winch.c', 'kin_extruder.c', 'kin_shaper.c',
 ]
 DEST_LIB = "c_helper.so"
 OTHER_FILES = [
     'list.h', 'serialqueue.h', 'stepcompress.h', 'itersolve.h', 'pyhelper.h',
-    'trapq.h',
+    'trapq.h', 'msgdecode.h', 'binlog.h',
 ]
 
 defs_stepcompress = """
@@ -43,7 +43,13 @@ defs_stepcompress = """
     void steppersync_free(struct steppersync *ss);
     void steppersync_set_time(struct steppersync *ss
         , double time_offset, double mcu_freq);
+    void steppersync_set_moves_freed(struct steppersync *ss
+        , uint32_t moves_freed);
     int steppersync_flush(struct steppersync *ss, uint64_t move_clock);
+
+    int stepcompress_set_evaluator(int type);
+    int stepcompress_bench(uint32_t max_error, uint64_t start_clock
+        , uint64_t *steps, int steps_count, int32_t *moves, int max_moves);
 """
 
 defs_itersolve = """
@@ -68,6 +74,19 @@ defs_trapq = """
         , double start_pos_x, double start_pos_y, double start_pos_z
         , double axes_r_x, double axes_r_y, double axes_r_z
         , double start_v, double cruise_v, double accel);
+    void trapq_append_scurve(struct trapq *tq, double print_time
+        , double accel_t, double accel_jerk_t, double cruise_t
+        , double decel_t, double decel_jerk_t
+        , double start_pos_x, double start_pos_y, double start_pos_z
+        , double axes_r_x, double axes_r_y, double axes_r_z
+        , double start_v, double cruise_v, double end_v);
+    void trapq_append_arc(struct trapq *tq, double print_time
+        , double accel_t, double accel_jerk_t, double cruise_t
+        , double decel_t, double decel_jerk_t
+        , double start_pos_x, double start_pos_y, double start_pos_z
+        , double arc_center_x, double arc_center_y
+        , double arc_angle_r, double axis_r_z
+        , double start_v, double cruise_v, double end_v);
     struct trapq *trapq_alloc(void);
     void trapq_free(struct trapq *tq);
     void trapq_free_moves(struct trapq *tq, double print_time);
@@ -134,6 +153,7 @@ defs_kin_shaper = """
 
 defs_serialqueue = """
     #define MESSAGE_MAX 64
+    #define SQ_PRIORITY_HIGH 1
     struct pull_queue_message {
         uint8_t msg[MESSAGE_MAX];
         int len;
@@ -141,26 +161,84 @@ defs_serialqueue = """
         uint64_t notify_id;
     };
 
-    struct serialqueue *serialqueue_alloc(int serial_fd, int write_only);
+    struct serialqueue *serialqueue_alloc(int serial_fd, char serial_fd_type
+        , int client_id);
     void serialqueue_exit(struct serialqueue *sq);
     void serialqueue_free(struct serialqueue *sq);
     struct command_queue *serialqueue_alloc_commandqueue(void);
     void serialqueue_free_commandqueue(struct command_queue *cq);
+    void serialqueue_set_commandqueue_priority(struct command_queue *cq
+        , int priority);
     void serialqueue_send(struct serialqueue *sq, struct command_queue *cq
         , uint8_t *msg, int len, uint64_t min_clock, uint64_t req_clock
         , uint64_t notify_id);
     void serialqueue_pull(struct serialqueue *sq
         , struct pull_queue_message *pqm);
+    int serialqueue_pull_batch(struct serialqueue *sq
+        , struct pull_queue_message *pqm, int max);
     void serialqueue_set_baud_adjust(struct serialqueue *sq
         , double baud_adjust);
     void serialqueue_set_receive_window(struct serialqueue *sq
         , int receive_window);
+    void serialqueue_set_priority_reserve(struct serialqueue *sq
+        , int reserve);
+    void serialqueue_set_binlog(struct serialqueue *sq, struct binlog *bl
+        , int source);
+    int serialqueue_add_capture(struct serialqueue *sq
+        , struct msgcapture *mc);
+    void serialqueue_remove_capture(struct serialqueue *sq
+        , struct msgcapture *mc);
     void serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
         , double last_clock_time, uint64_t last_clock);
     void serialqueue_get_stats(struct serialqueue *sq, char *buf, int len);
     int serialqueue_extract_old(struct serialqueue *sq, int sentq
         , struct pull_queue_message *q, int max);
     void force_retransmit(struct serialqueue *sq);
+    int serialqueue_open_canbus(const char *iface, uint32_t *rx_ids
+        , int count);
+"""
+
+defs_msgdecode = """
+    #define MSGDECODE_MAX_PARAMS 16
+    struct msgdecode_record {
+        int msgid, param_count;
+        double sent_time, receive_time;
+        int64_t params[MSGDECODE_MAX_PARAMS];
+    };
+
+    struct msgdecoder *msgdecode_alloc(void);
+    void msgdecode_free(struct msgdecoder *md);
+    int msgdecode_set_format(struct msgdecoder *md, int msgid
+        , uint8_t *types, int count);
+    int msgdecode_parse(struct msgdecoder *md, uint8_t *msg, int len
+        , struct msgdecode_record *rec);
+    void msgdecode_batch(struct msgdecoder *md
+        , struct pull_queue_message *pqm, int count
+        , struct msgdecode_record *out);
+
+    struct msgcapture_region {
+        int count, int_count, buf_size;
+        uint32_t dropped;
+        double *times;
+        int64_t *values;
+        uint8_t *data, *lengths;
+    };
+
+    struct msgcapture *msgcapture_alloc(int msgid, uint8_t *types
+        , int count, int oid_index, int oid, int buf_size, int size);
+    void msgcapture_free(struct msgcapture *mc);
+    int msgcapture_peek(struct msgcapture *mc
+        , struct msgcapture_region *r);
+    void msgcapture_release(struct msgcapture *mc, int count);
+"""
+
+defs_binlog = """
+    struct binlog *binlog_alloc(const char *filename, int max_size
+        , int backup_count, int buffer_size);
+    void binlog_free(struct binlog *bl);
+    int binlog_write(struct binlog *bl, int type, int source, double time
+        , uint8_t *data, int len);
+    void binlog_get_stats(struct binlog *bl, char *buf, int len);
 """
 
 defs_pyhelper = """
@@ -173,10 +251,10 @@ defs_std = """
 """
 
 defs_all = [
-    defs_pyhelper, defs_serialqueue, defs_std, defs_stepcompress,
-    defs_itersolve, defs_trapq, defs_kin_cartesian, defs_kin_corexy,
-    defs_kin_corexz, defs_kin_delta, defs_kin_polar, defs_kin_rotary_delta,
-    defs_kin_winch, defs_kin_extruder, defs_kin_shaper,
+    defs_pyhelper, defs_serialqueue, defs_msgdecode, defs_binlog, defs_std,
+    defs_stepcompress, defs_itersolve, defs_trapq, defs_kin_cartesian,
+    defs_kin_corexy, defs_kin_corexz, defs_kin_delta, defs_kin_polar,
+    defs_kin_rotary_delta, defs_kin_winch, defs_kin_extruder, defs_kin_shaper,
 ]
 
 # Update filenames to an absolute path
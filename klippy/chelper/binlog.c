@@ -0,0 +1,315 @@
+// Low overhead binary logging of host activity
+//
+// Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// Records (a small header followed by an opaque payload) are copied
+// into a memory buffer by the caller and written to disk by a
+// background thread, so that logging never blocks on file i/o.  The
+// log file is rotated once it reaches a configured size.  If the
+// writer can not keep up, new records are dropped (and counted)
+// instead of delaying the caller.  Source records (that describe
+// the mcu connections) are repeated at the start of each new file so
+// that every file can be decoded on its own.
+
+#include <errno.h> // ETIMEDOUT
+#include <fcntl.h> // open
+#include <pthread.h> // pthread_mutex_lock
+#include <stdio.h> // snprintf
+#include <stdlib.h> // malloc
+#include <string.h> // memcpy
+#include <time.h> // clock_gettime
+#include <unistd.h> // write
+#include "binlog.h" // struct binlog_record
+#include "compiler.h" // __visible
+#include "pyhelper.h" // get_monotonic
+
+// Maximum time records may stay in the buffer before being written
+#define FLUSH_TIME .250
+
+struct binlog {
+    // Writer thread
+    pthread_t tid;
+    pthread_mutex_t lock; // protects variables below
+    pthread_cond_t cond;
+    int must_exit;
+    // Record buffer
+    uint8_t *buf;
+    uint32_t size, pos, used;
+    // Statistics
+    uint64_t records, dropped, bytes;
+    // Log file (only accessed by the writer thread)
+    char *filename;
+    int fd, max_size, backup_count, write_errors, rotations;
+    size_t file_size;
+    uint8_t *scratch;
+    uint8_t *sources[256];
+};
+
+
+/****************************************************************
+ * Log files
+ ****************************************************************/
+
+// Write a buffer to the log file
+static void
+write_file(struct binlog *bl, uint8_t *data, int len)
+{
+    while (len > 0) {
+        int ret = write(bl->fd, data, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (!bl->write_errors++)
+                report_errno("binlog write", ret);
+            return;
+        }
+        data += ret;
+        len -= ret;
+        bl->file_size += ret;
+    }
+}
+
+// Open a new log file and write its header
+static int
+open_file(struct binlog *bl)
+{
+    bl->fd = open(bl->filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC
+                  , 0644);
+    if (bl->fd < 0) {
+        report_errno("binlog open", bl->fd);
+        return -1;
+    }
+    bl->file_size = 0;
+    struct binlog_file_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BINLOG_MAGIC, sizeof(hdr.magic));
+    hdr.version = BINLOG_VERSION;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr.realtime = (double)ts.tv_sec + (double)ts.tv_nsec * .000000001;
+    hdr.monotonic = get_monotonic();
+    write_file(bl, (void*)&hdr, sizeof(hdr));
+    int i;
+    for (i=0; i<ARRAY_SIZE(bl->sources); i++) {
+        uint8_t *src = bl->sources[i];
+        if (src) {
+            struct binlog_record *rec = (void*)src;
+            write_file(bl, src, sizeof(*rec) + rec->len);
+        }
+    }
+    return 0;
+}
+
+// Remember a source record so it can be repeated after rotation
+static void
+save_source(struct binlog *bl, uint8_t *data, int reclen)
+{
+    struct binlog_record *rec = (void*)data;
+    free(bl->sources[rec->source]);
+    bl->sources[rec->source] = malloc(reclen);
+    memcpy(bl->sources[rec->source], data, reclen);
+}
+
+// Rename existing log files (log -> log.1 -> log.2 ...) and start a
+// new log file
+static void
+rotate_file(struct binlog *bl)
+{
+    close(bl->fd);
+    int len = strlen(bl->filename) + 16, i;
+    char src[len], dst[len];
+    for (i=bl->backup_count; i>0; i--) {
+        if (i > 1)
+            snprintf(src, len, "%s.%d", bl->filename, i-1);
+        else
+            snprintf(src, len, "%s", bl->filename);
+        snprintf(dst, len, "%s.%d", bl->filename, i);
+        rename(src, dst);
+    }
+    bl->rotations++;
+    if (open_file(bl))
+        bl->fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+}
+
+// Write a series of complete records, rotating the log file as needed
+static void
+write_records(struct binlog *bl, uint8_t *data, int len)
+{
+    uint8_t *start = data, *end = data + len;
+    while (data < end) {
+        struct binlog_record rec;
+        memcpy(&rec, data, sizeof(rec));
+        int reclen = sizeof(rec) + rec.len;
+        if (bl->max_size && data > start
+            && bl->file_size + (data - start) + reclen > bl->max_size) {
+            write_file(bl, start, data - start);
+            rotate_file(bl);
+            start = data;
+        }
+        if (rec.type == BLR_SOURCE)
+            save_source(bl, data, reclen);
+        data += reclen;
+    }
+    write_file(bl, start, data - start);
+}
+
+
+/****************************************************************
+ * Writer thread
+ ****************************************************************/
+
+// Copy data into the record buffer (caller must hold lock)
+static void
+buffer_add(struct binlog *bl, void *data, int len)
+{
+    uint32_t wpos = (bl->pos + bl->used) % bl->size;
+    uint32_t tail = bl->size - wpos;
+    if (tail > len)
+        tail = len;
+    memcpy(&bl->buf[wpos], data, tail);
+    memcpy(bl->buf, (uint8_t*)data + tail, len - tail);
+    bl->used += len;
+}
+
+// Move all buffered records to the scratch area (caller must hold lock)
+static int
+buffer_take(struct binlog *bl)
+{
+    uint32_t len = bl->used, tail = bl->size - bl->pos;
+    if (tail > len)
+        tail = len;
+    memcpy(bl->scratch, &bl->buf[bl->pos], tail);
+    memcpy(&bl->scratch[tail], bl->buf, len - tail);
+    bl->pos = (bl->pos + len) % bl->size;
+    bl->used = 0;
+    return len;
+}
+
+// Background thread that writes buffered records to disk
+static void *
+writer_thread(void *data)
+{
+    struct binlog *bl = data;
+    pthread_mutex_lock(&bl->lock);
+    for (;;) {
+        // Wait for a quarter of the buffer to fill (or a timeout)
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        double waketime = ts.tv_sec + ts.tv_nsec * .000000001 + FLUSH_TIME;
+        ts = fill_time(waketime);
+        while (!bl->must_exit && bl->used < bl->size / 4) {
+            int ret = pthread_cond_timedwait(&bl->cond, &bl->lock, &ts);
+            if (ret == ETIMEDOUT)
+                break;
+        }
+        int must_exit = bl->must_exit;
+        int len = buffer_take(bl);
+        pthread_mutex_unlock(&bl->lock);
+        write_records(bl, bl->scratch, len);
+        if (must_exit)
+            break;
+        pthread_mutex_lock(&bl->lock);
+    }
+    return NULL;
+}
+
+
+/****************************************************************
+ * Interface
+ ****************************************************************/
+
+// Create a binary log writing to 'filename'.  The file is rotated
+// after reaching max_size bytes (zero to disable) keeping the given
+// number of old files.
+struct binlog * __visible
+binlog_alloc(const char *filename, int max_size, int backup_count
+             , int buffer_size)
+{
+    struct binlog *bl = malloc(sizeof(*bl));
+    memset(bl, 0, sizeof(*bl));
+    bl->filename = strdup(filename);
+    bl->max_size = max_size;
+    bl->backup_count = backup_count;
+    if (open_file(bl))
+        goto fail;
+    bl->size = buffer_size;
+    bl->buf = malloc(buffer_size);
+    bl->scratch = malloc(buffer_size);
+    pthread_mutex_init(&bl->lock, NULL);
+    pthread_cond_init(&bl->cond, NULL);
+    int ret = pthread_create(&bl->tid, NULL, writer_thread, bl);
+    if (ret) {
+        report_errno("binlog pthread_create", ret);
+        close(bl->fd);
+        free(bl->buf);
+        free(bl->scratch);
+        goto fail;
+    }
+    return bl;
+fail:
+    free(bl->filename);
+    free(bl);
+    return NULL;
+}
+
+// Write all pending records and free the binary log
+void __visible
+binlog_free(struct binlog *bl)
+{
+    if (!bl)
+        return;
+    pthread_mutex_lock(&bl->lock);
+    bl->must_exit = 1;
+    pthread_cond_signal(&bl->cond);
+    pthread_mutex_unlock(&bl->lock);
+    pthread_join(bl->tid, NULL);
+    close(bl->fd);
+    int i;
+    for (i=0; i<ARRAY_SIZE(bl->sources); i++)
+        free(bl->sources[i]);
+    free(bl->buf);
+    free(bl->scratch);
+    free(bl->filename);
+    free(bl);
+}
+
+// Add a record to the log.  Returns -1 if the record was dropped.
+int __visible
+binlog_write(struct binlog *bl, int type, int source, double time
+             , uint8_t *data, int len)
+{
+    struct binlog_record rec = {
+        .len = len, .type = type, .source = source, .time = time };
+    uint32_t reclen = sizeof(rec) + len;
+    if (len > UINT16_MAX)
+        return -1;
+    pthread_mutex_lock(&bl->lock);
+    if (bl->used + reclen > bl->size) {
+        bl->dropped++;
+        pthread_mutex_unlock(&bl->lock);
+        return -1;
+    }
+    buffer_add(bl, &rec, sizeof(rec));
+    buffer_add(bl, data, len);
+    bl->records++;
+    bl->bytes += reclen;
+    if (bl->used >= bl->size / 4 && bl->used - reclen < bl->size / 4)
+        pthread_cond_signal(&bl->cond);
+    pthread_mutex_unlock(&bl->lock);
+    return 0;
+}
+
+// Report the binary log statistics
+void __visible
+binlog_get_stats(struct binlog *bl, char *buf, int len)
+{
+    pthread_mutex_lock(&bl->lock);
+    snprintf(buf, len, "binlog_records=%llu binlog_bytes=%llu"
+             " binlog_dropped=%llu binlog_buffered=%u binlog_rotations=%d"
+             , (unsigned long long)bl->records
+             , (unsigned long long)bl->bytes
+             , (unsigned long long)bl->dropped, bl->used, bl->rotations);
+    pthread_mutex_unlock(&bl->lock);
+}
@@ -0,0 +1,36 @@
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stdint.h> // uint8_t
+
+#define BINLOG_MAGIC "KBLG"
+#define BINLOG_VERSION 1
+
+// Record types (see scripts/binlog_decode.py)
+enum {
+    BLR_SOURCE = 1, BLR_SENT, BLR_RETRANSMIT, BLR_RECEIVE, BLR_STATS,
+    BLR_THC_SAMPLE, BLR_GCODE, BLR_TEXT,
+};
+
+struct binlog_file_header {
+    char magic[4];
+    uint32_t version;
+    double realtime, monotonic;
+};
+
+struct binlog_record {
+    uint16_t len;
+    uint8_t type, source;
+    uint32_t pad;
+    double time;
+};
+
+struct binlog;
+struct binlog *binlog_alloc(const char *filename, int max_size
+                            , int backup_count, int buffer_size);
+void binlog_free(struct binlog *bl);
+int binlog_write(struct binlog *bl, int type, int source, double time
+                 , uint8_t *data, int len);
+void binlog_get_stats(struct binlog *bl, char *buf, int len);
+
+#endif // binlog.h
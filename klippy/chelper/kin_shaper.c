@@ -239,6 +239,8 @@ init_shaper(int shaper_type, double shaper_freq, double damping_ratio
 static inline double
 get_axis_position(struct move *m, int axis, double move_time)
 {
+    if (unlikely(m->arc_angle_r))
+        return move_get_coord(m, move_time).axis[axis - 'x'];
     double axis_r = m->axes_r.axis[axis - 'x'];
     double start_pos = m->start_pos.axis[axis - 'x'];
     double move_dist = move_get_distance(m, move_time);
@@ -0,0 +1,306 @@
+// Decoding of mcu response messages using the data dictionary
+//
+// Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "msgdecode.h" // struct msgdecode_record
+#include "pyhelper.h" // errorf
+#include "serialqueue.h" // struct pull_queue_message
+
+#define MSGID_MAX 256
+
+struct msgformat {
+    uint8_t param_count;
+    uint8_t types[MSGDECODE_MAX_PARAMS];
+};
+
+struct msgdecoder {
+    struct msgformat *formats[MSGID_MAX];
+};
+
+// Allocate a new (empty) message decoder
+struct msgdecoder * __visible
+msgdecode_alloc(void)
+{
+    struct msgdecoder *md = malloc(sizeof(*md));
+    memset(md, 0, sizeof(*md));
+    return md;
+}
+
+// Free all memory associated with a message decoder
+void __visible
+msgdecode_free(struct msgdecoder *md)
+{
+    if (!md)
+        return;
+    int i;
+    for (i=0; i<MSGID_MAX; i++)
+        free(md->formats[i]);
+    free(md);
+}
+
+// Register the parameter types of a response message id
+int __visible
+msgdecode_set_format(struct msgdecoder *md, int msgid
+                     , uint8_t *types, int count)
+{
+    if (msgid < 0 || msgid >= MSGID_MAX || count > MSGDECODE_MAX_PARAMS) {
+        errorf("msgdecode unsupported format id=%d count=%d", msgid, count);
+        return -1;
+    }
+    int i;
+    for (i=0; i<count; i++)
+        if (types[i] > MDT_BUFFER) {
+            errorf("msgdecode invalid type %d", types[i]);
+            return -1;
+        }
+    struct msgformat *mf = md->formats[msgid];
+    if (!mf) {
+        mf = malloc(sizeof(*mf));
+        md->formats[msgid] = mf;
+    }
+    memset(mf, 0, sizeof(*mf));
+    mf->param_count = count;
+    memcpy(mf->types, types, count);
+    return 0;
+}
+
+// Parse a variable length quantity (vlq) encoded integer
+static uint8_t *
+parse_int(uint8_t *p, uint8_t *end, uint32_t *pv)
+{
+    if (p >= end)
+        return NULL;
+    uint8_t c = *p++;
+    uint32_t v = c & 0x7f;
+    if ((c & 0x60) == 0x60)
+        v |= -0x20;
+    while (c & 0x80) {
+        if (p >= end)
+            return NULL;
+        c = *p++;
+        v = (v<<7) | (c & 0x7f);
+    }
+    *pv = v;
+    return p;
+}
+
+// Decode the parameters of a framed mcu message (of a known format).
+// Integer parameters are stored in message format order; buffer
+// parameters are stored as ((length << 8) | offset) of the data
+// within the message.
+static int
+decode_params(struct msgformat *mf, uint8_t *msg, int len, int64_t *params)
+{
+    uint8_t *p = &msg[MESSAGE_HEADER_SIZE + 1];
+    uint8_t *end = &msg[len-MESSAGE_TRAILER_SIZE];
+    int i;
+    for (i=0; i<mf->param_count; i++) {
+        uint8_t type = mf->types[i];
+        if (type == MDT_BUFFER) {
+            if (p >= end || *p > end - p - 1)
+                return -1;
+            uint8_t blen = *p++;
+            params[i] = ((int64_t)blen << 8) | (p - msg);
+            p += blen;
+            continue;
+        }
+        uint32_t v;
+        p = parse_int(p, end, &v);
+        if (!p)
+            return -1;
+        if (type == MDT_INT32 || type == MDT_INT16)
+            params[i] = (int32_t)v;
+        else
+            params[i] = v;
+    }
+    if (p != end)
+        // Extra data at end of message
+        return -1;
+    return 0;
+}
+
+// Decode a framed mcu message into a flat record.  On success the
+// message id is returned, otherwise -1 is returned (and rec->msgid
+// set to -1) so that the caller may fall back to a generic parser.
+int __visible
+msgdecode_parse(struct msgdecoder *md, uint8_t *msg, int len
+                , struct msgdecode_record *rec)
+{
+    rec->msgid = -1;
+    rec->param_count = 0;
+    if (len < MESSAGE_MIN + 1)
+        return -1;
+    int msgid = msg[MESSAGE_HEADER_SIZE];
+    struct msgformat *mf = md->formats[msgid];
+    if (!mf || decode_params(mf, msg, len, rec->params))
+        return -1;
+    rec->param_count = mf->param_count;
+    rec->msgid = msgid;
+    return msgid;
+}
+
+// Decode a batch of messages obtained from serialqueue_pull_batch()
+void __visible
+msgdecode_batch(struct msgdecoder *md, struct pull_queue_message *pqm
+                , int count, struct msgdecode_record *out)
+{
+    int i;
+    for (i=0; i<count; i++, pqm++, out++) {
+        out->sent_time = pqm->sent_time;
+        out->receive_time = pqm->receive_time;
+        if (pqm->notify_id || pqm->len <= 0) {
+            out->msgid = -1;
+            out->param_count = 0;
+            continue;
+        }
+        msgdecode_parse(md, pqm->msg, pqm->len, out);
+    }
+}
+
+
+/****************************************************************
+ * Bulk message capture
+ ****************************************************************/
+
+// A message capture stores the parameters of every received message
+// of a given id (and oid) in preallocated arrays - one array for the
+// receive times, one for the integer parameters, and one for the
+// contents of a buffer parameter.  The serialqueue thread fills the
+// capture and the host code reads contiguous runs of records (for
+// example, as numpy views) without decoding each message in python.
+
+struct msgcapture {
+    struct msgformat format;
+    int msgid, oid_index, oid, buf_index, buf_size, int_count;
+    // Single producer (serialqueue thread), single consumer ring
+    uint32_t size, head, tail, dropped;
+    double *times;
+    int64_t *values;
+    uint8_t *data, *lengths;
+};
+
+// Allocate a capture for messages with the given id and parameter
+// types.  If oid_index is not negative only messages whose parameter
+// at that index equals 'oid' are captured.  At most one buffer
+// parameter (of up to buf_size bytes) is supported.
+struct msgcapture * __visible
+msgcapture_alloc(int msgid, uint8_t *types, int count, int oid_index
+                 , int oid, int buf_size, int size)
+{
+    if (count > MSGDECODE_MAX_PARAMS || size <= 0) {
+        errorf("msgcapture unsupported format id=%d count=%d", msgid, count);
+        return NULL;
+    }
+    struct msgcapture *mc = malloc(sizeof(*mc));
+    memset(mc, 0, sizeof(*mc));
+    mc->format.param_count = count;
+    memcpy(mc->format.types, types, count);
+    mc->msgid = msgid;
+    mc->oid_index = oid_index;
+    mc->oid = oid;
+    mc->buf_index = -1;
+    int i;
+    for (i=0; i<count; i++) {
+        if (types[i] != MDT_BUFFER) {
+            mc->int_count++;
+            continue;
+        }
+        if (mc->buf_index >= 0) {
+            errorf("msgcapture only supports one buffer (id=%d)", msgid);
+            free(mc);
+            return NULL;
+        }
+        mc->buf_index = i;
+    }
+    mc->buf_size = mc->buf_index >= 0 ? buf_size : 0;
+    mc->size = size;
+    mc->times = malloc(size * sizeof(*mc->times));
+    mc->values = malloc(size * mc->int_count * sizeof(*mc->values) + 1);
+    mc->data = malloc(size * mc->buf_size + 1);
+    mc->lengths = malloc(size);
+    return mc;
+}
+
+// Free a message capture
+void __visible
+msgcapture_free(struct msgcapture *mc)
+{
+    if (!mc)
+        return;
+    free(mc->times);
+    free(mc->values);
+    free(mc->data);
+    free(mc->lengths);
+    free(mc);
+}
+
+// Store a message if it matches the capture.  Returns 1 if the
+// message was captured (or dropped because the capture was full),
+// otherwise 0.  Called from the serialqueue thread.
+int
+msgcapture_check(struct msgcapture *mc, uint8_t *msg, int len
+                 , double receive_time)
+{
+    if (len < MESSAGE_MIN + 1 || msg[MESSAGE_HEADER_SIZE] != mc->msgid)
+        return 0;
+    int64_t params[MSGDECODE_MAX_PARAMS];
+    if (decode_params(&mc->format, msg, len, params))
+        return 0;
+    if (mc->oid_index >= 0 && params[mc->oid_index] != mc->oid)
+        return 0;
+    uint32_t head = mc->head;
+    uint32_t tail = __atomic_load_n(&mc->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= mc->size) {
+        mc->dropped++;
+        return 1;
+    }
+    uint32_t pos = head % mc->size;
+    mc->times[pos] = receive_time;
+    int64_t *values = &mc->values[pos * mc->int_count];
+    int i;
+    for (i=0; i<mc->format.param_count; i++) {
+        if (i != mc->buf_index) {
+            *values++ = params[i];
+            continue;
+        }
+        int blen = params[i] >> 8, offset = params[i] & 0xff;
+        if (blen > mc->buf_size)
+            blen = mc->buf_size;
+        memcpy(&mc->data[pos * mc->buf_size], &msg[offset], blen);
+        mc->lengths[pos] = blen;
+    }
+    __atomic_store_n(&mc->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Return the next contiguous run of captured records
+int __visible
+msgcapture_peek(struct msgcapture *mc, struct msgcapture_region *r)
+{
+    uint32_t head = __atomic_load_n(&mc->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = mc->tail, pos = tail % mc->size;
+    uint32_t count = head - tail;
+    if (count > mc->size - pos)
+        count = mc->size - pos;
+    r->count = count;
+    r->int_count = mc->int_count;
+    r->buf_size = mc->buf_size;
+    r->dropped = mc->dropped;
+    r->times = &mc->times[pos];
+    r->values = &mc->values[pos * mc->int_count];
+    r->data = &mc->data[pos * mc->buf_size];
+    r->lengths = &mc->lengths[pos];
+    return count;
+}
+
+// Release records obtained from msgcapture_peek()
+void __visible
+msgcapture_release(struct msgcapture *mc, int count)
+{
+    __atomic_store_n(&mc->tail, mc->tail + count, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,44 @@
+#ifndef MSGDECODE_H
+#define MSGDECODE_H
+
+#include <stdint.h> // int64_t
+
+#define MSGDECODE_MAX_PARAMS 16
+
+enum {
+    MDT_UINT32, MDT_INT32, MDT_UINT16, MDT_INT16, MDT_BYTE, MDT_BUFFER,
+};
+
+struct msgdecode_record {
+    int msgid, param_count;
+    double sent_time, receive_time;
+    int64_t params[MSGDECODE_MAX_PARAMS];
+};
+
+struct msgcapture_region {
+    int count, int_count, buf_size;
+    uint32_t dropped;
+    double *times;
+    int64_t *values;
+    uint8_t *data, *lengths;
+};
+
+struct pull_queue_message;
+struct msgdecoder *msgdecode_alloc(void);
+void msgdecode_free(struct msgdecoder *md);
+int msgdecode_set_format(struct msgdecoder *md, int msgid
+                         , uint8_t *types, int count);
+int msgdecode_parse(struct msgdecoder *md, uint8_t *msg, int len
+                    , struct msgdecode_record *rec);
+void msgdecode_batch(struct msgdecoder *md, struct pull_queue_message *pqm
+                     , int count, struct msgdecode_record *out);
+struct msgcapture *msgcapture_alloc(int msgid, uint8_t *types, int count
+                                    , int oid_index, int oid, int buf_size
+                                    , int size);
+void msgcapture_free(struct msgcapture *mc);
+int msgcapture_check(struct msgcapture *mc, uint8_t *msg, int len
+                     , double receive_time);
+int msgcapture_peek(struct msgcapture *mc, struct msgcapture_region *r);
+void msgcapture_release(struct msgcapture *mc, int count);
+
+#endif // msgdecode.h
@@ -11,9 +11,16 @@
 // transmitted, schedules transmission of commands at specified mcu
 // clock times, prioritizes commands, and handles retransmissions.  A
 // background thread is launched to do this work and minimize latency.
+// Messages may be carried on a serial port (or pseudo-tty) byte stream
+// or, for mcus attached via a CAN bus, split into Linux SocketCAN
+// frames.
 
+#include <errno.h> // EAGAIN
 #include <fcntl.h> // fcntl
+#include <linux/can.h> // struct can_frame
+#include <linux/can/raw.h> // CAN_RAW_FILTER
 #include <math.h> // ceil
+#include <net/if.h> // if_nametoindex
 #include <poll.h> // poll
 #include <pthread.h> // pthread_mutex_lock
 #include <stddef.h> // offsetof
@@ -21,10 +28,13 @@
 #include <stdio.h> // snprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include <sys/socket.h> // socket
 #include <termios.h> // tcflush
 #include <unistd.h> // pipe
+#include "binlog.h" // binlog_write
 #include "compiler.h" // __visible
 #include "list.h" // list_add_tail
+#include "msgdecode.h" // msgcapture_check
 #include "pyhelper.h" // get_monotonic
 #include "serialqueue.h" // struct queue_message
 
@@ -279,6 +289,10 @@ f4: *p++ = v & 0x7f;
 struct command_queue {
     struct list_head stalled_queue, ready_queue;
     struct list_node node;
+    int priority;
+    // Messages on the send_ring (or send_overflow_queue) not yet
+    // moved to stalled_queue by the background thread
+    int in_flight;
 };
 
 // Allocate a 'struct queue_message' object
@@ -341,25 +355,110 @@ message_queue_free(struct list_head *root)
 }
 
 
+/****************************************************************
+ * Single producer single consumer rings
+ ****************************************************************/
+
+// A lock-free ring of message pointers used to pass messages between
+// the host threads and the background thread.  Only the producer
+// updates 'head' and only the consumer updates 'tail' - the two are
+// kept in separate cache lines so that the threads do not contend on
+// the same line.
+struct sq_ring {
+    uint32_t head __aligned(64);
+    uint32_t tail __aligned(64);
+    uint32_t mask;
+    struct queue_message **items;
+};
+
+// Allocate the storage of a ring ('size' must be a power of two)
+static void
+ring_init(struct sq_ring *r, int size)
+{
+    r->head = r->tail = 0;
+    r->mask = size - 1;
+    r->items = malloc(size * sizeof(*r->items));
+}
+
+// Add a message to the ring (producer only).  Returns -1 if full.
+static int
+ring_push(struct sq_ring *r, struct queue_message *qm)
+{
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > r->mask)
+        return -1;
+    r->items[head & r->mask] = qm;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Remove the oldest message from the ring (consumer only).  Returns
+// NULL if the ring is empty.
+static struct queue_message *
+ring_pop(struct sq_ring *r)
+{
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return NULL;
+    struct queue_message *qm = r->items[tail & r->mask];
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return qm;
+}
+
+// Check if the ring is empty (consumer only)
+static int
+ring_empty(struct sq_ring *r)
+{
+    return (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE)
+            == __atomic_load_n(&r->tail, __ATOMIC_RELAXED));
+}
+
+// Free a ring along with any messages still on it
+static void
+ring_free(struct sq_ring *r)
+{
+    struct queue_message *qm;
+    while ((qm = ring_pop(r)))
+        message_free(qm);
+    free(r->items);
+}
+
+
 /****************************************************************
  * Serialqueue interface
  ****************************************************************/
 
+// Block transmit modes (for statistics)
+#define SQM_DIRECT   0
+#define SQM_COALESCE 1
+#define SQM_NUM      2
+
+#define SQ_MAX_CAPTURES 8
+
 struct serialqueue {
     // Input reading
     struct pollreactor pr;
     int serial_fd;
+    char serial_fd_type;
+    uint32_t client_id;
     int pipe_fds[2];
     uint8_t input_buf[4096];
     uint8_t need_sync;
     int input_pos;
+    // Message handoff (see serialqueue_send_batch / serialqueue_pull)
+    struct sq_ring send_ring, receive_ring;
+    pthread_mutex_t send_lock; // serializes send_ring producers
+    int send_overflow;
+    pthread_mutex_t debug_lock; // protects old_receive
     // Threading
     pthread_t tid;
     pthread_mutex_t lock; // protects variables below
     pthread_cond_t cond;
     int receive_waiting;
     // Baud / clock tracking
-    int receive_window;
+    int receive_window, priority_reserve, send_window;
     double baud_adjust, idle_time;
     double est_freq, last_clock_time;
     uint64_t last_clock;
@@ -372,16 +471,31 @@ struct serialqueue {
     // Pending transmission message queues
     struct list_head pending_queues;
     int ready_bytes, stalled_bytes, need_ack_bytes, last_ack_bytes;
+    int priority_ready_bytes;
     uint64_t need_kick_clock;
     struct list_head notify_queue;
-    // Received messages
-    struct list_head receive_queue;
+    // Messages that did not fit on the send_ring / receive_ring
+    struct list_head send_overflow_queue, receive_queue;
+    // Bulk sensor messages stored directly in capture buffers
+    struct msgcapture *captures[SQ_MAX_CAPTURES];
+    int capture_count;
     // Debugging
     struct list_head old_sent, old_receive;
+    struct binlog *binlog;
+    int binlog_source;
     // Stats
     uint32_t bytes_write, bytes_read, bytes_retransmit, bytes_invalid;
+    uint32_t lock_count, lock_contended, kick_count, wake_count, ring_full;
+    uint32_t lane_msgs[SQ_PRIORITY_NUM];
+    double lane_latency[SQ_PRIORITY_NUM], lane_latency_max[SQ_PRIORITY_NUM];
+    uint32_t mode_blocks[SQM_NUM], mode_bytes[SQM_NUM];
+    double mode_latency[SQM_NUM];
 };
 
+#define SQT_UART 'u'
+#define SQT_CAN 'c'
+#define SQT_DEBUGFILE 'f'
+
 #define SQPF_SERIAL 0
 #define SQPF_PIPE   1
 #define SQPF_NUM    2
@@ -395,10 +509,14 @@ struct serialqueue {
 #define MIN_REQTIME_DELTA 0.250
 #define MIN_BACKGROUND_DELTA 0.005
 #define IDLE_QUERY_TIME 1.0
+#define COALESCE_BLOCKS 2
 
 #define DEBUG_QUEUE_SENT 100
 #define DEBUG_QUEUE_RECEIVE 100
 
+#define SEND_RING_SIZE 4096
+#define RECEIVE_RING_SIZE 1024
+
 // Create a series of empty messages and add them to a list
 static void
 debug_queue_alloc(struct list_head *root, int count)
@@ -421,12 +539,31 @@ debug_queue_add(struct list_head *root, struct queue_message *qm)
     message_free(old);
 }
 
+// Acquire sq->lock and track how often it was already held by the
+// other thread
+static void
+sq_lock(struct serialqueue *sq)
+{
+    if (pthread_mutex_trylock(&sq->lock)) {
+        pthread_mutex_lock(&sq->lock);
+        sq->lock_contended++;
+    }
+    sq->lock_count++;
+}
+
+static void
+sq_unlock(struct serialqueue *sq)
+{
+    pthread_mutex_unlock(&sq->lock);
+}
+
 // Wake up the receiver thread if it is waiting
 static void
 check_wake_receive(struct serialqueue *sq)
 {
     if (sq->receive_waiting) {
         sq->receive_waiting = 0;
+        sq->wake_count++;
         pthread_cond_signal(&sq->cond);
     }
 }
@@ -435,11 +572,26 @@ check_wake_receive(struct serialqueue *sq)
 static void
 kick_bg_thread(struct serialqueue *sq)
 {
+    __atomic_fetch_add(&sq->kick_count, 1, __ATOMIC_RELAXED);
     int ret = write(sq->pipe_fds[1], ".", 1);
     if (ret < 0)
         report_errno("pipe write", ret);
 }
 
+// Pass a received message to the serialqueue_pull() thread (must be
+// called with sq->lock held)
+static void
+queue_receive(struct serialqueue *sq, struct queue_message *qm)
+{
+    if (list_empty(&sq->receive_queue)) {
+        if (!ring_push(&sq->receive_ring, qm))
+            return;
+        // Ring is full - hold messages until the reader catches up
+        sq->ring_full++;
+    }
+    list_add_tail(&qm->node, &sq->receive_queue);
+}
+
 // Update internal state when the receive sequence increases
 static void
 update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
@@ -469,6 +621,13 @@ update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
     sq->receive_seq = rseq;
     pollreactor_update_timer(&sq->pr, SQPT_COMMAND, PR_NOW);
 
+    // Grow the in-flight window back towards the mcu receive window
+    if (sq->send_window < sq->receive_window) {
+        sq->send_window += MESSAGE_MIN;
+        if (sq->send_window > sq->receive_window)
+            sq->send_window = sq->receive_window;
+    }
+
     // Update retransmit info
     if (sq->rtt_sample_seq && rseq > sq->rtt_sample_seq
         && sq->last_receive_sent_time) {
@@ -501,6 +660,21 @@ update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
     }
 }
 
+// Store a data message in a matching bulk capture (if any)
+static int
+check_captures(struct serialqueue *sq, int len)
+{
+    if (!sq->capture_count)
+        return 0;
+    double receive_time = get_monotonic() - sq->baud_adjust * len;
+    int i;
+    for (i=0; i<sq->capture_count; i++)
+        if (msgcapture_check(sq->captures[i], sq->input_buf, len
+                             , receive_time))
+            return 1;
+    return 0;
+}
+
 // Process a well formed input message
 static void
 handle_message(struct serialqueue *sq, double eventtime, int len)
@@ -528,7 +702,7 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
         qm->len = 0;
         qm->sent_time = sq->last_receive_sent_time;
         qm->receive_time = eventtime;
-        list_add_tail(&qm->node, &sq->receive_queue);
+        queue_receive(sq, qm);
         must_wake = 1;
     }
 
@@ -540,14 +714,14 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
         else if (rseq > sq->ignore_nak_seq && !list_empty(&sq->sent_queue))
             // Duplicate Ack is a Nak - do fast retransmit
             pollreactor_update_timer(&sq->pr, SQPT_RETRANSMIT, PR_NOW);
-    } else {
+    } else if (!check_captures(sq, len)) {
         // Data message - add to receive queue
         struct queue_message *qm = message_fill(sq->input_buf, len);
         qm->sent_time = (rseq > sq->retransmit_seq
                          ? sq->last_receive_sent_time : 0.);
         qm->receive_time = get_monotonic(); // must be time post read()
         qm->receive_time -= sq->baud_adjust * len;
-        list_add_tail(&qm->node, &sq->receive_queue);
+        queue_receive(sq, qm);
         must_wake = 1;
     }
 
@@ -555,12 +729,68 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
         check_wake_receive(sq);
 }
 
+// Read the data of any pending CAN frames sent by the mcu.  Returns
+// the number of bytes read (which may be zero if only frames for other
+// nodes were available) or -1 on error.
+static int
+read_canbus(struct serialqueue *sq, uint8_t *buf, int maxlen)
+{
+    int pos = 0;
+    while (maxlen - pos >= CAN_MAX_DLEN) {
+        struct can_frame cf;
+        int ret = read(sq->serial_fd, &cf, sizeof(cf));
+        if (ret < 0 && errno == EAGAIN)
+            break;
+        if (ret != sizeof(cf) || cf.can_dlc > CAN_MAX_DLEN)
+            return -1;
+        if (cf.can_id != sq->client_id + 1)
+            // Frame for another node
+            continue;
+        memcpy(&buf[pos], cf.data, cf.can_dlc);
+        pos += cf.can_dlc;
+    }
+    return pos;
+}
+
+// Write a block of data to the serial fd.  On a CAN bus the data is
+// split into frames of up to eight bytes; the mcu reassembles the
+// byte stream so block framing, acks, and retransmits are unchanged.
+static int
+do_write(struct serialqueue *sq, uint8_t *buf, int buflen)
+{
+    if (sq->serial_fd_type != SQT_CAN)
+        return write(sq->serial_fd, buf, buflen);
+    struct can_frame cf;
+    memset(&cf, 0, sizeof(cf));
+    cf.can_id = sq->client_id;
+    int pos = 0;
+    while (pos < buflen) {
+        int len = buflen - pos;
+        if (len > CAN_MAX_DLEN)
+            len = CAN_MAX_DLEN;
+        cf.can_dlc = len;
+        memcpy(cf.data, &buf[pos], len);
+        int ret = write(sq->serial_fd, &cf, sizeof(cf));
+        if (ret < 0)
+            return ret;
+        pos += len;
+    }
+    return buflen;
+}
+
 // Callback for input activity on the serial fd
 static void
 input_event(struct serialqueue *sq, double eventtime)
 {
-    int ret = read(sq->serial_fd, &sq->input_buf[sq->input_pos]
-                   , sizeof(sq->input_buf) - sq->input_pos);
+    uint8_t *buf = &sq->input_buf[sq->input_pos];
+    int maxlen = sizeof(sq->input_buf) - sq->input_pos, ret;
+    if (sq->serial_fd_type == SQT_CAN) {
+        ret = read_canbus(sq, buf, maxlen);
+        if (!ret)
+            return;
+    } else {
+        ret = read(sq->serial_fd, buf, maxlen);
+    }
     if (ret <= 0) {
         report_errno("read", ret);
         pollreactor_do_exit(&sq->pr);
@@ -574,16 +804,19 @@ input_event(struct serialqueue *sq, double eventtime)
             return;
         if (ret > 0) {
             // Received a valid message
-            pthread_mutex_lock(&sq->lock);
+            sq_lock(sq);
+            if (sq->binlog)
+                binlog_write(sq->binlog, BLR_RECEIVE, sq->binlog_source
+                             , eventtime, sq->input_buf, ret);
             handle_message(sq, eventtime, ret);
             sq->bytes_read += ret;
-            pthread_mutex_unlock(&sq->lock);
+            sq_unlock(sq);
         } else {
             // Skip bad data at beginning of input
             ret = -ret;
-            pthread_mutex_lock(&sq->lock);
+            sq_lock(sq);
             sq->bytes_invalid += ret;
-            pthread_mutex_unlock(&sq->lock);
+            sq_unlock(sq);
         }
         sq->input_pos -= ret;
         if (sq->input_pos)
@@ -606,11 +839,14 @@ kick_event(struct serialqueue *sq, double eventtime)
 static double
 retransmit_event(struct serialqueue *sq, double eventtime)
 {
-    int ret = tcflush(sq->serial_fd, TCOFLUSH);
-    if (ret < 0)
-        report_errno("tcflush", ret);
+    int ret;
+    if (sq->serial_fd_type == SQT_UART) {
+        ret = tcflush(sq->serial_fd, TCOFLUSH);
+        if (ret < 0)
+            report_errno("tcflush", ret);
+    }
 
-    pthread_mutex_lock(&sq->lock);
+    sq_lock(sq);
 
     // Retransmit all pending messages
     uint8_t buf[MESSAGE_MAX * MESSAGE_SEQ_MASK + 1];
@@ -623,9 +859,12 @@ retransmit_event(struct serialqueue *sq, double eventtime)
         if (!first_buflen)
             first_buflen = qm->len + 1;
     }
-    ret = write(sq->serial_fd, buf, buflen);
+    ret = do_write(sq, buf, buflen);
     if (ret < 0)
         report_errno("retransmit write", ret);
+    if (sq->binlog)
+        binlog_write(sq->binlog, BLR_RETRANSMIT, sq->binlog_source
+                     , eventtime, buf, buflen);
     sq->bytes_retransmit += buflen;
 
     // Update rto
@@ -645,35 +884,81 @@ retransmit_event(struct serialqueue *sq, double eventtime)
     sq->retransmit_seq = sq->send_seq;
     sq->rtt_sample_seq = 0;
     sq->idle_time = eventtime + buflen * sq->baud_adjust;
+
+    // Data was lost - halve the in-flight window
+    int min_window = MESSAGE_MAX + sq->priority_reserve;
+    sq->send_window /= 2;
+    if (sq->send_window < min_window)
+        sq->send_window = min_window;
+    if (sq->send_window > sq->receive_window)
+        sq->send_window = sq->receive_window;
     double waketime = eventtime + first_buflen * sq->baud_adjust + sq->rto;
 
-    pthread_mutex_unlock(&sq->lock);
+    sq_unlock(sq);
     return waketime;
 }
 
+// Check if the receive window of the mcu permits sending a block of
+// 'len' bytes from the given priority class.  Bulk messages may not
+// use the portion of the window reserved for high priority messages.
+// The usable window (send_window) starts at the receive buffer size
+// advertised by the mcu and is reduced after retransmits.
+static int
+check_send_window(struct serialqueue *sq, int priority, int len)
+{
+    int seq_reserve = 0, window_reserve = 0;
+    if (priority == SQ_PRIORITY_BULK && sq->priority_reserve) {
+        seq_reserve = 1;
+        window_reserve = sq->priority_reserve;
+    }
+    if (sq->send_seq - sq->receive_seq >= MESSAGE_SEQ_MASK - seq_reserve
+        && sq->receive_seq != (uint64_t)-1)
+        // Need an ack before more messages can be sent
+        return 0;
+    if (sq->send_seq > sq->receive_seq && sq->send_window) {
+        int need_ack_bytes = sq->need_ack_bytes + len;
+        if (sq->last_ack_seq < sq->receive_seq)
+            need_ack_bytes += sq->last_ack_bytes;
+        if (need_ack_bytes > sq->send_window - window_reserve)
+            // Wait for ack from past messages before sending next message
+            return 0;
+    }
+    return 1;
+}
+
 // Construct a block of data and send to the serial port
 static void
 build_and_send_command(struct serialqueue *sq, double eventtime)
 {
     struct queue_message *out = message_alloc();
     out->len = MESSAGE_HEADER_SIZE;
+    int msg_count = 0;
+    double block_latency = 0.;
 
-    while (sq->ready_bytes) {
-        // Find highest priority message (message with lowest req_clock)
+    int bulk_ok = check_send_window(sq, SQ_PRIORITY_BULK, MESSAGE_MAX);
+    for (;;) {
+        // Find highest priority message (message from the highest
+        // priority class with lowest req_clock)
         uint64_t min_clock = MAX_CLOCK;
+        int priority = -1;
         struct command_queue *q, *cq = NULL;
         struct queue_message *qm = NULL;
         list_for_each_entry(q, &sq->pending_queues, node) {
-            if (!list_empty(&q->ready_queue)) {
-                struct queue_message *m = list_first_entry(
-                    &q->ready_queue, struct queue_message, node);
-                if (m->req_clock < min_clock) {
-                    min_clock = m->req_clock;
-                    cq = q;
-                    qm = m;
-                }
+            if (list_empty(&q->ready_queue)
+                || (q->priority == SQ_PRIORITY_BULK && !bulk_ok))
+                continue;
+            struct queue_message *m = list_first_entry(
+                &q->ready_queue, struct queue_message, node);
+            if (q->priority > priority
+                || (q->priority == priority && m->req_clock < min_clock)) {
+                priority = q->priority;
+                min_clock = m->req_clock;
+                cq = q;
+                qm = m;
             }
         }
+        if (!qm)
+            break;
         // Append message to outgoing command
         if (out->len + qm->len > sizeof(out->msg) - MESSAGE_TRAILER_SIZE)
             break;
@@ -683,6 +968,16 @@ build_and_send_command(struct serialqueue *sq, double eventtime)
         memcpy(&out->msg[out->len], qm->msg, qm->len);
         out->len += qm->len;
         sq->ready_bytes -= qm->len;
+        if (priority != SQ_PRIORITY_BULK)
+            sq->priority_ready_bytes -= qm->len;
+        // Update per priority class latency stats
+        double latency = eventtime - qm->ready_time;
+        sq->lane_msgs[priority]++;
+        sq->lane_latency[priority] += latency;
+        msg_count++;
+        block_latency += latency;
+        if (latency > sq->lane_latency_max[priority])
+            sq->lane_latency_max[priority] = latency;
         if (qm->notify_id) {
             // Message requires notification - add to notify list
             qm->req_clock = sq->send_seq;
@@ -703,10 +998,18 @@ build_and_send_command(struct serialqueue *sq, double eventtime)
     out->msg[out->len - MESSAGE_TRAILER_SYNC] = MESSAGE_SYNC;
 
     // Send message
-    int ret = write(sq->serial_fd, out->msg, out->len);
+    int ret = do_write(sq, out->msg, out->len);
     if (ret < 0)
         report_errno("write", ret);
+    if (sq->binlog)
+        binlog_write(sq->binlog, BLR_SENT, sq->binlog_source, eventtime
+                     , out->msg, out->len);
     sq->bytes_write += out->len;
+    int mode = eventtime < sq->idle_time ? SQM_COALESCE : SQM_DIRECT;
+    sq->mode_blocks[mode]++;
+    sq->mode_bytes[mode] += out->len;
+    if (msg_count)
+        sq->mode_latency[mode] += block_latency / msg_count;
     if (eventtime > sq->idle_time)
         sq->idle_time = eventtime;
     sq->idle_time += out->len * sq->baud_adjust;
@@ -722,22 +1025,56 @@ build_and_send_command(struct serialqueue *sq, double eventtime)
     list_add_tail(&out->node, &sq->sent_queue);
 }
 
+// Add a message from serialqueue_send_batch() to its command queue
+static void
+queue_stalled(struct serialqueue *sq, struct queue_message *qm)
+{
+    struct command_queue *cq = qm->cq;
+    if (list_empty(&cq->ready_queue) && list_empty(&cq->stalled_queue))
+        list_add_tail(&cq->node, &sq->pending_queues);
+    list_add_tail(&qm->node, &cq->stalled_queue);
+    sq->stalled_bytes += qm->len;
+    __atomic_sub_fetch(&cq->in_flight, 1, __ATOMIC_RELEASE);
+}
+
+// Collect the messages handed over by serialqueue_send_batch()
+static void
+drain_send_ring(struct serialqueue *sq)
+{
+    struct queue_message *qm;
+    while ((qm = ring_pop(&sq->send_ring)))
+        queue_stalled(sq, qm);
+    if (!__atomic_load_n(&sq->send_overflow, __ATOMIC_ACQUIRE))
+        return;
+    // The producer stops using the ring while the overflow queue is in
+    // use, so anything still on the ring is older than the overflow
+    while ((qm = ring_pop(&sq->send_ring)))
+        queue_stalled(sq, qm);
+    while (!list_empty(&sq->send_overflow_queue)) {
+        qm = list_first_entry(&sq->send_overflow_queue
+                              , struct queue_message, node);
+        list_del(&qm->node);
+        queue_stalled(sq, qm);
+    }
+    __atomic_store_n(&sq->send_overflow, 0, __ATOMIC_RELEASE);
+}
+
+// Check if serialqueue_send_batch() has queued messages not yet seen
+// by drain_send_ring()
+static int
+check_send_pending(struct serialqueue *sq)
+{
+    return (!ring_empty(&sq->send_ring)
+            || __atomic_load_n(&sq->send_overflow, __ATOMIC_ACQUIRE));
+}
+
 // Determine the time the next serial data should be sent
 static double
 check_send_command(struct serialqueue *sq, double eventtime)
 {
-    if (sq->send_seq - sq->receive_seq >= MESSAGE_SEQ_MASK
-        && sq->receive_seq != (uint64_t)-1)
-        // Need an ack before more messages can be sent
+    drain_send_ring(sq);
+    if (!check_send_window(sq, SQ_PRIORITY_HIGH, MESSAGE_MIN + 1))
         return PR_NEVER;
-    if (sq->send_seq > sq->receive_seq && sq->receive_window) {
-        int need_ack_bytes = sq->need_ack_bytes + MESSAGE_MAX;
-        if (sq->last_ack_seq < sq->receive_seq)
-            need_ack_bytes += sq->last_ack_bytes;
-        if (need_ack_bytes > sq->receive_window)
-            // Wait for ack from past messages before sending next message
-            return PR_NEVER;
-    }
 
     // Check for stalled messages now ready
     double idletime = eventtime > sq->idle_time ? eventtime : sq->idle_time;
@@ -759,8 +1096,11 @@ check_send_command(struct serialqueue *sq, double eventtime)
             }
             list_del(&qm->node);
             list_add_tail(&qm->node, &cq->ready_queue);
+            qm->ready_time = eventtime;
             sq->stalled_bytes -= qm->len;
             sq->ready_bytes += qm->len;
+            if (cq->priority != SQ_PRIORITY_BULK)
+                sq->priority_ready_bytes += qm->len;
         }
         // Update min_ready_clock
         if (!list_empty(&cq->ready_queue)) {
@@ -777,13 +1117,34 @@ check_send_command(struct serialqueue *sq, double eventtime)
         }
     }
 
+    // High priority messages are sent as soon as they are ready
+    if (sq->priority_ready_bytes) {
+        int len = MESSAGE_MIN + sq->priority_ready_bytes;
+        if (len > MESSAGE_MAX)
+            len = MESSAGE_MAX;
+        if (check_send_window(sq, SQ_PRIORITY_HIGH, len))
+            return PR_NOW;
+    }
+    if (!check_send_window(sq, SQ_PRIORITY_BULK, MESSAGE_MAX))
+        return PR_NEVER;
+
     // Check for messages to send
     if (sq->ready_bytes >= MESSAGE_PAYLOAD_MAX)
         return PR_NOW;
+    double coalesce_time = (sq->idle_time
+                            - COALESCE_BLOCKS * MESSAGE_MAX * sq->baud_adjust);
+    if (sq->ready_bytes && eventtime < coalesce_time) {
+        // The serial port is still busy with earlier blocks, so sending
+        // a partial block now would not deliver it any sooner.  Wait
+        // until the port is nearly idle so that more messages may be
+        // packed into the block.
+        __atomic_store_n(&sq->need_kick_clock, MAX_CLOCK, __ATOMIC_RELAXED);
+        return coalesce_time;
+    }
     if (! sq->est_freq) {
         if (sq->ready_bytes)
             return PR_NOW;
-        sq->need_kick_clock = MAX_CLOCK;
+        __atomic_store_n(&sq->need_kick_clock, MAX_CLOCK, __ATOMIC_RELAXED);
         return PR_NEVER;
     }
     uint64_t reqclock_delta = MIN_REQTIME_DELTA * sq->est_freq;
@@ -792,7 +1153,7 @@ check_send_command(struct serialqueue *sq, double eventtime)
     uint64_t wantclock = min_ready_clock - reqclock_delta;
     if (min_stalled_clock < wantclock)
         wantclock = min_stalled_clock;
-    sq->need_kick_clock = wantclock;
+    __atomic_store_n(&sq->need_kick_clock, wantclock, __ATOMIC_RELAXED);
     return idletime + (wantclock - ack_clock) / sq->est_freq;
 }
 
@@ -800,15 +1161,21 @@ check_send_command(struct serialqueue *sq, double eventtime)
 static double
 command_event(struct serialqueue *sq, double eventtime)
 {
-    pthread_mutex_lock(&sq->lock);
+    sq_lock(sq);
     double waketime;
     for (;;) {
         waketime = check_send_command(sq, eventtime);
-        if (waketime != PR_NOW)
+        if (waketime == PR_NOW) {
+            build_and_send_command(sq, eventtime);
+            continue;
+        }
+        // A producer that read need_kick_clock before it was updated
+        // above may not have kicked - recheck for new messages
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!check_send_pending(sq))
             break;
-        build_and_send_command(sq, eventtime);
     }
-    pthread_mutex_unlock(&sq->lock);
+    sq_unlock(sq);
     return waketime;
 }
 
@@ -819,23 +1186,31 @@ background_thread(void *data)
     struct serialqueue *sq = data;
     pollreactor_run(&sq->pr);
 
-    pthread_mutex_lock(&sq->lock);
+    sq_lock(sq);
     check_wake_receive(sq);
-    pthread_mutex_unlock(&sq->lock);
+    sq_unlock(sq);
 
     return NULL;
 }
 
-// Create a new 'struct serialqueue' object
+// Create a new 'struct serialqueue' object.  The serial_fd_type is
+// 'u' for a serial port, 'c' for a CAN socket (where client_id is the
+// CAN id used to transmit), or 'f' for a write only debug file.
 struct serialqueue * __visible
-serialqueue_alloc(int serial_fd, int write_only)
+serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
 {
-    struct serialqueue *sq = malloc(sizeof(*sq));
+    struct serialqueue *sq;
+    int ret = posix_memalign((void**)&sq, __alignof__(*sq), sizeof(*sq));
+    if (ret)
+        goto fail;
     memset(sq, 0, sizeof(*sq));
 
     // Reactor setup
+    int write_only = serial_fd_type == SQT_DEBUGFILE;
     sq->serial_fd = serial_fd;
-    int ret = pipe(sq->pipe_fds);
+    sq->serial_fd_type = serial_fd_type;
+    sq->client_id = client_id;
+    ret = pipe(sq->pipe_fds);
     if (ret)
         goto fail;
     pollreactor_setup(&sq->pr, SQPF_NUM, SQPT_NUM, sq);
@@ -862,8 +1237,11 @@ serialqueue_alloc(int serial_fd, int write_only)
     sq->need_kick_clock = MAX_CLOCK;
     list_init(&sq->pending_queues);
     list_init(&sq->sent_queue);
+    list_init(&sq->send_overflow_queue);
     list_init(&sq->receive_queue);
     list_init(&sq->notify_queue);
+    ring_init(&sq->send_ring, SEND_RING_SIZE);
+    ring_init(&sq->receive_ring, RECEIVE_RING_SIZE);
 
     // Debugging
     list_init(&sq->old_sent);
@@ -873,6 +1251,12 @@ serialqueue_alloc(int serial_fd, int write_only)
 
     // Thread setup
     ret = pthread_mutex_init(&sq->lock, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_mutex_init(&sq->send_lock, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_mutex_init(&sq->debug_lock, NULL);
     if (ret)
         goto fail;
     ret = pthread_cond_init(&sq->cond, NULL);
@@ -908,7 +1292,10 @@ serialqueue_free(struct serialqueue *sq)
         return;
     if (!pollreactor_is_exit(&sq->pr))
         serialqueue_exit(sq);
-    pthread_mutex_lock(&sq->lock);
+    sq_lock(sq);
+    ring_free(&sq->send_ring);
+    ring_free(&sq->receive_ring);
+    message_queue_free(&sq->send_overflow_queue);
     message_queue_free(&sq->sent_queue);
     message_queue_free(&sq->receive_queue);
     message_queue_free(&sq->notify_queue);
@@ -921,7 +1308,7 @@ serialqueue_free(struct serialqueue *sq)
         message_queue_free(&cq->ready_queue);
         message_queue_free(&cq->stalled_queue);
     }
-    pthread_mutex_unlock(&sq->lock);
+    sq_unlock(sq);
     pollreactor_free(&sq->pr);
     free(sq);
 }
@@ -937,53 +1324,86 @@ serialqueue_alloc_commandqueue(void)
     return cq;
 }
 
+// Set the priority class of a 'struct command_queue' (must be called
+// before any messages are added to the queue)
+void __visible
+serialqueue_set_commandqueue_priority(struct command_queue *cq, int priority)
+{
+    if (priority < SQ_PRIORITY_BULK || priority >= SQ_PRIORITY_NUM) {
+        errorf("Invalid commandqueue priority %d", priority);
+        return;
+    }
+    cq->priority = priority;
+}
+
 // Free a 'struct command_queue'
 void __visible
 serialqueue_free_commandqueue(struct command_queue *cq)
 {
     if (!cq)
         return;
-    if (!list_empty(&cq->ready_queue) || !list_empty(&cq->stalled_queue)) {
+    if (__atomic_load_n(&cq->in_flight, __ATOMIC_ACQUIRE)
+        || !list_empty(&cq->ready_queue) || !list_empty(&cq->stalled_queue)) {
         errorf("Memory leak! Can't free non-empty commandqueue");
         return;
     }
     free(cq);
 }
 
-// Add a batch of messages to the given command_queue
+// Add a batch of messages to the given command_queue.  The messages
+// are handed to the background thread via the lock-free send_ring
+// (sq->lock is only taken if the ring fills).
 void
 serialqueue_send_batch(struct serialqueue *sq, struct command_queue *cq
                        , struct list_head *msgs)
 {
     // Make sure min_clock is set in list and calculate total bytes
-    int len = 0;
+    int len = 0, count = 0;
     struct queue_message *qm;
     list_for_each_entry(qm, msgs, node) {
         if (qm->min_clock + (1LL<<31) < qm->req_clock
             && qm->req_clock != BACKGROUND_PRIORITY_CLOCK)
             qm->min_clock = qm->req_clock - (1LL<<31);
+        qm->cq = cq;
         len += qm->len;
+        count++;
     }
     if (! len)
         return;
+    __atomic_add_fetch(&cq->in_flight, count, __ATOMIC_RELAXED);
     qm = list_first_entry(msgs, struct queue_message, node);
+    uint64_t min_clock = qm->min_clock;
 
-    // Add list to cq->stalled_queue
-    pthread_mutex_lock(&sq->lock);
-    if (list_empty(&cq->ready_queue) && list_empty(&cq->stalled_queue))
-        list_add_tail(&cq->node, &sq->pending_queues);
-    list_join_tail(msgs, &cq->stalled_queue);
-    sq->stalled_bytes += len;
-    int mustwake = 0;
-    if (qm->min_clock < sq->need_kick_clock) {
-        sq->need_kick_clock = 0;
-        mustwake = 1;
+    // Pass messages to the background thread
+    pthread_mutex_lock(&sq->send_lock);
+    while (!list_empty(msgs)) {
+        qm = list_first_entry(msgs, struct queue_message, node);
+        list_del(&qm->node);
+        if (__atomic_load_n(&sq->send_overflow, __ATOMIC_RELAXED)
+            || ring_push(&sq->send_ring, qm)) {
+            // Ring is full - queue remaining messages under sq->lock
+            list_add_head(&qm->node, msgs);
+            sq_lock(sq);
+            list_join_tail(msgs, &sq->send_overflow_queue);
+            if (!__atomic_load_n(&sq->send_overflow, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&sq->send_overflow, 1, __ATOMIC_RELEASE);
+                sq->ring_full++;
+            }
+            sq_unlock(sq);
+            list_init(msgs);
+        }
     }
-    pthread_mutex_unlock(&sq->lock);
-
-    // Wake the background thread if necessary
-    if (mustwake)
+    pthread_mutex_unlock(&sq->send_lock);
+
+    // Wake the background thread if it may be sleeping past the
+    // transmit time of these messages (pairs with command_event)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t need_kick_clock = __atomic_load_n(&sq->need_kick_clock
+                                               , __ATOMIC_RELAXED);
+    if (min_clock < need_kick_clock || cq->priority != SQ_PRIORITY_BULK) {
+        __atomic_store_n(&sq->need_kick_clock, 0, __ATOMIC_RELAXED);
         kick_bg_thread(sq);
+    }
 }
 
 // Schedule the transmission of a message on the serial port at a
@@ -1004,60 +1424,152 @@ serialqueue_send(struct serialqueue *sq, struct command_queue *cq, uint8_t *msg
     serialqueue_send_batch(sq, cq, &msgs);
 }
 
-// Return a message read from the serial port (or wait for one if none
-// available)
-void __visible
-serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm)
+// Copy a received message to a pull_queue_message
+static void
+pull_receive(struct queue_message *qm, struct pull_queue_message *pqm)
 {
-    pthread_mutex_lock(&sq->lock);
-    // Wait for message to be available
-    while (list_empty(&sq->receive_queue)) {
-        if (pollreactor_is_exit(&sq->pr))
-            goto exit;
-        sq->receive_waiting = 1;
-        int ret = pthread_cond_wait(&sq->cond, &sq->lock);
-        if (ret)
-            report_errno("pthread_cond_wait", ret);
-    }
-
-    // Remove message from queue
-    struct queue_message *qm = list_first_entry(
-        &sq->receive_queue, struct queue_message, node);
-    list_del(&qm->node);
-
-    // Copy message
     memcpy(pqm->msg, qm->msg, qm->len);
     pqm->len = qm->len;
     pqm->sent_time = qm->sent_time;
     pqm->receive_time = qm->receive_time;
     pqm->notify_id = qm->notify_id;
-    if (qm->len)
-        debug_queue_add(&sq->old_receive, qm);
-    else
-        message_free(qm);
+}
 
-    pthread_mutex_unlock(&sq->lock);
-    return;
+// Return up to 'max' messages read from the serial port (or wait for
+// one if none available).  Returns the number of messages stored in
+// 'pqm' or -1 if the serialqueue is exiting.  Messages are taken from
+// the lock-free receive_ring - sq->lock is only taken when the ring
+// is empty.
+int __visible
+serialqueue_pull_batch(struct serialqueue *sq, struct pull_queue_message *pqm
+                       , int max)
+{
+    struct list_head done;
+    list_init(&done);
+    int count = 0;
+    for (;;) {
+        struct queue_message *qm;
+        while (count < max && (qm = ring_pop(&sq->receive_ring))) {
+            pull_receive(qm, &pqm[count++]);
+            list_add_tail(&qm->node, &done);
+        }
+        if (count >= max)
+            break;
+        // Check for overflow messages or wait for new messages
+        sq_lock(sq);
+        if (!ring_empty(&sq->receive_ring)) {
+            sq_unlock(sq);
+            continue;
+        }
+        while (count < max && !list_empty(&sq->receive_queue)) {
+            qm = list_first_entry(&sq->receive_queue
+                                  , struct queue_message, node);
+            list_del(&qm->node);
+            pull_receive(qm, &pqm[count++]);
+            list_add_tail(&qm->node, &done);
+        }
+        if (count) {
+            sq_unlock(sq);
+            break;
+        }
+        if (pollreactor_is_exit(&sq->pr)) {
+            sq_unlock(sq);
+            return -1;
+        }
+        sq->receive_waiting = 1;
+        int ret = pthread_cond_wait(&sq->cond, &sq->lock);
+        if (ret)
+            report_errno("pthread_cond_wait", ret);
+        sq_unlock(sq);
+    }
 
-exit:
-    pqm->len = -1;
-    pthread_mutex_unlock(&sq->lock);
+    // Move consumed messages to the debug queue
+    pthread_mutex_lock(&sq->debug_lock);
+    while (!list_empty(&done)) {
+        struct queue_message *qm = list_first_entry(
+            &done, struct queue_message, node);
+        list_del(&qm->node);
+        if (qm->len)
+            debug_queue_add(&sq->old_receive, qm);
+        else
+            message_free(qm);
+    }
+    pthread_mutex_unlock(&sq->debug_lock);
+    return count;
+}
+
+// Return a message read from the serial port (or wait for one if none
+// available)
+void __visible
+serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm)
+{
+    if (serialqueue_pull_batch(sq, pqm, 1) < 0)
+        pqm->len = -1;
 }
 
 void __visible
 serialqueue_set_baud_adjust(struct serialqueue *sq, double baud_adjust)
 {
-    pthread_mutex_lock(&sq->lock);
+    sq_lock(sq);
     sq->baud_adjust = baud_adjust;
-    pthread_mutex_unlock(&sq->lock);
+    sq_unlock(sq);
 }
 
 void __visible
 serialqueue_set_receive_window(struct serialqueue *sq, int receive_window)
 {
-    pthread_mutex_lock(&sq->lock);
-    sq->receive_window = receive_window;
-    pthread_mutex_unlock(&sq->lock);
+    sq_lock(sq);
+    sq->receive_window = sq->send_window = receive_window;
+    sq_unlock(sq);
+}
+
+// Set the number of bytes of the mcu receive window (and one sequence
+// number) that are reserved for high priority messages
+void __visible
+serialqueue_set_priority_reserve(struct serialqueue *sq, int reserve)
+{
+    sq_lock(sq);
+    sq->priority_reserve = reserve;
+    sq_unlock(sq);
+}
+
+// Log all blocks sent and received to a binary log (NULL to disable)
+void __visible
+serialqueue_set_binlog(struct serialqueue *sq, struct binlog *bl, int source)
+{
+    sq_lock(sq);
+    sq->binlog = bl;
+    sq->binlog_source = source;
+    sq_unlock(sq);
+}
+
+// Store received messages matching a bulk capture in its buffers
+// instead of passing them to serialqueue_pull()
+int __visible
+serialqueue_add_capture(struct serialqueue *sq, struct msgcapture *mc)
+{
+    int ret = -1;
+    sq_lock(sq);
+    if (sq->capture_count < SQ_MAX_CAPTURES) {
+        sq->captures[sq->capture_count++] = mc;
+        ret = 0;
+    }
+    sq_unlock(sq);
+    return ret;
+}
+
+// Stop storing messages in a bulk capture
+void __visible
+serialqueue_remove_capture(struct serialqueue *sq, struct msgcapture *mc)
+{
+    sq_lock(sq);
+    int i;
+    for (i=0; i<sq->capture_count; i++)
+        if (sq->captures[i] == mc) {
+            sq->captures[i] = sq->captures[--sq->capture_count];
+            break;
+        }
+    sq_unlock(sq);
 }
 
 // Set the estimated clock rate of the mcu on the other end of the
@@ -1066,11 +1578,38 @@ void __visible
 serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
                           , double last_clock_time, uint64_t last_clock)
 {
-    pthread_mutex_lock(&sq->lock);
+    sq_lock(sq);
     sq->est_freq = est_freq;
     sq->last_clock_time = last_clock_time;
     sq->last_clock = last_clock;
-    pthread_mutex_unlock(&sq->lock);
+    sq_unlock(sq);
+}
+
+// Return the average ready to transmit latency of a priority class
+static double
+lane_latency(struct serialqueue *sq, int priority)
+{
+    if (!sq->lane_msgs[priority])
+        return 0.;
+    return sq->lane_latency[priority] / sq->lane_msgs[priority];
+}
+
+// Return the average size of blocks sent in a transmit mode
+static double
+mode_fill(struct serialqueue *sq, int mode)
+{
+    if (!sq->mode_blocks[mode])
+        return 0.;
+    return (double)sq->mode_bytes[mode] / sq->mode_blocks[mode];
+}
+
+// Return the average ready to transmit latency of a transmit mode
+static double
+mode_latency(struct serialqueue *sq, int mode)
+{
+    if (!sq->mode_blocks[mode])
+        return 0.;
+    return sq->mode_latency[mode] / sq->mode_blocks[mode];
 }
 
 // Return a string buffer containing statistics for the serial port
@@ -1078,21 +1617,42 @@ void __visible
 serialqueue_get_stats(struct serialqueue *sq, char *buf, int len)
 {
     struct serialqueue stats;
-    pthread_mutex_lock(&sq->lock);
+    sq_lock(sq);
     memcpy(&stats, sq, sizeof(stats));
-    pthread_mutex_unlock(&sq->lock);
+    sq_unlock(sq);
 
     snprintf(buf, len, "bytes_write=%u bytes_read=%u"
              " bytes_retransmit=%u bytes_invalid=%u"
              " send_seq=%u receive_seq=%u retransmit_seq=%u"
              " srtt=%.3f rttvar=%.3f rto=%.3f"
              " ready_bytes=%u stalled_bytes=%u"
+             " bulk_msgs=%u bulk_latency=%.6f bulk_latency_max=%.6f"
+             " priority_msgs=%u priority_latency=%.6f"
+             " priority_latency_max=%.6f"
+             " lock_count=%u lock_contended=%u kicks=%u wakes=%u"
+             " ring_full=%u send_window=%d"
+             " direct_blocks=%u direct_fill=%.1f direct_latency=%.6f"
+             " coalesce_blocks=%u coalesce_fill=%.1f coalesce_latency=%.6f"
              , stats.bytes_write, stats.bytes_read
              , stats.bytes_retransmit, stats.bytes_invalid
              , (int)stats.send_seq, (int)stats.receive_seq
              , (int)stats.retransmit_seq
              , stats.srtt, stats.rttvar, stats.rto
-             , stats.ready_bytes, stats.stalled_bytes);
+             , stats.ready_bytes, stats.stalled_bytes
+             , stats.lane_msgs[SQ_PRIORITY_BULK]
+             , lane_latency(&stats, SQ_PRIORITY_BULK)
+             , stats.lane_latency_max[SQ_PRIORITY_BULK]
+             , stats.lane_msgs[SQ_PRIORITY_HIGH]
+             , lane_latency(&stats, SQ_PRIORITY_HIGH)
+             , stats.lane_latency_max[SQ_PRIORITY_HIGH]
+             , stats.lock_count, stats.lock_contended
+             , stats.kick_count, stats.wake_count, stats.ring_full
+             , stats.send_window
+             , stats.mode_blocks[SQM_DIRECT], mode_fill(&stats, SQM_DIRECT)
+             , mode_latency(&stats, SQM_DIRECT)
+             , stats.mode_blocks[SQM_COALESCE]
+             , mode_fill(&stats, SQM_COALESCE)
+             , mode_latency(&stats, SQM_COALESCE));
 }
 
 // Extract old messages stored in the debug queues
@@ -1108,11 +1668,12 @@ serialqueue_extract_old(struct serialqueue *sq, int sentq
     list_init(&current);
 
     // Atomically replace existing debug list with new zero'd list
-    pthread_mutex_lock(&sq->lock);
+    pthread_mutex_t *lock = sentq ? &sq->lock : &sq->debug_lock;
+    pthread_mutex_lock(lock);
     list_join_tail(rootp, &current);
     list_init(rootp);
     list_join_tail(&replacement, rootp);
-    pthread_mutex_unlock(&sq->lock);
+    pthread_mutex_unlock(lock);
 
     // Walk the debug list
     int pos = 0;
@@ -1141,3 +1702,51 @@ force_retransmit(struct serialqueue *sq)
     if (t != PR_NEVER && t > get_monotonic() + 0.01)
         pollreactor_update_timer(&sq->pr, SQPT_RETRANSMIT, PR_NOW);
 }
+
+
+/****************************************************************
+ * CAN bus sockets
+ ****************************************************************/
+
+// Open a raw SocketCAN socket on the network interface 'iface' that
+// only receives frames with the standard ids listed in 'rx_ids'.
+// Returns the socket fd or -1 on error.
+int __visible
+serialqueue_open_canbus(const char *iface, uint32_t *rx_ids, int count)
+{
+    int fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (fd < 0) {
+        report_errno("can socket", fd);
+        return -1;
+    }
+    struct can_filter filters[count];
+    int i;
+    for (i=0; i<count; i++) {
+        filters[i].can_id = rx_ids[i];
+        filters[i].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+    }
+    int ret = setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, filters
+                         , count * sizeof(filters[0]));
+    if (ret < 0) {
+        report_errno("can filter", ret);
+        goto fail;
+    }
+    struct sockaddr_can addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = if_nametoindex(iface);
+    if (!addr.can_ifindex) {
+        errorf("Unknown CAN interface '%s'", iface);
+        goto fail;
+    }
+    ret = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    if (ret < 0) {
+        report_errno("can bind", ret);
+        goto fail;
+    }
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
@@ -19,6 +19,10 @@
 #define MESSAGE_DEST 0x10
 #define MESSAGE_SYNC 0x7E
 
+#define SQ_PRIORITY_BULK 0
+#define SQ_PRIORITY_HIGH 1
+#define SQ_PRIORITY_NUM  2
+
 struct queue_message {
     int len;
     uint8_t msg[MESSAGE_MAX];
@@ -26,6 +30,8 @@ struct queue_message {
         // Filled when on a command queue
         struct {
             uint64_t min_clock, req_clock;
+            double ready_time;
+            struct command_queue *cq;
         };
         // Filled when in sent/receive queues
         struct {
@@ -47,24 +53,38 @@ struct pull_queue_message {
 };
 
 struct serialqueue;
-struct serialqueue *serialqueue_alloc(int serial_fd, int write_only);
+struct serialqueue *serialqueue_alloc(int serial_fd, char serial_fd_type
+                                     , int client_id);
 void serialqueue_exit(struct serialqueue *sq);
 void serialqueue_free(struct serialqueue *sq);
 struct command_queue *serialqueue_alloc_commandqueue(void);
 void serialqueue_free_commandqueue(struct command_queue *cq);
+void serialqueue_set_commandqueue_priority(struct command_queue *cq
+                                           , int priority);
 void serialqueue_send_batch(struct serialqueue *sq, struct command_queue *cq
                             , struct list_head *msgs);
 void serialqueue_send(struct serialqueue *sq, struct command_queue *cq
                       , uint8_t *msg, int len, uint64_t min_clock
                       , uint64_t req_clock, uint64_t notify_id);
 void serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm);
+int serialqueue_pull_batch(struct serialqueue *sq
+                           , struct pull_queue_message *pqm, int max);
 void serialqueue_set_baud_adjust(struct serialqueue *sq, double baud_adjust);
 void serialqueue_set_receive_window(struct serialqueue *sq, int receive_window);
+void serialqueue_set_priority_reserve(struct serialqueue *sq, int reserve);
+struct binlog;
+void serialqueue_set_binlog(struct serialqueue *sq, struct binlog *bl
+                            , int source);
+struct msgcapture;
+int serialqueue_add_capture(struct serialqueue *sq, struct msgcapture *mc);
+void serialqueue_remove_capture(struct serialqueue *sq
+                                , struct msgcapture *mc);
 void serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
                                , double last_clock_time, uint64_t last_clock);
 void serialqueue_get_stats(struct serialqueue *sq, char *buf, int len);
 int serialqueue_extract_old(struct serialqueue *sq, int sentq
                             , struct pull_queue_message *q, int max);
 void force_retransmit(struct serialqueue *sq);
+int serialqueue_open_canbus(const char *iface, uint32_t *rx_ids, int count);
 
 #endif // serialqueue.h
@@ -19,6 +19,9 @@
 #include <stdio.h> // fprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // __m256i
+#endif
 #include "compiler.h" // DIV_ROUND_UP
 #include "pyhelper.h" // errorf
 #include "serialqueue.h" // struct queue_message
@@ -45,7 +48,7 @@ struct stepcompress {
 
 
 /****************************************************************
- * Step compression
+ * Step time bounds
  ****************************************************************/
 
 static inline int32_t
@@ -77,6 +80,308 @@ minmax_point(struct stepcompress *sc, uint32_t *pos)
     return (struct points){ point - max_error, point };
 }
 
+
+
+/****************************************************************
+ * Vectorized point range checking
+ ****************************************************************/
+
+// The inner loop of compress_bisect_add() walks the step queue and
+// narrows the range of valid intervals for a given 'add' one point
+// at a time, with an integer divide whenever a point narrows the
+// range.  On cpus with AVX2 the interval bounds of eight points are
+// calculated at once (the divides are done in double precision,
+// which is exact for these operands) along with their running
+// min/max.  The check_line() verification of each step_move is also
+// done several points at a time (with SSE2 or AVX2).  All of these
+// use the same wrapping 32bit integer math as the scalar code, so
+// the resulting step_move sequence is identical.
+
+typedef int32_t (*scan_points_fn)(struct stepcompress *sc, uint32_t *qlast
+                                  , int32_t count, int32_t add
+                                  , int32_t *mininterval
+                                  , int32_t *maxinterval);
+typedef uint32_t (*check_points_fn)(struct stepcompress *sc
+                                    , uint32_t interval, uint32_t count
+                                    , int32_t add);
+
+// Largest count for which 'count*(count-1)' fits in an int32_t
+#define SCAN_ADDFACTOR_MAX 46340
+
+// Table of 1/count used to avoid divides in the common case
+#define SCAN_RECIP_SIZE 2048
+static double scan_recip[SCAN_RECIP_SIZE];
+
+// Return the number of points that may be scanned
+static inline int32_t
+scan_limit(struct stepcompress *sc, uint32_t *qlast, int32_t add)
+{
+    int32_t maxcount = qlast - sc->queue_pos;
+    if (add && maxcount > SCAN_ADDFACTOR_MAX)
+        maxcount = SCAN_ADDFACTOR_MAX;
+    return maxcount;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+// Shift lanes up by 'n' filling with 'fill'
+#define AVX2_SHIFT(v, n, fill) _mm256_blend_epi32(                    \
+        _mm256_permutevar8x32_epi32((v), _mm256_set_epi32(            \
+            7-(n), 6-(n), 5-(n), 4-(n), 3-(n), 2-(n), 1-(n), 0))      \
+        , (fill), (1<<(n))-1)
+
+static __always_inline AVX2 __m256i
+avx2_prefix_max(__m256i v)
+{
+    __m256i fill = _mm256_set1_epi32(INT32_MIN);
+    v = _mm256_max_epi32(v, AVX2_SHIFT(v, 1, fill));
+    v = _mm256_max_epi32(v, AVX2_SHIFT(v, 2, fill));
+    return _mm256_max_epi32(v, AVX2_SHIFT(v, 4, fill));
+}
+
+static __always_inline AVX2 __m256i
+avx2_prefix_min(__m256i v)
+{
+    __m256i fill = _mm256_set1_epi32(INT32_MAX);
+    v = _mm256_min_epi32(v, AVX2_SHIFT(v, 1, fill));
+    v = _mm256_min_epi32(v, AVX2_SHIFT(v, 2, fill));
+    return _mm256_min_epi32(v, AVX2_SHIFT(v, 4, fill));
+}
+
+// Calculate ceil(n/d) and floor(m/d) for four lanes given the
+// reciprocal 'r' of 'd'
+static __always_inline AVX2 void
+avx2_div4(__m128i n, __m128i m, __m256d d, __m256d r
+          , __m128i *lo, __m128i *hi)
+{
+    __m256d one = _mm256_set1_pd(1.), dn = _mm256_cvtepi32_pd(n);
+    __m256d dm = _mm256_cvtepi32_pd(m);
+    __m256d qn = _mm256_ceil_pd(_mm256_mul_pd(dn, r));
+    __m256d qm = _mm256_floor_pd(_mm256_mul_pd(dm, r));
+    // The product may round past an exact quotient - correct for that
+    __m256d fixn = _mm256_cmp_pd(_mm256_mul_pd(_mm256_sub_pd(qn, one), d)
+                                 , dn, _CMP_GE_OQ);
+    __m256d fixm = _mm256_cmp_pd(_mm256_mul_pd(_mm256_add_pd(qm, one), d)
+                                 , dm, _CMP_LE_OQ);
+    qn = _mm256_sub_pd(qn, _mm256_and_pd(fixn, one));
+    qm = _mm256_add_pd(qm, _mm256_and_pd(fixm, one));
+    *lo = _mm256_cvttpd_epi32(qn);
+    *hi = _mm256_cvttpd_epi32(qm);
+}
+
+// Scan eight points per iteration using AVX2
+static int32_t AVX2
+scan_points_avx2(struct stepcompress *sc, uint32_t *qlast, int32_t count
+                 , int32_t add, int32_t *mininterval, int32_t *maxinterval)
+{
+    uint32_t *qpos = sc->queue_pos;
+    int32_t maxcount = scan_limit(sc, qlast, add);
+    __m256i vlsc = _mm256_set1_epi32((uint32_t)sc->last_step_clock);
+    __m256i vmaxerr = _mm256_set1_epi32(sc->max_error);
+    __m256i vadd = _mm256_set1_epi32(add), vone = _mm256_set1_epi32(1);
+    __m256i vstep = _mm256_set_epi32(8, 7, 6, 5, 4, 3, 2, 1);
+    while (count + 8 <= maxcount) {
+        // Points for counts count+1 .. count+8 (queue_pos[count..count+7])
+        __m256i vcount = _mm256_add_epi32(_mm256_set1_epi32(count), vstep);
+        __m256i cur = _mm256_loadu_si256((__m256i*)&qpos[count]);
+        __m256i prev = _mm256_loadu_si256((__m256i*)&qpos[count-1]);
+        __m256i point = _mm256_sub_epi32(cur, vlsc);
+        __m256i err = _mm256_min_epu32(
+            _mm256_srli_epi32(_mm256_sub_epi32(cur, prev), 1), vmaxerr);
+        __m256i addfactor = _mm256_srli_epi32(_mm256_mullo_epi32(
+            vcount, _mm256_sub_epi32(vcount, vone)), 1);
+        __m256i c = _mm256_mullo_epi32(vadd, addfactor);
+        __m256i minp = _mm256_sub_epi32(_mm256_sub_epi32(point, err), c);
+        __m256i maxp = _mm256_sub_epi32(point, c);
+        // Divide by count
+        __m256d dlo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(vcount));
+        __m256d dhi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(vcount, 1));
+        __m256d rlo, rhi;
+        if (count + 8 < SCAN_RECIP_SIZE) {
+            rlo = _mm256_loadu_pd(&scan_recip[count + 1]);
+            rhi = _mm256_loadu_pd(&scan_recip[count + 5]);
+        } else {
+            rlo = _mm256_div_pd(_mm256_set1_pd(1.), dlo);
+            rhi = _mm256_div_pd(_mm256_set1_pd(1.), dhi);
+        }
+        __m128i lo0, lo1, hi0, hi1;
+        avx2_div4(_mm256_castsi256_si128(minp), _mm256_castsi256_si128(maxp)
+                  , dlo, rlo, &lo0, &hi0);
+        avx2_div4(_mm256_extracti128_si256(minp, 1)
+                  , _mm256_extracti128_si256(maxp, 1), dhi, rhi, &lo1, &hi1);
+        __m256i lo = _mm256_inserti128_si256(_mm256_castsi128_si256(lo0)
+                                             , lo1, 1);
+        __m256i hi = _mm256_inserti128_si256(_mm256_castsi128_si256(hi0)
+                                             , hi1, 1);
+        // Running max/min of the bounds across the lanes
+        lo = _mm256_max_epi32(avx2_prefix_max(lo)
+                              , _mm256_set1_epi32(*mininterval));
+        hi = _mm256_min_epi32(avx2_prefix_min(hi)
+                              , _mm256_set1_epi32(*maxinterval));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_cmpgt_epi32(lo, hi)));
+        int num = mask ? __builtin_ctz(mask) : 8;
+        if (num) {
+            __m256i idx = _mm256_set1_epi32(num - 1);
+            *mininterval = _mm256_cvtsi256_si32(
+                _mm256_permutevar8x32_epi32(lo, idx));
+            *maxinterval = _mm256_cvtsi256_si32(
+                _mm256_permutevar8x32_epi32(hi, idx));
+        }
+        count += num;
+        if (num < 8)
+            break;
+    }
+    return count;
+}
+
+// Load the step time and interval of the first 'num' points of a
+// step_move.  The step time of point 'j' is interval*j +
+// add*j*(j-1)/2 and the interval used to reach it is
+// interval+add*(j-1).  Later points are advanced from these values
+// with additions only.
+static inline void
+check_points_start(uint32_t interval, int32_t add, int num
+                   , uint32_t *p, uint32_t *curinterval)
+{
+    uint32_t pos = 0;
+    int j;
+    for (j=0; j<num; j++) {
+        pos += interval;
+        p[j] = pos;
+        curinterval[j] = interval;
+        interval += add;
+    }
+}
+
+// Verify four points of a step_move per iteration using SSE2.
+// Returns the number of leading points known to be valid.
+static uint32_t SSE2
+check_points_sse2(struct stepcompress *sc, uint32_t interval, uint32_t count
+                  , int32_t add)
+{
+    uint32_t *qpos = sc->queue_pos, lsc = sc->last_step_clock, i = 0;
+    uint32_t bp[4], bint[4];
+    check_points_start(interval, add, 4, bp, bint);
+    __m128i p = _mm_loadu_si128((__m128i*)bp);
+    __m128i curinterval = _mm_loadu_si128((__m128i*)bint);
+    __m128i vlsc = _mm_set1_epi32(lsc);
+    __m128i vbias = _mm_set1_epi32(0x80000000);
+    __m128i vmaxerr = _mm_xor_si128(_mm_set1_epi32(sc->max_error), vbias);
+    __m128i vadd4 = _mm_set1_epi32(add * 4), vadd10 = _mm_set1_epi32(add * 10);
+    while (i + 4 <= count) {
+        __m128i cur = _mm_loadu_si128((__m128i*)&qpos[i]);
+        __m128i prev = (i ? _mm_loadu_si128((__m128i*)&qpos[i-1])
+                        : _mm_or_si128(_mm_slli_si128(cur, 4)
+                                       , _mm_cvtsi32_si128(lsc)));
+        __m128i err = _mm_srli_epi32(_mm_sub_epi32(cur, prev), 1);
+        __m128i berr = _mm_xor_si128(err, vbias);
+        __m128i errgt = _mm_cmpgt_epi32(berr, vmaxerr);
+        err = _mm_xor_si128(_mm_or_si128(_mm_and_si128(errgt, vmaxerr)
+                                         , _mm_andnot_si128(errgt, berr))
+                            , vbias);
+        __m128i point = _mm_sub_epi32(cur, vlsc);
+        __m128i minp = _mm_sub_epi32(point, err);
+        // Unsigned compare of p against the point bounds
+        __m128i biasp = _mm_xor_si128(p, vbias);
+        __m128i bad = _mm_or_si128(
+            _mm_cmpgt_epi32(_mm_xor_si128(minp, vbias), biasp)
+            , _mm_cmpgt_epi32(biasp, _mm_xor_si128(point, vbias)));
+        bad = _mm_or_si128(bad, curinterval);
+        if (_mm_movemask_ps(_mm_castsi128_ps(bad)))
+            break;
+        // Advance to the next four points
+        p = _mm_add_epi32(p, _mm_add_epi32(_mm_slli_epi32(curinterval, 2)
+                                           , vadd10));
+        curinterval = _mm_add_epi32(curinterval, vadd4);
+        i += 4;
+    }
+    return i;
+}
+
+// Verify eight points of a step_move per iteration using AVX2.
+// Returns the number of leading points known to be valid.
+static uint32_t AVX2
+check_points_avx2(struct stepcompress *sc, uint32_t interval, uint32_t count
+                  , int32_t add)
+{
+    uint32_t *qpos = sc->queue_pos, i = 0;
+    uint32_t bp[8], bint[8];
+    check_points_start(interval, add, 8, bp, bint);
+    __m256i p = _mm256_loadu_si256((__m256i*)bp);
+    __m256i curinterval = _mm256_loadu_si256((__m256i*)bint);
+    __m256i vlsc = _mm256_set1_epi32((uint32_t)sc->last_step_clock);
+    __m256i vmaxerr = _mm256_set1_epi32(sc->max_error);
+    __m256i vadd8 = _mm256_set1_epi32(add * 8);
+    __m256i vadd36 = _mm256_set1_epi32(add * 36);
+    while (i + 8 <= count) {
+        __m256i cur = _mm256_loadu_si256((__m256i*)&qpos[i]);
+        __m256i prev = (i ? _mm256_loadu_si256((__m256i*)&qpos[i-1])
+                        : AVX2_SHIFT(cur, 1, vlsc));
+        __m256i err = _mm256_min_epu32(
+            _mm256_srli_epi32(_mm256_sub_epi32(cur, prev), 1), vmaxerr);
+        __m256i point = _mm256_sub_epi32(cur, vlsc);
+        __m256i minp = _mm256_sub_epi32(point, err);
+        // Unsigned compare of p against the point bounds
+        __m256i good = _mm256_and_si256(
+            _mm256_cmpeq_epi32(_mm256_max_epu32(p, minp), p)
+            , _mm256_cmpeq_epi32(_mm256_min_epu32(p, point), p));
+        __m256i bad = _mm256_or_si256(
+            _mm256_andnot_si256(good, _mm256_set1_epi32(-1)), curinterval);
+        if (_mm256_movemask_ps(_mm256_castsi256_ps(bad)))
+            break;
+        // Advance to the next eight points
+        p = _mm256_add_epi32(p, _mm256_add_epi32(
+                                 _mm256_slli_epi32(curinterval, 3), vadd36));
+        curinterval = _mm256_add_epi32(curinterval, vadd8);
+        i += 8;
+    }
+    return i;
+}
+
+#endif
+
+static scan_points_fn scan_points;
+static check_points_fn check_points;
+static int evaluator_type = -1;
+
+// Select the point range checker (or the best available if type < 0)
+int __visible
+stepcompress_set_evaluator(int type)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    int have_avx2 = __builtin_cpu_supports("avx2");
+    int have_sse2 = __builtin_cpu_supports("sse2");
+    if (type < 0 || type > SC_EVAL_AVX2)
+        type = SC_EVAL_AVX2;
+    if (type == SC_EVAL_AVX2 && !have_avx2)
+        type = SC_EVAL_SSE2;
+    if (type == SC_EVAL_SSE2 && !have_sse2)
+        type = SC_EVAL_SCALAR;
+    int i;
+    for (i=1; i<SCAN_RECIP_SIZE; i++)
+        scan_recip[i] = 1. / i;
+    scan_points = type == SC_EVAL_AVX2 ? scan_points_avx2 : NULL;
+    check_points = (type == SC_EVAL_AVX2 ? check_points_avx2
+                    : type == SC_EVAL_SSE2 ? check_points_sse2 : NULL);
+#else
+    type = SC_EVAL_SCALAR;
+    scan_points = NULL;
+    check_points = NULL;
+#endif
+    evaluator_type = type;
+    return type;
+}
+
+
+/****************************************************************
+ * Step compression
+ ****************************************************************/
+
 // The maximum add delta between two valid quadratic sequences of the
 // form "add*count*(count-1)/2 + interval*count" is "(6 + 4*sqrt(2)) *
 // maxerror / (count*count)".  The "6 + 4*sqrt(2)" is 11.65685, but
@@ -109,6 +414,11 @@ compress_bisect_add(struct stepcompress *sc)
         int32_t nextmaxinterval = outer_maxinterval, interval = nextmaxinterval;
         int32_t nextcount = 1;
         for (;;) {
+            if (scan_points) {
+                nextcount = scan_points(sc, qlast, nextcount, add
+                                        , &nextmininterval, &nextmaxinterval);
+                interval = nextmaxinterval;
+            }
             nextcount++;
             if (&sc->queue_pos[nextcount-1] >= qlast) {
                 int32_t count = nextcount - 1;
@@ -202,8 +512,15 @@ check_line(struct stepcompress *sc, struct step_move move)
         return ERROR_RET;
     }
     uint32_t interval = move.interval, p = 0;
-    uint16_t i;
-    for (i=0; i<move.count; i++) {
+    uint16_t i = 0;
+    if (check_points) {
+        // Continue after the points verified by the vectorized checker
+        uint32_t n = check_points(sc, move.interval, move.count, move.add);
+        p = move.interval*n + move.add*(n*(n-1)/2);
+        interval += move.add*n;
+        i = n;
+    }
+    for (; i<move.count; i++) {
         struct points point = minmax_point(sc, sc->queue_pos + i);
         p += interval;
         if (p < point.minp || p > point.maxp) {
@@ -238,6 +555,8 @@ stepcompress_alloc(uint32_t oid)
     list_init(&sc->msg_queue);
     sc->oid = oid;
     sc->sdir = -1;
+    if (evaluator_type < 0)
+        stepcompress_set_evaluator(-1);
     return sc;
 }
 
@@ -516,6 +835,77 @@ stepcompress_queue_msg(struct stepcompress *sc, uint32_t *data, int len)
 }
 
 
+/****************************************************************
+ * Step compress benchmarking
+ ****************************************************************/
+
+// Compress a list of absolute step clocks and store the resulting
+// (interval, count, add) triples in 'moves'.  A zero entry in
+// 'steps' ends a sequence (eg, on a direction change).  Returns the
+// number of moves generated.
+int __visible
+stepcompress_bench(uint32_t max_error, uint64_t start_clock
+                   , uint64_t *steps, int steps_count
+                   , int32_t *moves, int max_moves)
+{
+    struct stepcompress *sc = stepcompress_alloc(0);
+    sc->max_error = max_error;
+    sc->last_step_clock = start_clock;
+    sc->queue = malloc(sizeof(*sc->queue) * (steps_count + 1));
+    sc->queue_end = sc->queue + steps_count + 1;
+    int pos = 0, nmoves = 0, ret = 0;
+    while (pos < steps_count) {
+        if (!steps[pos]) {
+            pos++;
+            continue;
+        }
+        if (nmoves >= max_moves) {
+            ret = ERROR_RET;
+            break;
+        }
+        if (steps[pos] >= sc->last_step_clock + CLOCK_DIFF_MAX) {
+            // Step far in the future - emit it on its own
+            moves[nmoves*3] = steps[pos] - sc->last_step_clock;
+            moves[nmoves*3+1] = 1;
+            moves[nmoves*3+2] = 0;
+            nmoves++;
+            sc->last_step_clock = steps[pos++];
+            continue;
+        }
+        // Load the next sequence of steps
+        uint64_t last = sc->last_step_clock;
+        sc->queue_pos = sc->queue_next = sc->queue;
+        while (pos < steps_count && steps[pos]
+               && steps[pos] < last + CLOCK_DIFF_MAX) {
+            last = steps[pos++];
+            *sc->queue_next++ = last;
+        }
+        // Compress it
+        while (sc->queue_pos < sc->queue_next) {
+            struct step_move move = compress_bisect_add(sc);
+            ret = check_line(sc, move);
+            if (ret)
+                goto done;
+            if (nmoves >= max_moves) {
+                ret = ERROR_RET;
+                goto done;
+            }
+            moves[nmoves*3] = move.interval;
+            moves[nmoves*3+1] = move.count;
+            moves[nmoves*3+2] = move.add;
+            nmoves++;
+            int32_t addfactor = move.count*(move.count-1)/2;
+            uint32_t ticks = move.add*addfactor + move.interval*move.count;
+            sc->last_step_clock += ticks;
+            sc->queue_pos += move.count;
+        }
+    }
+done:
+    stepcompress_free(sc);
+    return ret ? ret : nmoves;
+}
+
+
 /****************************************************************
  * Step compress synchronization
  ****************************************************************/
@@ -537,6 +927,10 @@ struct steppersync {
     // Storage for list of pending move clocks
     uint64_t *move_clocks;
     int num_move_clocks;
+    // Number of moves sent and number of moves the mcu reported freed
+    uint64_t moves_sent, moves_freed;
+    uint32_t last_moves_freed;
+    int have_moves_freed;
 };
 
 // Allocate a new 'steppersync' object
@@ -609,6 +1003,41 @@ heap_replace(struct steppersync *ss, uint64_t req_clock)
     }
 }
 
+static int
+cmp_move_clock(const void *a, const void *b)
+{
+    uint64_t ca = *(uint64_t*)a, cb = *(uint64_t*)b;
+    return ca < cb ? -1 : ca > cb;
+}
+
+// Note the running (32bit) count of moves freed by the mcu.  Moves
+// that were freed before the clock they were expected to become
+// available at (eg, after a stepper stop) can be reused immediately.
+void __visible
+steppersync_set_moves_freed(struct steppersync *ss, uint32_t moves_freed)
+{
+    if (!ss->have_moves_freed) {
+        // Moves freed before the first report are not counted
+        ss->have_moves_freed = 1;
+        ss->last_moves_freed = moves_freed;
+        return;
+    }
+    ss->moves_freed += moves_freed - ss->last_moves_freed;
+    ss->last_moves_freed = moves_freed;
+    // Only the last num_move_clocks moves sent can still be in use
+    int64_t nmc = ss->num_move_clocks;
+    int64_t freed = ss->moves_freed + nmc - ss->moves_sent;
+    if (freed <= 0)
+        return;
+    if (freed > nmc)
+        freed = nmc;
+    // A sorted array is a valid heap - mark the earliest entries free
+    qsort(ss->move_clocks, nmc, sizeof(*ss->move_clocks), cmp_move_clock);
+    int i;
+    for (i=0; i<freed; i++)
+        ss->move_clocks[i] = 0;
+}
+
 // Find and transmit any scheduled steps prior to the given 'move_clock'
 int __visible
 steppersync_flush(struct steppersync *ss, uint64_t move_clock)
@@ -643,11 +1072,13 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock)
             break;
 
         uint64_t next_avail = ss->move_clocks[0];
-        if (qm->min_clock)
+        if (qm->min_clock) {
             // The qm->min_clock field is overloaded to indicate that
             // the command uses the 'move queue' and to store the time
             // that move queue item becomes available.
             heap_replace(ss, qm->min_clock);
+            ss->moves_sent++;
+        }
         // Reset the min_clock to its normal meaning (minimum transmit time)
         qm->min_clock = next_avail;
 
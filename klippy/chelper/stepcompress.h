@@ -5,6 +5,10 @@
 
 #define ERROR_RET -989898989
 
+enum { SC_EVAL_SCALAR, SC_EVAL_SSE2, SC_EVAL_AVX2 };
+
+int stepcompress_set_evaluator(int type);
+
 struct stepcompress *stepcompress_alloc(uint32_t oid);
 void stepcompress_fill(struct stepcompress *sc, uint32_t max_error
                        , uint32_t invert_sdir, uint32_t queue_step_msgid
@@ -17,6 +21,9 @@ int stepcompress_append(struct stepcompress *sc, int sdir
 int stepcompress_commit(struct stepcompress *sc);
 int stepcompress_reset(struct stepcompress *sc, uint64_t last_step_clock);
 int stepcompress_queue_msg(struct stepcompress *sc, uint32_t *data, int len);
+int stepcompress_bench(uint32_t max_error, uint64_t start_clock
+                       , uint64_t *steps, int steps_count
+                       , int32_t *moves, int max_moves);
 
 struct serialqueue;
 struct steppersync *steppersync_alloc(
@@ -25,6 +32,8 @@ struct steppersync *steppersync_alloc(
 void steppersync_free(struct steppersync *ss);
 void steppersync_set_time(struct steppersync *ss, double time_offset
                           , double mcu_freq);
+void steppersync_set_moves_freed(struct steppersync *ss
+                                 , uint32_t moves_freed);
 int steppersync_flush(struct steppersync *ss, uint64_t move_clock);
 
 #endif // stepcompress.h
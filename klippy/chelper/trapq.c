@@ -4,7 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <math.h> // sqrt
+#include <math.h> // sin
 #include <stddef.h> // offsetof
 #include <stdlib.h> // malloc
 #include <string.h> // memset
@@ -68,11 +68,139 @@ trapq_append(struct trapq *tq, double print_time
     }
 }
 
+// Add a move with a constant jerk to the queue and return its end
+// position.  The 'path' move provides the direction (and arc) fields.
+static struct coord
+append_jerk_move(struct trapq *tq, struct move *path, double print_time
+                 , double move_t, struct coord start_pos
+                 , double start_v, double accel, double jerk)
+{
+    struct move *m = move_alloc();
+    *m = *path;
+    m->print_time = print_time;
+    m->move_t = move_t;
+    m->start_v = start_v;
+    m->half_accel = .5 * accel;
+    m->sixth_jerk = jerk * (1. / 6.);
+    m->start_pos = start_pos;
+    trapq_add_move(tq, m);
+    return move_get_coord(m, move_t);
+}
+
+// Add the (up to) three moves of a jerk limited velocity change.  The
+// acceleration ramps linearly up to its peak during 'jerk_t', holds,
+// and then ramps linearly back down to zero during the final 'jerk_t'.
+static struct coord
+append_scurve_phase(struct trapq *tq, struct move *path, double print_time
+                    , double move_t, double jerk_t, struct coord start_pos
+                    , double start_v, double end_v)
+{
+    if (!jerk_t)
+        // Plain constant acceleration
+        return append_jerk_move(tq, path, print_time, move_t, start_pos
+                                , start_v, (end_v - start_v) / move_t, 0.);
+    double peak_accel = (end_v - start_v) / (move_t - jerk_t);
+    double jerk = peak_accel / jerk_t, jerk_dv = .5 * peak_accel * jerk_t;
+    start_pos = append_jerk_move(tq, path, print_time, jerk_t, start_pos
+                                 , start_v, 0., jerk);
+    print_time += jerk_t;
+    double const_t = move_t - 2. * jerk_t;
+    if (const_t > 0.) {
+        start_pos = append_jerk_move(tq, path, print_time, const_t
+                                     , start_pos, start_v + jerk_dv
+                                     , peak_accel, 0.);
+        print_time += const_t;
+    }
+    return append_jerk_move(tq, path, print_time, jerk_t, start_pos
+                            , end_v - jerk_dv, peak_accel, -jerk);
+}
+
+// Add the accel, cruise, and decel portions of a move along 'path'
+static void
+append_scurve(struct trapq *tq, struct move *path, double print_time
+              , double accel_t, double accel_jerk_t, double cruise_t
+              , double decel_t, double decel_jerk_t, struct coord start_pos
+              , double start_v, double cruise_v, double end_v)
+{
+    if (accel_t) {
+        start_pos = append_scurve_phase(tq, path, print_time, accel_t
+                                        , accel_jerk_t, start_pos
+                                        , start_v, cruise_v);
+        print_time += accel_t;
+    }
+    if (cruise_t) {
+        start_pos = append_jerk_move(tq, path, print_time, cruise_t
+                                     , start_pos, cruise_v, 0., 0.);
+        print_time += cruise_t;
+    }
+    if (decel_t)
+        append_scurve_phase(tq, path, print_time, decel_t, decel_jerk_t
+                            , start_pos, cruise_v, end_v);
+}
+
+// Fill and add a jerk limited (S-curve) move to the queue.  The
+// acceleration changes linearly during the 'accel_jerk_t' and
+// 'decel_jerk_t' ends of the accel and decel portions (the planner in
+// toolhead.py sizes the portions so both the accel and jerk limits
+// hold).
+void __visible
+trapq_append_scurve(struct trapq *tq, double print_time
+                    , double accel_t, double accel_jerk_t, double cruise_t
+                    , double decel_t, double decel_jerk_t
+                    , double start_pos_x, double start_pos_y
+                    , double start_pos_z
+                    , double axes_r_x, double axes_r_y, double axes_r_z
+                    , double start_v, double cruise_v, double end_v)
+{
+    struct coord start_pos = { .x=start_pos_x, .y=start_pos_y, .z=start_pos_z };
+    struct move path = { .axes_r = { .x=axes_r_x, .y=axes_r_y, .z=axes_r_z } };
+    append_scurve(tq, &path, print_time, accel_t, accel_jerk_t, cruise_t
+                  , decel_t, decel_jerk_t, start_pos
+                  , start_v, cruise_v, end_v);
+}
+
+// Fill and add a circular arc move (in the XY plane) to the queue.
+// The arc turns 'arc_angle_r' radians (positive is counter-clockwise)
+// around the given center for each mm of travel along the path, while
+// Z moves 'axis_r_z' mm per mm of travel.
+void __visible
+trapq_append_arc(struct trapq *tq, double print_time
+                 , double accel_t, double accel_jerk_t, double cruise_t
+                 , double decel_t, double decel_jerk_t
+                 , double start_pos_x, double start_pos_y, double start_pos_z
+                 , double arc_center_x, double arc_center_y
+                 , double arc_angle_r, double axis_r_z
+                 , double start_v, double cruise_v, double end_v)
+{
+    struct coord start_pos = { .x=start_pos_x, .y=start_pos_y, .z=start_pos_z };
+    struct move path = {
+        .axes_r = { .z=axis_r_z }, .arc_angle_r = arc_angle_r,
+        .arc_center_x = arc_center_x, .arc_center_y = arc_center_y };
+    append_scurve(tq, &path, print_time, accel_t, accel_jerk_t, cruise_t
+                  , decel_t, decel_jerk_t, start_pos
+                  , start_v, cruise_v, end_v);
+}
+
 // Return the distance moved given a time in a move
 inline double
 move_get_distance(struct move *m, double move_time)
 {
-    return (m->start_v + m->half_accel * move_time) * move_time;
+    return (m->start_v + (m->half_accel + m->sixth_jerk * move_time)
+            * move_time) * move_time;
+}
+
+// Return the XYZ coordinates of an arc move given a distance along it
+static struct coord
+move_get_arc_coord(struct move *m, double move_dist)
+{
+    double angle = m->arc_angle_r * move_dist;
+    double s = sin(angle), c = cos(angle);
+    double rx = m->start_pos.x - m->arc_center_x;
+    double ry = m->start_pos.y - m->arc_center_y;
+    return (struct coord) {
+        .x = m->arc_center_x + rx * c - ry * s,
+        .y = m->arc_center_y + rx * s + ry * c,
+        .z = m->start_pos.z + m->axes_r.z * move_dist };
 }
 
 // Return the XYZ coordinates given a time in a move
@@ -80,6 +208,8 @@ inline struct coord
 move_get_coord(struct move *m, double move_time)
 {
     double move_dist = move_get_distance(m, move_time);
+    if (unlikely(m->arc_angle_r))
+        return move_get_arc_coord(m, move_dist);
     return (struct coord) {
         .x = m->start_pos.x + m->axes_r.x * move_dist,
         .y = m->start_pos.y + m->axes_r.y * move_dist,
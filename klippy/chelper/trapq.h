@@ -14,8 +14,10 @@ struct coord {
 
 struct move {
     double print_time, move_t;
-    double start_v, half_accel;
+    double start_v, half_accel, sixth_jerk;
     struct coord start_pos, axes_r;
+    // Circular arc in the XY plane (arc_angle_r is zero on lines)
+    double arc_angle_r, arc_center_x, arc_center_y;
 
     struct list_node node;
 };
@@ -30,6 +32,22 @@ void trapq_append(struct trapq *tq, double print_time
                   , double start_pos_x, double start_pos_y, double start_pos_z
                   , double axes_r_x, double axes_r_y, double axes_r_z
                   , double start_v, double cruise_v, double accel);
+void trapq_append_scurve(struct trapq *tq, double print_time
+                         , double accel_t, double accel_jerk_t
+                         , double cruise_t
+                         , double decel_t, double decel_jerk_t
+                         , double start_pos_x, double start_pos_y
+                         , double start_pos_z
+                         , double axes_r_x, double axes_r_y, double axes_r_z
+                         , double start_v, double cruise_v, double end_v);
+void trapq_append_arc(struct trapq *tq, double print_time
+                      , double accel_t, double accel_jerk_t, double cruise_t
+                      , double decel_t, double decel_jerk_t
+                      , double start_pos_x, double start_pos_y
+                      , double start_pos_z
+                      , double arc_center_x, double arc_center_y
+                      , double arc_angle_r, double axis_r_z
+                      , double start_v, double cruise_v, double end_v);
 double move_get_distance(struct move *m, double move_time);
 struct coord move_get_coord(struct move *m, double move_time);
 struct trapq *trapq_alloc(void);
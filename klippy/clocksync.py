@@ -8,6 +8,9 @@ import logging, math
 RTT_AGE = .000010 / (60. * 60.)
 DECAY = 1. / 30.
 TRANSMIT_EXTRA = .001
+RTT_FILTER_TIME = .000200
+BURST_COUNT = 16
+BURST_INTERVAL = .020
 
 class ClockSync:
     def __init__(self, reactor):
@@ -16,6 +19,7 @@ class ClockSync:
         self.get_clock_timer = reactor.register_timer(self._get_clock_event)
         self.get_clock_cmd = self.cmd_queue = None
         self.queries_pending = 0
+        self.burst_remaining = 0
         self.mcu_freq = 1.
         self.last_clock = 0
         self.clock_est = (0., 0., 0.)
@@ -27,6 +31,7 @@ class ClockSync:
         self.clock_avg = self.clock_covariance = 0.
         self.prediction_variance = 0.
         self.last_prediction_time = 0.
+        self.sample_count = 0
     def connect(self, serial):
         self.serial = serial
         self.mcu_freq = serial.msgparser.get_constant_float('CLOCK_FREQ')
@@ -37,6 +42,7 @@ class ClockSync:
         self.time_avg = params['#sent_time']
         self.clock_est = (self.time_avg, self.clock_avg, self.mcu_freq)
         self.prediction_variance = (.001 * self.mcu_freq)**2
+        self.sample_count = 1
         # Enable periodic get_clock timer
         for i in range(8):
             self.reactor.pause(self.reactor.monotonic() + 0.050)
@@ -46,7 +52,7 @@ class ClockSync:
         self.get_clock_cmd = serial.get_msgparser().create_command('get_clock')
         self.cmd_queue = serial.alloc_command_queue()
         serial.register_response(self._handle_clock, 'clock')
-        self.reactor.update_timer(self.get_clock_timer, self.reactor.NOW)
+        self._start_burst(self.reactor.monotonic())
     def connect_file(self, serial, pace=False):
         self.serial = serial
         self.mcu_freq = serial.msgparser.get_constant_float('CLOCK_FREQ')
@@ -56,9 +62,16 @@ class ClockSync:
             freq = self.mcu_freq
         serial.set_clock_est(freq, self.reactor.monotonic(), 0)
     # MCU clock querying (_handle_clock is invoked from background thread)
+    def _start_burst(self, eventtime):
+        # Send a series of closely spaced queries to quickly converge
+        self.burst_remaining = BURST_COUNT
+        self.reactor.update_timer(self.get_clock_timer, self.reactor.NOW)
     def _get_clock_event(self, eventtime):
         self.serial.raw_send(self.get_clock_cmd, 0, 0, self.cmd_queue)
         self.queries_pending += 1
+        if self.burst_remaining:
+            self.burst_remaining -= 1
+            return eventtime + BURST_INTERVAL
         # Use an unusual time for the next event so clock messages
         # don't resonate with other periodic events.
         return eventtime + .9839
@@ -82,6 +95,13 @@ class ClockSync:
             self.min_rtt_time = sent_time
             logging.debug("new minimum rtt %.3f: hrtt=%.6f freq=%d",
                           sent_time, half_rtt, self.clock_est[2])
+        # Samples with a round-trip-time well above the minimum have an
+        # uncertain mcu sample time - reduce their weight.  Initial
+        # samples use a higher weight so that the regression converges
+        # quickly.
+        self.sample_count += 1
+        rtt_excess = (half_rtt - self.min_half_rtt) / RTT_FILTER_TIME
+        decay = max(DECAY, 1. / self.sample_count) / (1. + rtt_excess**2)
         # Filter out samples that are extreme outliers
         exp_clock = ((sent_time - self.time_avg) * self.clock_est[2]
                      + self.clock_avg)
@@ -102,19 +122,22 @@ class ClockSync:
         else:
             self.last_prediction_time = sent_time
             self.prediction_variance = (
-                (1. - DECAY) * (self.prediction_variance + clock_diff2 * DECAY))
+                (1. - decay) * (self.prediction_variance + clock_diff2 * decay))
         # Add clock and sent_time to linear regression
         diff_sent_time = sent_time - self.time_avg
-        self.time_avg += DECAY * diff_sent_time
-        self.time_variance = (1. - DECAY) * (
-            self.time_variance + diff_sent_time**2 * DECAY)
+        self.time_avg += decay * diff_sent_time
+        self.time_variance = (1. - decay) * (
+            self.time_variance + diff_sent_time**2 * decay)
         diff_clock = clock - self.clock_avg
-        self.clock_avg += DECAY * diff_clock
-        self.clock_covariance = (1. - DECAY) * (
-            self.clock_covariance + diff_sent_time * diff_clock * DECAY)
+        self.clock_avg += decay * diff_clock
+        self.clock_covariance = (1. - decay) * (
+            self.clock_covariance + diff_sent_time * diff_clock * decay)
         # Update prediction from linear regression
         new_freq = self.clock_covariance / self.time_variance
         pred_stddev = math.sqrt(self.prediction_variance)
+        # Only the 3*stddev margin depends on the clock estimate (and
+        # shrinks with it) - TRANSMIT_EXTRA covers the serial transmit
+        # time of a block, which a better estimate does not reduce
         self.serial.set_clock_est(new_freq, self.time_avg + TRANSMIT_EXTRA,
                                   int(self.clock_avg - 3. * pred_stddev))
         self.clock_est = (self.time_avg + self.min_half_rtt,
@@ -129,6 +152,8 @@ class ClockSync:
         self.serial.set_clock_est(self.clock_est[2],
                                   self.time_avg + TRANSMIT_EXTRA,
                                   int(self.clock_avg - 3. * pred_stddev))
+        # Invoked from the background thread - start burst from reactor
+        self.reactor.register_async_callback(self._start_burst)
     # clock frequency conversions
     def print_time_to_clock(self, print_time):
         return int(print_time * self.mcu_freq)
@@ -165,7 +190,9 @@ class ClockSync:
                     self.prediction_variance))
     def stats(self, eventtime):
         sample_time, clock, freq = self.clock_est
-        return "freq=%d" % (freq,)
+        return "freq=%d clock_stddev=%.6f hrtt=%.6f" % (
+            freq, math.sqrt(self.prediction_variance) / freq,
+            self.min_half_rtt)
     def calibrate_clock(self, print_time, eventtime):
         return (0., self.mcu_freq)
 
@@ -21,10 +21,28 @@ QUERY_RATES = {
 }
 
 SCALE = 0.004 * 9.80665 * 1000. # 4mg/LSB * Earth gravity in mm/s**2
+BYTES_PER_SAMPLE = 6
+SAMPLES_PER_BLOCK = 8
+MAX_RAW_SAMPLES = 300000
+DRAIN_TIME = .100
 
 Accel_Measurement = collections.namedtuple(
     'Accel_Measurement', ('time', 'accel_x', 'accel_y', 'accel_z'))
 
+# Raw adxl345_data messages read from a message capture
+class ADXL345RawArrays:
+    def __init__(self, np, chunks):
+        self.np = np
+        self.sequences = np.concatenate([c[0] for c in chunks])
+        self.data = np.concatenate([c[1] for c in chunks])
+        self.lengths = np.concatenate([c[2] for c in chunks])
+    def __len__(self):
+        return len(self.sequences)
+    def get_last_count(self):
+        return int(self.lengths[-1]) // BYTES_PER_SAMPLE
+    def get_actual_count(self):
+        return int((self.lengths // BYTES_PER_SAMPLE).sum())
+
 # Sample results
 class ADXL345Results:
     def __init__(self):
@@ -47,15 +65,39 @@ class ADXL345Results:
         self.start2_time = start2_time
         self.start_range = start2_time - start1_time
         self.end_range = end2_time - end1_time
-        self.total_count = (end_sequence - 1) * 8 + len(raw_samples[-1][1]) // 6
+        if isinstance(raw_samples, ADXL345RawArrays):
+            last_count = raw_samples.get_last_count()
+            actual_count = raw_samples.get_actual_count()
+        else:
+            last_count = len(raw_samples[-1][1]) // 6
+            actual_count = sum([len(data)//6 for _, data in raw_samples])
+        self.total_count = (end_sequence - 1) * 8 + last_count
         total_time = end2_time - start2_time
         self.time_per_sample = time_per_sample = total_time / self.total_count
         self.seq_to_time = time_per_sample * 8.
-        actual_count = sum([len(data)//6 for _, data in raw_samples])
         self.drops = self.total_count - actual_count
+    def _decode_arrays(self):
+        # Vectorized decoding of the raw messages (result is an array of
+        # time, accel_x, accel_y, accel_z rows)
+        raw = self.raw_samples
+        np = raw.np
+        sdata = raw.data.view('<i2').reshape(
+            len(raw), SAMPLES_PER_BLOCK, 3).astype(np.float64)
+        index = np.arange(SAMPLES_PER_BLOCK)
+        valid = index < (raw.lengths // BYTES_PER_SAMPLE)[:,None]
+        seq_time = self.start2_time + raw.sequences * self.seq_to_time
+        samp_time = seq_time[:,None] + index * self.time_per_sample
+        sdata = sdata[valid]
+        self.samples = samples = np.empty((len(sdata), 4))
+        samples[:,0] = samp_time[valid]
+        for i, (pos, scale) in enumerate(self.axes_map):
+            samples[:,i+1] = sdata[:,pos] * scale
+        return samples
     def decode_samples(self):
         if not self.raw_samples:
             return self.samples
+        if isinstance(self.raw_samples, ADXL345RawArrays):
+            return self._decode_arrays()
         (x_pos, x_scale), (y_pos, y_scale), (z_pos, z_scale) = self.axes_map
         actual_count = 0
         self.samples = samples = [None] * self.total_count
@@ -84,7 +126,9 @@ class ADXL345Results:
             f = open(filename, "w")
             f.write("##%s\n#time,accel_x,accel_y,accel_z\n" % (
                 self.get_stats(),))
-            samples = self.samples or self.decode_samples()
+            samples = self.samples
+            if not len(samples):
+                samples = self.decode_samples()
             for t, accel_x, accel_y, accel_z in samples:
                 f.write("%.6f,%.6f,%.6f,%.6f\n" % (
                     t, accel_x, accel_y, accel_z))
@@ -111,6 +155,12 @@ class ADXL345:
         # Measurement storage (accessed from background thread)
         self.raw_samples = []
         self.last_sequence = 0
+        # Measurements read from a message capture (if numpy is available)
+        self.capture = None
+        self.raw_chunks = []
+        self.raw_count = 0
+        self.drain_timer = self.printer.get_reactor().register_timer(
+            self._drain_capture)
         self.samples_start1 = self.samples_start2 = 0.
         # Setup mcu sensor_adxl345 bulk query code
         self.spi = bus.MCU_SPI_from_config(config, 3, default_speed=5000000)
@@ -123,7 +173,8 @@ class ADXL345:
                            % (oid,), on_restart=True)
         mcu.register_config_callback(self._build_config)
         mcu.register_response(self._handle_adxl345_start, "adxl345_start", oid)
-        mcu.register_response(self._handle_adxl345_data, "adxl345_data", oid)
+        mcu.register_bulk_response(self._handle_adxl345_data, "adxl345_data",
+                                   oid)
         # Register commands
         name = "default"
         if len(config.get_name().split()) > 1:
@@ -149,22 +200,49 @@ class ADXL345:
             "adxl345_end oid=%c end1_time=%u end2_time=%u"
             " limit_count=%hu sequence=%hu",
             oid=self.oid, cq=self.spi.get_command_queue())
+        self.capture = self.mcu.alloc_message_capture(
+            "adxl345_data", self.oid,
+            buf_size=BYTES_PER_SAMPLE * SAMPLES_PER_BLOCK)
     def _clock_to_print_time(self, clock):
         return self.mcu.clock_to_print_time(self.mcu.clock32_to_clock64(clock))
     def _handle_adxl345_start(self, params):
         self.samples_start1 = self._clock_to_print_time(params['start1_time'])
         self.samples_start2 = self._clock_to_print_time(params['start2_time'])
-    def _handle_adxl345_data(self, params):
+    def _handle_adxl345_data(self, msgs):
         last_sequence = self.last_sequence
-        sequence = (last_sequence & ~0xffff) | params['sequence']
-        if sequence < last_sequence:
-            sequence += 0x10000
-        self.last_sequence = sequence
         raw_samples = self.raw_samples
-        if len(raw_samples) >= 300000:
+        for receive_time, (oid, msg_sequence, data) in msgs:
+            sequence = (last_sequence & ~0xffff) | msg_sequence
+            if sequence < last_sequence:
+                sequence += 0x10000
+            last_sequence = sequence
+            if len(raw_samples) >= 300000:
+                # Avoid filling up memory with too many samples
+                continue
+            raw_samples.append((sequence, data))
+        self.last_sequence = last_sequence
+    def _drain_capture(self, eventtime):
+        np = self.capture.np
+        while 1:
+            times, values, data, lengths = self.capture.get_samples()
+            count = len(times)
+            if not count:
+                break
+            # Extend the 16bit message sequences
+            last_sequence = self.last_sequence
+            seq16 = values[:,1]
+            prev = np.concatenate(([last_sequence & 0xffff], seq16[:-1]))
+            wraps = np.cumsum(seq16 < prev)
+            sequences = (last_sequence & ~0xffff) + seq16 + wraps * 0x10000
+            self.last_sequence = int(sequences[-1])
             # Avoid filling up memory with too many samples
-            return
-        raw_samples.append((sequence, params['data']))
+            keep = min(count, MAX_RAW_SAMPLES - self.raw_count)
+            if keep > 0:
+                self.raw_chunks.append((sequences[:keep], data[:keep].copy(),
+                                        lengths[:keep].copy()))
+                self.raw_count += keep
+            self.capture.release(count)
+        return eventtime + DRAIN_TIME
     def _convert_sequence(self, sequence):
         sequence = (self.last_sequence & ~0xffff) | sequence
         if sequence < self.last_sequence:
@@ -190,8 +268,13 @@ class ADXL345:
         # Setup samples
         print_time = self.printer.lookup_object('toolhead').get_last_move_time()
         self.raw_samples = []
+        self.raw_chunks = []
+        self.raw_count = 0
         self.last_sequence = 0
         self.samples_start1 = self.samples_start2 = print_time
+        if self.capture is not None:
+            reactor = self.printer.get_reactor()
+            reactor.update_timer(self.drain_timer, reactor.NOW)
         # Start bulk reading
         reqclock = self.mcu.print_time_to_clock(print_time)
         rest_ticks = self.mcu.seconds_to_clock(4. / rate)
@@ -212,6 +295,15 @@ class ADXL345:
         self.query_rate = 0
         raw_samples = self.raw_samples
         self.raw_samples = []
+        if self.capture is not None:
+            reactor = self.printer.get_reactor()
+            reactor.update_timer(self.drain_timer, reactor.NEVER)
+            self._drain_capture(reactor.monotonic())
+            raw_samples = []
+            if self.raw_chunks:
+                raw_samples = ADXL345RawArrays(self.capture.np,
+                                               self.raw_chunks)
+            self.raw_chunks = []
         # Generate results
         end1_time = self._clock_to_print_time(params['end1_time'])
         end2_time = self._clock_to_print_time(params['end2_time'])
@@ -252,7 +344,7 @@ class ADXL345:
         self.start_measurements()
         reactor = self.printer.get_reactor()
         eventtime = starttime = reactor.monotonic()
-        while not self.raw_samples:
+        while not self.raw_samples and not self.raw_count:
             eventtime = reactor.pause(eventtime + .1)
             if eventtime > starttime + 3.:
                 # Try to shutdown the measurements
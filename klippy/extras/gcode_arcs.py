@@ -8,7 +8,9 @@
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import math
 
-# Coordinates created by this are converted into G1 commands.
+# Arcs are queued as native arc moves when the toolhead is not behind a
+# move transform. Otherwise the coordinates created by this are
+# converted into G1 commands.
 #
 # note: only IJ version available
 
@@ -42,6 +44,12 @@ class ArcSupport:
         asF = gcmd.get_float("F", None)
         clockwise = (gcmd.get_command() == 'G2')
 
+        if self.gcode_move.has_arc_move():
+            angle = self.calcAngularTravel(currentPos, [asX, asY, asZ],
+                                           [asI, asJ], clockwise)
+            self.gcode_move.arc_move(gcmd, [asI, asJ], angle)
+            return
+
         # Build list of linear coordinates to move to
         coords = self.planArc(currentPos, [asX, asY, asZ], [asI, asJ],
                               clockwise)
@@ -78,25 +86,12 @@ class ArcSupport:
         # Radius vector from center to current location
         r_P = -offset[0]
         r_Q = -offset[1]
-
-        # Determine angular travel
         center_P = currentPos[X_AXIS] - r_P
         center_Q = currentPos[Y_AXIS] - r_Q
-        rt_X = targetPos[X_AXIS] - center_P
-        rt_Y = targetPos[Y_AXIS] - center_Q
-        angular_travel = math.atan2(r_P * rt_Y - r_Q * rt_X,
-                                    r_P * rt_X + r_Q * rt_Y)
-        if angular_travel < 0.:
-            angular_travel += 2. * math.pi
-        if clockwise:
-            angular_travel -= 2. * math.pi
 
-        if (angular_travel == 0.
-            and currentPos[X_AXIS] == targetPos[X_AXIS]
-            and currentPos[Y_AXIS] == targetPos[Y_AXIS]):
-            # Make a circle if the angular rotation is 0 and the
-            # target is current position
-            angular_travel = 2. * math.pi
+        # Determine angular travel
+        angular_travel = self.calcAngularTravel(currentPos, targetPos,
+                                                offset, clockwise)
 
         # Determine number of segments
         linear_travel = targetPos[Z_AXIS] - currentPos[Z_AXIS]
@@ -125,5 +120,27 @@ class ArcSupport:
         coords.append(targetPos)
         return coords
 
+    # Return the signed angle (in radians, positive is counter-clockwise)
+    # swept by an arc around the center at 'offset' from currentPos
+    def calcAngularTravel(self, currentPos, targetPos, offset, clockwise):
+        r_P = -offset[0]
+        r_Q = -offset[1]
+        rt_X = targetPos[0] - currentPos[0] - offset[0]
+        rt_Y = targetPos[1] - currentPos[1] - offset[1]
+        angular_travel = math.atan2(r_P * rt_Y - r_Q * rt_X,
+                                    r_P * rt_X + r_Q * rt_Y)
+        if angular_travel < 0.:
+            angular_travel += 2. * math.pi
+        if clockwise:
+            angular_travel -= 2. * math.pi
+
+        if (angular_travel == 0.
+            and currentPos[0] == targetPos[0]
+            and currentPos[1] == targetPos[1]):
+            # Make a circle if the angular rotation is 0 and the
+            # target is current position
+            angular_travel = 2. * math.pi
+        return angular_travel
+
 def load_config(config):
     return ArcSupport(config)
@@ -3,9 +3,136 @@
 # Copyright (C) 2016-2020  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging
+import logging, math
 import homing
 
+MERGE_FLUSH_TIME = 0.100
+MERGE_MAX_POINTS = 64
+
+# Buffer consecutive G1 moves in the XY plane and submit collinear runs
+# as a single line and near-circular runs as a single arc, as long as
+# the merged path stays within 'tolerance' of the original segments
+class SegmentMerger:
+    def __init__(self, gcode_move, tolerance):
+        self.gcode_move = gcode_move
+        self.printer = printer = gcode_move.printer
+        self.reactor = printer.get_reactor()
+        self.tolerance = tolerance
+        self.points = []
+        self.speed = 0.
+        self.fit = None
+        self.gcode_mutex = None
+        self.flush_timer = self.reactor.register_timer(self._flush_handler)
+        printer.register_event_handler("klippy:ready", self._handle_ready)
+    def _handle_ready(self):
+        self.gcode_mutex = self.printer.lookup_object('gcode').get_mutex()
+        toolhead = self.printer.lookup_object('toolhead')
+        toolhead.register_pending_move_flusher(self.flush)
+    def _flush_handler(self, eventtime):
+        # Submit a run left behind when g-code input goes idle
+        if self.gcode_mutex.test():
+            return eventtime + MERGE_FLUSH_TIME
+        with self.gcode_mutex:
+            self.flush()
+        return self.reactor.NEVER
+    # The fit of a run is () for a line or (center, angle) for an arc
+    def _fit_line(self, points):
+        sx, sy = points[0][:2]
+        dx, dy = points[-1][0] - sx, points[-1][1] - sy
+        dist2 = dx*dx + dy*dy
+        if not dist2:
+            return None
+        inv_dist = 1. / math.sqrt(dist2)
+        last_proj = 0.
+        for p in points[1:-1]:
+            px, py = p[0] - sx, p[1] - sy
+            if abs(dx*py - dy*px) * inv_dist > self.tolerance:
+                return None
+            proj = dx*px + dy*py
+            if proj < last_proj or proj > dist2:
+                # Path doubles back on itself
+                return None
+            last_proj = proj
+        return ()
+    def _fit_arc(self, points):
+        # Find the circle through the first, middle, and last points
+        ax, ay = points[0][:2]
+        mid = points[len(points) // 2]
+        bx, by = mid[0] - ax, mid[1] - ay
+        cx, cy = points[-1][0] - ax, points[-1][1] - ay
+        det = 2. * (bx*cy - by*cx)
+        if not det:
+            return None
+        b2, c2 = bx*bx + by*by, cx*cx + cy*cy
+        ox, oy = (cy*b2 - by*c2) / det, (bx*c2 - cx*b2) / det
+        radius = math.sqrt(ox*ox + oy*oy)
+        ox, oy = ox + ax, oy + ay
+        # Check every segment follows the circle in the same direction
+        tolerance = self.tolerance
+        angle = 0.
+        prx, pry = ax - ox, ay - oy
+        for p in points[1:]:
+            rx, ry = p[0] - ox, p[1] - oy
+            if abs(math.sqrt(rx*rx + ry*ry) - radius) > tolerance:
+                return None
+            step = math.atan2(prx*ry - pry*rx, prx*rx + pry*ry)
+            if step * det <= 0.:
+                return None
+            # Distance between the arc and the chord of this segment
+            half_chord2 = .25 * ((rx - prx)**2 + (ry - pry)**2)
+            sagitta = radius - math.sqrt(max(0., radius**2 - half_chord2))
+            if sagitta > tolerance:
+                return None
+            angle += step
+            prx, pry = rx, ry
+        if abs(angle) >= 2. * math.pi:
+            return None
+        return ((ox, oy), angle)
+    def _submit(self, points, fit):
+        gcode_move = self.gcode_move
+        if fit:
+            center, angle = fit
+            gcode_move.arc_move_with_transform(points[-1], center, angle,
+                                               self.speed)
+        else:
+            gcode_move.move_with_transform(points[-1], self.speed)
+    def flush(self):
+        points, self.points = self.points, []
+        if len(points) > 1:
+            self._submit(points, self.fit)
+    def move(self, newpos, speed):
+        points = self.points
+        if points:
+            last = points[-1]
+            if (speed != self.speed or newpos[2] != last[2]
+                or newpos[3] != last[3] or len(points) >= MERGE_MAX_POINTS):
+                self.flush()
+                points = self.points
+        if not points:
+            start = self.gcode_move.position_with_transform()
+            if newpos[2] != start[2] or newpos[3] != start[3]:
+                # Not an XY move - submit it directly
+                self.gcode_move.move_with_transform(newpos, speed)
+                return
+            self.points = points = [start]
+            self.speed = speed
+            self.fit = ()
+            self.reactor.update_timer(
+                self.flush_timer, self.reactor.monotonic() + MERGE_FLUSH_TIME)
+        points.append(list(newpos))
+        if len(points) <= 2:
+            return
+        fit = self._fit_line(points)
+        if fit is None and self.gcode_move.has_arc_move():
+            fit = self._fit_arc(points)
+        if fit is not None:
+            self.fit = fit
+            return
+        # Submit the run up to the previous point and start a new one
+        self.points = points[-2:]
+        prev_fit, self.fit = self.fit, ()
+        self._submit(points[:-1], prev_fit)
+
 class GCodeMove:
     def __init__(self, config):
         self.printer = printer = config.get_printer()
@@ -45,12 +172,19 @@ class GCodeMove:
         # G-Code state
         self.saved_states = {}
         self.move_transform = self.move_with_transform = None
+        self.arc_move_with_transform = None
         self.position_with_transform = (lambda: [0., 0., 0., 0.])
+        # Optional merging of short G1 segments
+        self.segment_merger = None
+        merge_tolerance = config.getfloat('merge_tolerance', 0., minval=0.)
+        if merge_tolerance:
+            self.segment_merger = SegmentMerger(self, merge_tolerance)
     def _handle_ready(self):
         self.is_printer_ready = True
         if self.move_transform is None:
             toolhead = self.printer.lookup_object('toolhead')
             self.move_with_transform = toolhead.move
+            self.arc_move_with_transform = toolhead.arc_move
             self.position_with_transform = toolhead.get_position
     def _handle_shutdown(self):
         if not self.is_printer_ready:
@@ -71,11 +205,13 @@ class GCodeMove:
         if self.move_transform is not None and not force:
             raise self.printer.config_error(
                 "G-Code move transform already specified")
+        self._flush_merged_moves()
         old_transform = self.move_transform
         if old_transform is None:
             old_transform = self.printer.lookup_object('toolhead', None)
         self.move_transform = transform
         self.move_with_transform = transform.move
+        self.arc_move_with_transform = getattr(transform, 'arc_move', None)
         self.position_with_transform = transform.get_position
         return old_transform
     def _get_gcode_position(self):
@@ -98,12 +234,32 @@ class GCodeMove:
             'position': homing.Coord(*self.last_position),
             'gcode_position': homing.Coord(*move_position),
         }
+    def _flush_merged_moves(self):
+        if self.segment_merger is not None:
+            self.segment_merger.flush()
     def reset_last_position(self):
+        self._flush_merged_moves()
         if self.is_printer_ready:
             self.last_position = self.position_with_transform()
+    def has_arc_move(self):
+        return self.arc_move_with_transform is not None
     # G-Code movement commands
     def cmd_G1(self, gcmd):
         # Move
+        self._update_last_position(gcmd)
+        if self.segment_merger is not None:
+            self.segment_merger.move(self.last_position, self.speed)
+        else:
+            self.move_with_transform(self.last_position, self.speed)
+    def arc_move(self, gcmd, offset, angle):
+        # Move along a circular arc (in the XY plane) turning 'angle'
+        # radians around the point at 'offset' from the current position
+        self._flush_merged_moves()
+        center = [self.last_position[i] + offset[i] for i in (0, 1)]
+        self._update_last_position(gcmd)
+        self.arc_move_with_transform(self.last_position, center, angle,
+                                     self.speed)
+    def _update_last_position(self, gcmd):
         params = gcmd.get_command_parameters()
         try:
             for pos, axis in enumerate('XYZ'):
@@ -132,7 +288,6 @@ class GCodeMove:
         except ValueError as e:
             raise gcmd.error("Unable to parse move '%s'"
                              % (gcmd.get_commandline(),))
-        self.move_with_transform(self.last_position, self.speed)
     def cmd_G28(self, gcmd):
         # Move to origin
         axes = []
@@ -209,6 +364,7 @@ class GCodeMove:
             speed = gcmd.get_float('MOVE_SPEED', self.speed, above=0.)
             for pos, delta in enumerate(move_delta):
                 self.last_position[pos] += delta
+            self._flush_merged_moves()
             self.move_with_transform(self.last_position, speed)
     cmd_SAVE_GCODE_STATE_help = "Save G-Code coordinate state"
     def cmd_SAVE_GCODE_STATE(self, gcmd):
@@ -243,6 +399,7 @@ class GCodeMove:
         if gcmd.get_int('MOVE', 0):
             speed = gcmd.get_float('MOVE_SPEED', self.speed, above=0.)
             self.last_position[:3] = state['last_position'][:3]
+            self._flush_merged_moves()
             self.move_with_transform(self.last_position, speed)
     def cmd_GET_POSITION(self, gcmd):
         toolhead = self.printer.lookup_object('toolhead', None)
@@ -0,0 +1,118 @@
+# Dump the timing trace recorded by an mcu (CONFIG_WANT_TRACE)
+#
+# Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import logging, struct
+import mcu
+
+# Event types (must match src/trace.h)
+EVENTS = ["timer", "tasks", "priority_task", "command", "freeze",
+          "unfreeze", "step_margin"]
+TRACE_ENTRY = struct.Struct('<IIBB')
+
+class MCUTrace:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.mcu = mcu.get_printer_mcu(self.printer,
+                                       config.get('mcu', 'mcu'))
+        self.filename = config.get('filename', '/tmp/mcu_trace.log')
+        events = config.get('events', ', '.join(EVENTS))
+        self.event_mask = 0
+        for name in [e.strip() for e in events.split(',') if e.strip()]:
+            if name not in EVENTS:
+                raise config.error("Unknown mcu_trace event '%s'" % (name,))
+            self.event_mask |= 1 << EVENTS.index(name)
+        self.query_cmd = self.set_cmd = None
+        self.mcu.register_config_callback(self._build_config)
+        self.printer.register_event_handler("klippy:shutdown",
+                                            self._handle_shutdown)
+        gcode = self.printer.lookup_object('gcode')
+        gcode.register_command("MCU_TRACE_DUMP", self.cmd_MCU_TRACE_DUMP,
+                               desc=self.cmd_MCU_TRACE_DUMP_help)
+    def _build_config(self):
+        if self.mcu.try_lookup_command("trace_query offset=%hu") is None:
+            raise self.printer.config_error(
+                "MCU '%s' was not built with CONFIG_WANT_TRACE"
+                % (self.mcu.get_name(),))
+        self.mcu.add_config_cmd("trace_set events=%d" % (self.event_mask,),
+                                is_init=True)
+        self.query_cmd = self.mcu.lookup_query_command(
+            "trace_query offset=%hu",
+            "trace_data offset=%hu count=%hu data=%*s")
+        self.set_cmd = self.mcu.lookup_command("trace_set events=%c")
+    def _read_entries(self):
+        # Recording is paused by the first query so that the buffer
+        # does not change while it is read
+        entries = []
+        count = 1
+        while len(entries) < count:
+            params = self.query_cmd.send([len(entries)])
+            count = params['count']
+            data = params['data']
+            if params['offset'] != len(entries) or not data:
+                break
+            for pos in range(0, len(data), TRACE_ENTRY.size):
+                entries.append(TRACE_ENTRY.unpack_from(data, pos))
+        return entries
+    def _format_entries(self, entries):
+        freq = self.mcu.seconds_to_clock(1.)
+        msgnames = self.mcu.get_message_names()
+        tasknames = {v: k for k, v in self.mcu.get_enumerations().get(
+            'priority_task', {}).items()}
+        out = ["# mcu_trace mcu=%s freq=%d" % (self.mcu.get_name(), freq)]
+        for clock, value, etype, arg in entries:
+            print_time = self.mcu.clock_to_print_time(
+                self.mcu.clock32_to_clock64(clock))
+            event = EVENTS[etype] if etype < len(EVENTS) else "type%d" % (
+                etype,)
+            delta = ((clock - value + 0x80000000) & 0xffffffff) - 0x80000000
+            argname = "-"
+            if event in ("timer", "tasks", "command"):
+                # Value is a reference clock (scheduled time or start)
+                value = delta
+                if event == "command":
+                    argname = msgnames.get(arg, "cmd%d" % (arg,))
+            elif event == "step_margin":
+                # Value is the (estimated) end of the step queue
+                value = -delta
+                argname = "oid%d" % (arg,)
+            elif event == "priority_task":
+                argname = tasknames.get(arg, "task%d" % (arg,))
+            out.append("%.6f %s %s %.6f" % (
+                print_time, event, argname, value / float(freq)))
+        return out
+    def dump(self, filename):
+        entries = self._read_entries()
+        f = open(filename, 'wb')
+        f.write('\n'.join(self._format_entries(entries)) + '\n')
+        f.close()
+        return len(entries)
+    def _dump_after_shutdown(self, eventtime):
+        try:
+            count = self.dump(self.filename)
+        except (IOError, self.mcu.error) as e:
+            logging.warning("Unable to dump mcu trace: %s", e)
+            return
+        logging.info("Wrote %d mcu trace events to %s", count, self.filename)
+    def _handle_shutdown(self):
+        if self.query_cmd is None:
+            return
+        # The mcu stops recording on a shutdown - fetch the events that
+        # led up to it once the shutdown processing completes
+        reactor = self.printer.get_reactor()
+        reactor.register_callback(self._dump_after_shutdown)
+    cmd_MCU_TRACE_DUMP_help = "Write the mcu timing trace to a file"
+    def cmd_MCU_TRACE_DUMP(self, gcmd):
+        filename = gcmd.get('FILENAME', self.filename)
+        try:
+            count = self.dump(filename)
+        except (IOError, self.mcu.error) as e:
+            raise gcmd.error("Unable to dump mcu trace: %s" % (e,))
+        # Resume recording (clears the trace buffer)
+        self.set_cmd.send([self.event_mask])
+        gcmd.respond_info("Wrote %d mcu trace events to %s" % (
+            count, filename))
+
+def load_config(config):
+    return MCUTrace(config)
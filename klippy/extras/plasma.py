@@ -32,8 +32,8 @@ class Plasma:
             transfer_pin_params['invert'],
             config.getint('transfer_timeout_ms')))
 
-        self.cmd_queue = self.mcu.alloc_command_queue()
-        self.ack_queue = self.mcu.alloc_command_queue()
+        self.cmd_queue = self.mcu.alloc_command_queue(high_priority=True)
+        self.ack_queue = self.mcu.alloc_command_queue(high_priority=True)
         self.mcu.register_config_callback(self.build_config)
         self.plasma_start_cmd = None
         self.plasma_stop_cmd = None
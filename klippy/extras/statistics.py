@@ -4,6 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import os, time, logging
+import binlog
 
 def get_os_stats(eventtime):
     # Get core usage stats
@@ -38,8 +39,13 @@ class PrinterStats:
         stats = [cb(eventtime) for cb in self.stats_cb]
         if max([s[0] for s in stats]):
             stats.append(get_os_stats(eventtime))
-            logging.info("Stats %.1f: %s", eventtime,
-                         ' '.join([s[1] for s in stats]))
+            bl = binlog.get_binary_log()
+            if bl is not None:
+                stats.append((False, bl.stats(eventtime)))
+            msg = ' '.join([s[1] for s in stats])
+            logging.info("Stats %.1f: %s", eventtime, msg)
+            if bl is not None:
+                bl.write(binlog.BLR_STATS, eventtime, msg)
         return eventtime + 1.
 
 def load_config(config):
@@ -4,6 +4,9 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 from math import sqrt
+import binlog
+
+DRAIN_TIME = .100
 
 class TorchHeightController:
     def __init__(self, config):
@@ -23,7 +26,7 @@ class TorchHeightController:
         mm_per_s_per_mv = config.getfloat('speed_coeff') / 1000
         self.speed_coeff = int(mm_per_s_per_mv * 2**14)
 
-        self.cmd_queue = self.mcu.alloc_command_queue()
+        self.cmd_queue = self.mcu.alloc_command_queue(high_priority=True)
         self.mcu.register_config_callback(self.build_config)
         self.thc_start_cmd = None
         self.thc_stop_cmd = None
@@ -36,6 +39,10 @@ class TorchHeightController:
         self.mcu.register_response(self._handle_sample, 'thc_sample')
         self.enable = False
         self.last_M7 = None
+        self.binlog = binlog.get_binary_log()
+        # Samples read in bulk from a message capture (if numpy is available)
+        self.capture = None
+        self.drain_timer = self.reactor.register_timer(self._drain_capture)
 
     def build_config(self):
         self.toolhead = self.printer.lookup_object('toolhead')
@@ -54,6 +61,9 @@ class TorchHeightController:
             cq=self.cmd_queue)
         self.thc_stop_cmd = self.mcu.lookup_command(
             "stop_thc oid=%c clock=%u", cq=self.cmd_queue)
+        self.capture = self.mcu.alloc_message_capture('thc_sample')
+        if self.capture is not None:
+            self.reactor.update_timer(self.drain_timer, self.reactor.NOW)
 
     def _handle_sample(self, params):
         z_mcu_pos = params['z_pos'] * self.z_stepper._step_dist
@@ -62,9 +72,44 @@ class TorchHeightController:
         z_pos = z_mcu_pos - self.z_stepper._mcu_position_offset
         voltage = float(params['voltage_mv']) / 1000
         xy_speed = sqrt(params['xy_speed_squared'])
+        receive_time = params['#receive_time']
+        if self.binlog is not None:
+            self.binlog.write(binlog.BLR_THC_SAMPLE, receive_time,
+                              binlog.THC_SAMPLE.pack(receive_time, z_pos,
+                                                     voltage, xy_speed))
         self.gcode.respond_info('echo: THC_error ' + str(z_pos) + ' ' +
             str(voltage) + ' ' + str(xy_speed))
 
+    def _drain_capture(self, eventtime):
+        np = self.capture.np
+        while 1:
+            times, values, data, lengths = self.capture.get_samples()
+            count = len(times)
+            if not count:
+                break
+            z_mcu_pos = values[:,0] * self.z_stepper._step_dist
+            if self.z_stepper._invert_dir:
+                z_mcu_pos = -z_mcu_pos
+            z_pos = z_mcu_pos - self.z_stepper._mcu_position_offset
+            voltage = values[:,1] / 1000.
+            xy_speed = np.sqrt(values[:,2])
+            if self.binlog is not None:
+                samples = np.column_stack((times, z_pos, voltage, xy_speed))
+                per_record = binlog.MAX_RECORD_SIZE // binlog.THC_SAMPLE.size
+                for i in range(0, count, per_record):
+                    self.binlog.write(
+                        binlog.BLR_THC_SAMPLE, times[i],
+                        samples[i:i+per_record].astype('<f8').tobytes())
+            # 'times' and 'values' point into the capture ring - only
+            # release the samples once they are no longer used
+            self.capture.release(count)
+            # Report all the samples in a single message
+            self.gcode.respond_info('\n'.join([
+                'echo: THC_error ' + str(z) + ' ' + str(v) + ' ' + str(s)
+                for z, v, s in zip(z_pos.tolist(), voltage.tolist(),
+                                   xy_speed.tolist())]))
+        return eventtime + DRAIN_TIME
+
     def cmd_M6(self, gcmd):
         if not self.enable:
             voltage = gcmd.get_float('V', minval=0, maxval=300)
@@ -119,6 +164,9 @@ class TorchHeightController:
         self.reactor.pause(now + self.last_M7
                            - self.mcu.estimated_print_time(now) + 0.05)
         self.last_M7 = None
+        if self.capture is not None:
+            # Report pending samples using the old stepper position
+            self._drain_capture(self.reactor.monotonic())
 
         z_pos = self.z_stepper.resync_mcu_position()
         cur_pos = self.toolhead.get_position()
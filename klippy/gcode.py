@@ -4,7 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import os, re, logging, collections, shlex
-import homing
+import homing, binlog
 
 class GCodeCommand:
     error = homing.CommandError
@@ -353,6 +353,7 @@ class GCodeIO:
         self.pending_commands = []
         self.bytes_read = 0
         self.input_log = collections.deque([], 50)
+        self.binlog = binlog.get_binary_log()
         self.jit_enable = False
     def _handle_ready(self):
         self.is_printer_ready = True
@@ -385,6 +386,9 @@ class GCodeIO:
         lines = data.split('\n')
         lines[0] = self.partial_input + lines[0]
         self.partial_input = lines.pop()
+        if self.binlog is not None:
+            for line in lines:
+                self.binlog.write(binlog.BLR_GCODE, eventtime, line)
         pending_commands = self.pending_commands
         pending_commands.extend(lines)
         self.pipe_is_active = True
@@ -49,6 +49,7 @@ class PrinterExtruder:
         ffi_main, ffi_lib = chelper.get_ffi()
         self.trapq = ffi_main.gc(ffi_lib.trapq_alloc(), ffi_lib.trapq_free)
         self.trapq_append = ffi_lib.trapq_append
+        self.trapq_append_scurve = ffi_lib.trapq_append_scurve
         self.trapq_free_moves = ffi_lib.trapq_free_moves
         self.sk_extruder = ffi_main.gc(ffi_lib.extruder_stepper_alloc(),
                                        ffi_lib.free)
@@ -145,6 +146,16 @@ class PrinterExtruder:
         if axis_r > 0. and (move.axes_d[0] or move.axes_d[1]):
             pressure_advance = self.pressure_advance
         # Queue movement (x is extruder movement, y is pressure advance)
+        if move.max_jerk:
+            # Follow the jerk limited velocity changes of the toolhead
+            self.trapq_append_scurve(
+                self.trapq, print_time,
+                move.accel_t, move.accel_jerk_t, move.cruise_t,
+                move.decel_t, move.decel_jerk_t,
+                move.start_pos[3], 0., 0.,
+                1., pressure_advance, 0.,
+                start_v, cruise_v, move.end_v * axis_r)
+            return
         self.trapq_append(self.trapq, print_time,
                           move.accel_t, move.cruise_t, move.decel_t,
                           move.start_pos[3], 0., 0.,
@@ -5,7 +5,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import sys, os, gc, optparse, logging, time, collections, importlib
-import util, reactor, queuelogger, msgproto, homing
+import util, reactor, queuelogger, binlog, msgproto, homing
 import gcode, configfile, pins, mcu, toolhead, webhooks
 
 message_ready = "Printer is ready"
@@ -264,6 +264,8 @@ def main():
                     help="api server unix domain socket filename")
     opts.add_option("-l", "--logfile", dest="logfile",
                     help="write log to file instead of stderr")
+    opts.add_option("-b", "--binary-log", dest="binlog",
+                    help="write a binary log of host activity to file")
     opts.add_option("-v", action="store_true", dest="verbose",
                     help="enable debug messages")
     opts.add_option("-o", "--debugoutput", dest="debugoutput",
@@ -295,6 +297,9 @@ def main():
         bglogger = queuelogger.setup_bg_logging(options.logfile, debuglevel)
     else:
         logging.basicConfig(level=debuglevel)
+    if options.binlog:
+        start_args['binlog_file'] = options.binlog
+        binlog.setup_binary_log(options.binlog)
     logging.info("Starting Klippy...")
     start_args['software_version'] = util.get_git_version()
     start_args['cpu_info'] = util.get_cpu_info()
@@ -327,6 +332,7 @@ def main():
         logging.info("Restarting printer")
         start_args['start_reason'] = res
 
+    binlog.clear_binary_log()
     if bglogger is not None:
         bglogger.stop()
 
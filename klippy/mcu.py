@@ -399,14 +399,27 @@ class MCU:
         if self._name.startswith('mcu '):
             self._name = self._name[4:]
         # Serial port
-        self._serialport = config.get('serial')
+        self._canbus_uuid = config.get('canbus_uuid', None)
+        if self._canbus_uuid is not None:
+            try:
+                serialhdl.canbus_uuid_to_bytes(self._canbus_uuid)
+            except serialhdl.error as e:
+                raise config.error(str(e))
+            self._canbus_iface = config.get('canbus_interface', 'can0')
+            self._canbus_nodeid = config.getint(
+                'canbus_nodeid', default_canbus_nodeid(config),
+                minval=0, maxval=63)
+            self._serialport = self._canbus_uuid
+        else:
+            self._serialport = config.get('serial')
         serial_rts = True
         if config.get('restart_method', None) == "cheetah":
             # Special case: Cheetah boards require RTS to be deasserted, else
             # a reset will trigger the built-in bootloader.
             serial_rts = False
         baud = 0
-        if not (self._serialport.startswith("/dev/rpmsg_")
+        if not (self._canbus_uuid is not None
+                or self._serialport.startswith("/dev/rpmsg_")
                 or self._serialport.startswith("/tmp/klipper_host_")):
             baud = config.getint('baud', 250000, minval=2400)
         self._serial = serialhdl.SerialReader(
@@ -442,6 +455,10 @@ class MCU:
         self._mcu_tick_avg = 0.
         self._mcu_tick_stddev = 0.
         self._mcu_tick_awake = 0.
+        self._move_free = self._move_low = 0
+        self._moves_freed = self._sent_moves_freed = None
+        self._priority_tasks = {}
+        self._task_latency = {}
         # Register handlers
         printer.register_event_handler("klippy:connect", self._connect)
         printer.register_event_handler("klippy:mcu_identify",
@@ -458,6 +475,14 @@ class MCU:
         diff = count*tick_sumsq - tick_sum**2
         self._mcu_tick_stddev = c * math.sqrt(max(0., diff))
         self._mcu_tick_awake = tick_sum / self._mcu_freq
+        self._move_free = params['move_free']
+        self._move_low = params['move_low']
+        # Passed to the steppersync from flush_moves() (main thread)
+        self._moves_freed = params['moves_freed']
+    def _handle_task_stats(self, params):
+        task_id = params['id']
+        name = self._priority_tasks.get(task_id, "task%d" % (task_id,))
+        self._task_latency[name] = params['max_latency'] / self._mcu_freq
     def _handle_shutdown(self, params):
         if self._is_shutdown:
             return
@@ -602,7 +627,12 @@ class MCU:
                 # Try toggling usb power
                 self._check_restart("enable power")
             try:
-                self._serial.connect()
+                if self._canbus_uuid is not None:
+                    self._serial.connect_canbus(self._canbus_uuid,
+                                                self._canbus_nodeid,
+                                                self._canbus_iface)
+                else:
+                    self._serial.connect()
                 self._clocksync.connect(self._serial)
             except serialhdl.error as e:
                 raise error(str(e))
@@ -615,7 +645,8 @@ class MCU:
                     pin_resolver.reserve_pin(pin, cname[13:])
         self._mcu_freq = self.get_constant_float('CLOCK_FREQ')
         self._stats_sumsq_base = self.get_constant_float('STATS_SUMSQ_BASE')
-        self._emergency_stop_cmd = self.lookup_command("emergency_stop")
+        self._emergency_stop_cmd = self.lookup_command(
+            "emergency_stop", cq=self.alloc_command_queue(high_priority=True))
         self._reset_cmd = self.try_lookup_command("reset")
         self._config_reset_cmd = self.try_lookup_command("config_reset")
         ext_only = self._reset_cmd is None and self._config_reset_cmd is None
@@ -625,6 +656,9 @@ class MCU:
         self.register_response(self._handle_shutdown, 'shutdown')
         self.register_response(self._handle_shutdown, 'is_shutdown')
         self.register_response(self._handle_mcu_stats, 'stats')
+        tasks = self.get_enumerations().get('priority_task', {})
+        self._priority_tasks = {v: n for n, v in tasks.items()}
+        self.register_response(self._handle_task_stats, 'task_stats')
     # Config creation helpers
     def setup_pin(self, pin_type, pin_params):
         pcs = {'endstop': MCU_endstop,
@@ -661,8 +695,14 @@ class MCU:
         return self._name
     def register_response(self, cb, msg, oid=None):
         self._serial.register_response(cb, msg, oid)
-    def alloc_command_queue(self):
-        return self._serial.alloc_command_queue()
+    def register_bulk_response(self, cb, msg, oid=None):
+        self._serial.register_bulk_response(cb, msg, oid)
+    def alloc_message_capture(self, msg, oid=None,
+                              size=serialhdl.CAPTURE_SIZE,
+                              buf_size=serialhdl.CAPTURE_BUF_SIZE):
+        return self._serial.alloc_message_capture(msg, oid, size, buf_size)
+    def alloc_command_queue(self, high_priority=False):
+        return self._serial.alloc_command_queue(high_priority)
     def lookup_command(self, msgformat, cq=None):
         return CommandWrapper(self._serial, msgformat, cq)
     def lookup_query_command(self, msgformat, respformat, oid=None,
@@ -676,6 +716,9 @@ class MCU:
             return None
     def lookup_command_id(self, msgformat):
         return self._serial.get_msgparser().lookup_command(msgformat).msgid
+    def get_message_names(self):
+        msgparser = self._serial.get_msgparser()
+        return {msgid: m.name for msgid, m in msgparser.messages_by_id.items()}
     def get_enumerations(self):
         return self._serial.get_msgparser().get_enumerations()
     def get_constants(self):
@@ -754,6 +797,11 @@ class MCU:
         clock = self.print_time_to_clock(print_time)
         if clock < 0:
             return
+        moves_freed = self._moves_freed
+        if moves_freed != self._sent_moves_freed:
+            self._sent_moves_freed = moves_freed
+            self._ffi_lib.steppersync_set_moves_freed(self._steppersync,
+                                                      moves_freed)
         ret = self._ffi_lib.steppersync_flush(self._steppersync, clock)
         if ret:
             raise error("Internal error in MCU '%s' stepcompress"
@@ -775,6 +823,9 @@ class MCU:
         msg = "%s: mcu_awake=%.03f mcu_task_avg=%.06f mcu_task_stddev=%.06f" % (
             self._name, self._mcu_tick_awake, self._mcu_tick_avg,
             self._mcu_tick_stddev)
+        msg += " move_free=%d move_low=%d" % (self._move_free, self._move_low)
+        msg += "".join([" %s_latency=%.06f" % (n, l)
+                        for n, l in sorted(self._task_latency.items())])
         return False, ' '.join([msg, self._serial.stats(eventtime),
                                 self._clocksync.stats(eventtime)])
 
@@ -801,6 +852,15 @@ def error_help(msg):
                 return help_msg
     return ""
 
+# The default CAN node id is the position of the mcu among the mcus
+# that are attached via CAN bus
+def default_canbus_nodeid(config):
+    sections = ([config.getsection('mcu')]
+                + config.get_prefix_sections('mcu '))
+    names = [s.get_name() for s in sections
+             if s.get('canbus_uuid', None) is not None]
+    return names.index(config.get_name())
+
 def add_printer_objects(config):
     printer = config.get_printer()
     reactor = printer.get_reactor()
@@ -36,11 +36,15 @@ def crc16_ccitt(buf):
     crc = chr(crc >> 8) + chr(crc & 0xff)
     return crc
 
+# Parameter type codes understood by the C message decoder (msgdecode.c)
+DT_UINT32, DT_INT32, DT_UINT16, DT_INT16, DT_BYTE, DT_BUFFER = range(6)
+
 class PT_uint32:
     is_int = True
     is_dynamic_string = False
     max_length = 5
     signed = False
+    decode_type = DT_UINT32
     def encode(self, out, v):
         if v >= 0xc000000 or v < -0x4000000: out.append((v>>28) & 0x7f | 0x80)
         if v >= 0x180000 or v < -0x80000:    out.append((v>>21) & 0x7f | 0x80)
@@ -63,18 +67,23 @@ class PT_uint32:
 
 class PT_int32(PT_uint32):
     signed = True
+    decode_type = DT_INT32
 class PT_uint16(PT_uint32):
     max_length = 3
+    decode_type = DT_UINT16
 class PT_int16(PT_int32):
     signed = True
     max_length = 3
+    decode_type = DT_INT16
 class PT_byte(PT_uint32):
     max_length = 2
+    decode_type = DT_BYTE
 
 class PT_string:
     is_int = False
     is_dynamic_string = True
     max_length = 64
+    decode_type = DT_BUFFER
     def encode(self, out, v):
         out.append(len(v))
         out.extend(bytearray(v))
@@ -96,6 +105,7 @@ MessageTypes = {
 class Enumeration:
     is_int = False
     is_dynamic_string = False
+    decode_type = None
     def __init__(self, pt, enum_name, enums):
         self.pt = pt
         self.max_length = pt.max_length
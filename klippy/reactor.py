@@ -3,7 +3,7 @@
 # Copyright (C) 2016-2020  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, gc, select, math, time, logging, Queue as queue
+import os, gc, select, math, time, logging, heapq, errno, Queue as queue
 import greenlet
 import chelper, util
 
@@ -15,6 +15,12 @@ class ReactorTimer:
         self.callback = callback
         self.waketime = waketime
 
+class ReactorHeapTimer(ReactorTimer):
+    def __init__(self, callback, waketime):
+        ReactorTimer.__init__(self, callback, waketime)
+        # Sequence number of the timer's current entry on the heap
+        self.heap_seq = -1
+
 class ReactorCompletion:
     class sentinel: pass
     def __init__(self, reactor):
@@ -130,23 +136,26 @@ class SelectReactor:
         timers = list(self._timers)
         timers.pop(timers.index(timer_handler))
         self._timers = timers
+    def _check_idle(self, eventtime, busy):
+        # Determine the timeout when no timer is due
+        if busy:
+            return 0.
+        if self._check_gc:
+            gi = gc.get_count()
+            if gi[0] >= 700:
+                # Reactor looks idle and gc is due - run it
+                gc_level = 0
+                if gi[1] >= 10:
+                    gc_level = 1
+                    if gi[2] >= 10:
+                        gc_level = 2
+                self._last_gc_times[gc_level] = eventtime
+                gc.collect(gc_level)
+                return 0.
+        return min(1., max(.001, self._next_timer - eventtime))
     def _check_timers(self, eventtime, busy):
         if eventtime < self._next_timer:
-            if busy:
-                return 0.
-            if self._check_gc:
-                gi = gc.get_count()
-                if gi[0] >= 700:
-                    # Reactor looks idle and gc is due - run it
-                    gc_level = 0
-                    if gi[1] >= 10:
-                        gc_level = 1
-                        if gi[2] >= 10:
-                            gc_level = 2
-                    self._last_gc_times[gc_level] = eventtime
-                    gc.collect(gc_level)
-                    return 0.
-            return min(1., max(.001, self._next_timer - eventtime))
+            return self._check_idle(eventtime, busy)
         self._next_timer = self.NEVER
         g_dispatch = self._g_dispatch
         for t in self._timers:
@@ -325,18 +334,103 @@ class EPollReactor(SelectReactor):
         SelectReactor.__init__(self, gc_checking)
         self._epoll = select.epoll()
         self._fds = {}
+        # Regular files can not be added to an epoll set (they are
+        # always readable)
+        self._file_fds = []
+        # Timers are kept on a binary heap of (waketime, seq, timer)
+        # entries.  Rescheduling a timer adds a new entry; entries with
+        # a seq that no longer matches timer.heap_seq are stale and are
+        # discarded when they reach the top of the heap.
+        self._timer_heap = []
+        self._timer_seq = 0
+        self._timer_count = 0
+    # Timers
+    def _push_timer(self, timer_handler, waketime):
+        timer_handler.waketime = waketime
+        seq = self._timer_seq
+        self._timer_seq = seq + 1
+        timer_handler.heap_seq = seq
+        if waketime < self.NEVER:
+            heap = self._timer_heap
+            heapq.heappush(heap, (waketime, seq, timer_handler))
+            if len(heap) > 2 * self._timer_count + 64:
+                # Too many stale entries - rebuild the heap
+                heap[:] = [e for e in heap if e[1] == e[2].heap_seq]
+                heapq.heapify(heap)
+    def update_timer(self, timer_handler, waketime):
+        if waketime == timer_handler.waketime:
+            return
+        self._push_timer(timer_handler, waketime)
+        self._next_timer = min(self._next_timer, waketime)
+    def register_timer(self, callback, waketime=_NEVER):
+        timer_handler = ReactorHeapTimer(callback, waketime)
+        self._timer_count += 1
+        self._push_timer(timer_handler, waketime)
+        self._next_timer = min(self._next_timer, waketime)
+        return timer_handler
+    def unregister_timer(self, timer_handler):
+        self._timer_count -= 1
+        self._push_timer(timer_handler, self.NEVER)
+    def _check_timers(self, eventtime, busy):
+        if eventtime < self._next_timer:
+            return self._check_idle(eventtime, busy)
+        heap = self._timer_heap
+        heappop = heapq.heappop
+        g_dispatch = self._g_dispatch
+        # Invoke each due timer at most once (timers rescheduled to an
+        # already passed time run on the next call).  Rescheduled
+        # entries are put back on the heap before each callback as the
+        # callback may pause and let another greenlet dispatch timers.
+        end_seq = self._timer_seq
+        deferred = []
+        while heap and heap[0][0] <= eventtime:
+            entry = heappop(heap)
+            t = entry[2]
+            if entry[1] != t.heap_seq:
+                # Stale entry
+                continue
+            if entry[1] >= end_seq:
+                deferred.append(entry)
+                continue
+            for d in deferred:
+                heapq.heappush(heap, d)
+            del deferred[:]
+            t.waketime = self.NEVER
+            waketime = t.callback(eventtime)
+            self._push_timer(t, waketime)
+            if g_dispatch is not self._g_dispatch:
+                self._next_timer = self.NOW
+                self._end_greenlet(g_dispatch)
+                return 0.
+        for d in deferred:
+            heapq.heappush(heap, d)
+        # Discard stale entries so that heap[0] is the next wake time
+        while heap and heap[0][1] != heap[0][2].heap_seq:
+            heappop(heap)
+        self._next_timer = heap[0][0] if heap else self.NEVER
+        return 0.
     # File descriptors
     def register_fd(self, fd, callback):
         file_handler = ReactorFileHandler(fd, callback)
         fds = self._fds.copy()
         fds[fd] = callback
         self._fds = fds
-        self._epoll.register(fd, select.EPOLLIN | select.EPOLLHUP)
+        try:
+            self._epoll.register(fd, select.EPOLLIN | select.EPOLLHUP)
+        except IOError as e:
+            if e.errno != errno.EPERM:
+                raise
+            self._file_fds = self._file_fds + [(fd, select.EPOLLIN)]
         return file_handler
     def unregister_fd(self, file_handler):
-        self._epoll.unregister(file_handler.fd)
+        fd = file_handler.fd
+        file_fds = [f for f in self._file_fds if f[0] != fd]
+        if len(file_fds) != len(self._file_fds):
+            self._file_fds = file_fds
+        else:
+            self._epoll.unregister(fd)
         fds = self._fds.copy()
-        del fds[file_handler.fd]
+        del fds[fd]
         self._fds = fds
     # Main loop
     def _dispatch_loop(self):
@@ -346,7 +440,10 @@ class EPollReactor(SelectReactor):
         while self._process:
             timeout = self._check_timers(eventtime, busy)
             busy = False
-            res = self._epoll.poll(timeout)
+            if self._file_fds:
+                res = self._epoll.poll(0.) + self._file_fds
+            else:
+                res = self._epoll.poll(timeout)
             eventtime = self.monotonic()
             for fd, event in res:
                 busy = True
@@ -356,10 +453,17 @@ class EPollReactor(SelectReactor):
                     eventtime = self.monotonic()
                     break
         self._g_dispatch = None
+    def finalize(self):
+        SelectReactor.finalize(self)
+        self._epoll.close()
 
-# Use the poll based reactor if it is available
+# Use the epoll based reactor if it is available (falling back to poll)
 try:
-    select.poll
-    Reactor = PollReactor
+    select.epoll
+    Reactor = EPollReactor
 except:
-    Reactor = SelectReactor
+    try:
+        select.poll
+        Reactor = PollReactor
+    except:
+        Reactor = SelectReactor
@@ -3,16 +3,32 @@
 # Copyright (C) 2016-2020  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, threading
+import logging, threading, os, struct, zlib, binascii, errno, importlib
 import serial
 
-import msgproto, chelper, util
+import msgproto, chelper, util, binlog
 
 class error(Exception):
     pass
 
+PULL_BATCH = 32
+PRIORITY_WINDOW_SHARE = 0.125
+CAPTURE_SIZE = 16384
+CAPTURE_BUF_SIZE = msgproto.MESSAGE_PAYLOAD_MAX
+IDENTIFY_INFO_OFFSET = 0xffffffff
+IDENTIFY_CACHE_DIR = "~/.cache/klipper/identify"
+BITS_PER_BYTE = 10.
+
+CANBUS_ID_UUID = 0x321
+CANBUS_ID_SET = 0x322
+CANBUS_ID_UUID_RESP = 0x323
+CANBUS_ID_BASE = 0x100
+CANBUS_UUID_LEN = 6
+CANBUS_TIMEOUT = .100
+# A full 8 byte frame takes ~130 bits on the bus (with bit stuffing)
+CANBUS_BITS_PER_BYTE = 16.
+
 class SerialReader:
-    BITS_PER_BYTE = 10.
     def __init__(self, reactor, serialport, baud, rts=True):
         self.reactor = reactor
         self.serialport = serialport
@@ -20,9 +36,11 @@ class SerialReader:
         # Serial port
         self.ser = None
         self.rts = rts
+        self.identify_cache_dir = IDENTIFY_CACHE_DIR
         self.msgparser = msgproto.MessageParser()
         # C interface
         self.ffi_main, self.ffi_lib = chelper.get_ffi()
+        self.decoder = self._build_decoder(self.msgparser)
         self.serialqueue = None
         self.default_cmd_queue = self.alloc_command_queue()
         self.stats_buf = self.ffi_main.new('char[4096]')
@@ -31,35 +49,153 @@ class SerialReader:
         self.background_thread = None
         # Message handlers
         self.handlers = {}
+        self.bulk_handlers = {}
         self.register_response(self._handle_unknown_init, '#unknown')
         self.register_response(self.handle_output, '#output')
         # Sent message notification tracking
         self.last_notify_id = 0
         self.pending_notifications = {}
+    def _build_decoder(self, msgparser):
+        # Load the response formats into the C message decoder
+        decoder = self.ffi_main.gc(self.ffi_lib.msgdecode_alloc(),
+                                   self.ffi_lib.msgdecode_free)
+        formats = {}
+        for msgid, mp in msgparser.messages_by_id.items():
+            if not isinstance(mp, msgproto.MessageFormat):
+                continue
+            types = [t.decode_type for t in mp.param_types]
+            if None in types or self.ffi_lib.msgdecode_set_format(
+                    decoder, msgid, types, len(types)):
+                # Parameters need python processing (eg, enumerations)
+                continue
+            names = [name for name, t in mp.param_names]
+            buffers = [i for i, t in enumerate(mp.param_types)
+                       if t.is_dynamic_string]
+            oid_index = -1
+            if 'oid' in names:
+                oid_index = names.index('oid')
+            formats[msgid] = (mp.name, names, buffers, oid_index)
+        return msgparser, decoder, formats
+    def _handle_message(self, response, rec, msgparser, formats, bulk):
+        fmt = formats.get(rec.msgid)
+        if fmt is None:
+            # Message not handled by the C decoder
+            params = msgparser.parse(response.msg[0:response.len])
+            params['#sent_time'] = rec.sent_time
+            params['#receive_time'] = rec.receive_time
+            hdl = (params['#name'], params.get('oid'))
+            hdl = self.handlers.get(hdl, self.handle_default)
+            hdl(params)
+            return
+        name, names, buffers, oid_index = fmt
+        values = list(rec.params[0:len(names)])
+        for i in buffers:
+            start = values[i] & 0xff
+            end = start + (values[i] >> 8)
+            values[i] = bytes(bytearray(response.msg[start:end]))
+        oid = None
+        if oid_index >= 0:
+            oid = values[oid_index]
+        hdl = (name, oid)
+        if hdl in self.bulk_handlers:
+            bulk.setdefault(hdl, []).append((rec.receive_time, values))
+            return
+        params = dict(zip(names, values))
+        params['#name'] = name
+        params['#sent_time'] = rec.sent_time
+        params['#receive_time'] = rec.receive_time
+        hdl = self.handlers.get(hdl, self.handle_default)
+        hdl(params)
     def _bg_thread(self):
-        response = self.ffi_main.new('struct pull_queue_message *')
+        responses = self.ffi_main.new('struct pull_queue_message[%d]'
+                                      % (PULL_BATCH,))
+        records = self.ffi_main.new('struct msgdecode_record[%d]'
+                                    % (PULL_BATCH,))
         while 1:
-            self.ffi_lib.serialqueue_pull(self.serialqueue, response)
-            count = response.len
+            count = self.ffi_lib.serialqueue_pull_batch(
+                self.serialqueue, responses, PULL_BATCH)
             if count < 0:
                 break
-            if response.notify_id:
-                params = {'#sent_time': response.sent_time,
-                          '#receive_time': response.receive_time}
-                completion = self.pending_notifications.pop(response.notify_id)
-                self.reactor.async_complete(completion, params)
-                continue
-            params = self.msgparser.parse(response.msg[0:count])
-            params['#sent_time'] = response.sent_time
-            params['#receive_time'] = response.receive_time
-            hdl = (params['#name'], params.get('oid'))
-            try:
-                with self.lock:
-                    hdl = self.handlers.get(hdl, self.handle_default)
-                    hdl(params)
-            except:
-                logging.exception("Exception in serial callback")
+            msgparser, decoder, formats = self.decoder
+            self.ffi_lib.msgdecode_batch(decoder, responses, count, records)
+            bulk = {}
+            with self.lock:
+                for i in range(count):
+                    response = responses[i]
+                    if response.notify_id:
+                        params = {'#sent_time': response.sent_time,
+                                  '#receive_time': response.receive_time}
+                        completion = self.pending_notifications.pop(
+                            response.notify_id)
+                        self.reactor.async_complete(completion, params)
+                        continue
+                    try:
+                        self._handle_message(response, records[i],
+                                             msgparser, formats, bulk)
+                    except:
+                        logging.exception("Exception in serial callback")
+                for hdl, msgs in bulk.items():
+                    try:
+                        self.bulk_handlers[hdl](msgs)
+                    except:
+                        logging.exception("Exception in serial callback")
+    def _get_identify_info(self):
+        # Query the crc32 and size of the data dictionary (old firmware
+        # responds with empty data)
+        msg = "identify offset=%d count=%d" % (IDENTIFY_INFO_OFFSET, 8)
+        params = self.send_with_response(msg, 'identify_response')
+        data = params['data']
+        if params['offset'] != IDENTIFY_INFO_OFFSET or len(data) != 8:
+            return None
+        return struct.unpack('<II', data)
+    def _get_identify_cache_file(self, info):
+        if info is None or self.identify_cache_dir is None:
+            return None
+        return os.path.join(os.path.expanduser(self.identify_cache_dir),
+                            "%08x-%d.zlib" % info)
+    def _check_identify_info(self, data, info):
+        crc, size = info
+        return len(data) == size and zlib.crc32(data) & 0xffffffff == crc
+    def _load_identify_cache(self, filename, info):
+        try:
+            f = open(filename, 'rb')
+            data = f.read()
+            f.close()
+        except (IOError, OSError) as e:
+            return None
+        if not self._check_identify_info(data, info):
+            logging.warn("Ignoring invalid dictionary cache %s", filename)
+            return None
+        return data
+    def _save_identify_cache(self, filename, data, info):
+        if not self._check_identify_info(data, info):
+            logging.warn("Data dictionary does not match reported crc")
+            return
+        try:
+            dirname = os.path.dirname(filename)
+            if not os.path.exists(dirname):
+                os.makedirs(dirname)
+            tmpname = "%s.%d.tmp" % (filename, os.getpid())
+            f = open(tmpname, 'wb')
+            f.write(data)
+            f.close()
+            os.rename(tmpname, filename)
+        except (IOError, OSError) as e:
+            logging.warn("Unable to write dictionary cache %s: %s",
+                         filename, e)
     def _get_identify_data(self, eventtime):
+        # Check for a cached copy of the "data dictionary"
+        try:
+            info = self._get_identify_info()
+        except error as e:
+            logging.exception("Wait for identify_response")
+            return None
+        cache_file = self._get_identify_cache_file(info)
+        if cache_file is not None:
+            identify_data = self._load_identify_cache(cache_file, info)
+            if identify_data is not None:
+                logging.info("Loaded data dictionary from %s", cache_file)
+                return identify_data
         # Query the "data dictionary" from the micro-controller
         identify_data = ""
         while 1:
@@ -73,8 +209,51 @@ class SerialReader:
                 msgdata = params['data']
                 if not msgdata:
                     # Done
+                    if cache_file is not None:
+                        self._save_identify_cache(cache_file, identify_data,
+                                                  info)
                     return identify_data
                 identify_data += msgdata
+    def _start_session(self, serial_fd_type='u', client_id=0,
+                       bits_per_byte=BITS_PER_BYTE):
+        self.serialqueue = self.ffi_main.gc(
+            self.ffi_lib.serialqueue_alloc(self.ser.fileno(), serial_fd_type,
+                                           client_id),
+            self.ffi_lib.serialqueue_free)
+        self.background_thread = threading.Thread(target=self._bg_thread)
+        self.background_thread.start()
+        # Obtain and load the data dictionary from the firmware
+        completion = self.reactor.register_callback(self._get_identify_data)
+        identify_data = completion.wait(self.reactor.monotonic() + 5.)
+        if identify_data is None:
+            logging.info("Timeout on connect")
+            self.disconnect()
+            return False
+        msgparser = msgproto.MessageParser()
+        msgparser.process_identify(identify_data)
+        self.msgparser = msgparser
+        self.decoder = self._build_decoder(msgparser)
+        self.register_response(self.handle_unknown, '#unknown')
+        bl = binlog.get_binary_log()
+        if bl is not None:
+            source = bl.register_source(self.reactor.monotonic(),
+                                        self.serialport, identify_data)
+            self.ffi_lib.serialqueue_set_binlog(
+                self.serialqueue, bl.get_handle(), source)
+        # Setup baud adjust
+        mcu_baud = msgparser.get_constant_float('SERIAL_BAUD', None)
+        if mcu_baud is not None:
+            baud_adjust = bits_per_byte / mcu_baud
+            self.ffi_lib.serialqueue_set_baud_adjust(
+                self.serialqueue, baud_adjust)
+        receive_window = msgparser.get_constant_int('RECEIVE_WINDOW', None)
+        if receive_window is not None:
+            self.ffi_lib.serialqueue_set_receive_window(
+                self.serialqueue, receive_window)
+            # Reserve part of the window for high priority messages
+            self.ffi_lib.serialqueue_set_priority_reserve(
+                self.serialqueue, int(receive_window * PRIORITY_WINDOW_SHARE))
+        return True
     def connect(self):
         # Initial connection
         logging.info("Starting serial connect")
@@ -98,37 +277,64 @@ class SerialReader:
                 continue
             if self.baud:
                 stk500v2_leave(self.ser, self.reactor)
-            self.serialqueue = self.ffi_main.gc(
-                self.ffi_lib.serialqueue_alloc(self.ser.fileno(), 0),
-                self.ffi_lib.serialqueue_free)
-            self.background_thread = threading.Thread(target=self._bg_thread)
-            self.background_thread.start()
-            # Obtain and load the data dictionary from the firmware
-            completion = self.reactor.register_callback(self._get_identify_data)
-            identify_data = completion.wait(connect_time + 5.)
-            if identify_data is not None:
+            if self._start_session():
+                break
+    def _canbus_wait(self, can_id, check, timeout=CANBUS_TIMEOUT):
+        # Wait for a frame with the given id whose data passes check()
+        end_time = self.reactor.monotonic() + timeout
+        while 1:
+            frame = self.ser.recv()
+            if frame is None:
+                eventtime = self.reactor.monotonic()
+                if eventtime > end_time:
+                    return False
+                self.reactor.pause(eventtime + .001)
+            elif frame[0] == can_id and check(frame[1]):
+                return True
+    def _canbus_assign(self, uuid, txid):
+        # Check if the node already uses this id (empty frames are pings)
+        is_ping = (lambda data: not data)
+        self.ser.send(txid)
+        if self._canbus_wait(txid + 1, is_ping):
+            return True
+        # Find the unassigned node with the given uuid and assign the id
+        self.ser.send(CANBUS_ID_UUID)
+        if not self._canbus_wait(CANBUS_ID_UUID_RESP,
+                                 (lambda data: data == uuid)):
+            return False
+        self.ser.send(CANBUS_ID_SET, struct.pack('<H', txid) + uuid)
+        self.ser.send(txid)
+        return self._canbus_wait(txid + 1, is_ping)
+    def connect_canbus(self, canbus_uuid, canbus_nodeid, canbus_iface):
+        uuid = canbus_uuid_to_bytes(canbus_uuid)
+        txid = CANBUS_ID_BASE + 2 * canbus_nodeid
+        logging.info("Starting CAN connect")
+        start_time = self.reactor.monotonic()
+        while 1:
+            connect_time = self.reactor.monotonic()
+            if connect_time > start_time + 90.:
+                raise error("Unable to connect")
+            try:
+                self.ser = CANSocket(canbus_iface,
+                                     [txid + 1, CANBUS_ID_UUID_RESP])
+            except error as e:
+                logging.warn("Unable to open CAN port: %s", e)
+                self.reactor.pause(connect_time + 5.)
+                continue
+            if not self._canbus_assign(uuid, txid):
+                logging.info("CAN node %s not found on %s",
+                             canbus_uuid, canbus_iface)
+                self.disconnect()
+                self.reactor.pause(connect_time + 5.)
+                continue
+            if self._start_session('c', txid, CANBUS_BITS_PER_BYTE):
                 break
-            logging.info("Timeout on serial connect")
-            self.disconnect()
-        msgparser = msgproto.MessageParser()
-        msgparser.process_identify(identify_data)
-        self.msgparser = msgparser
-        self.register_response(self.handle_unknown, '#unknown')
-        # Setup baud adjust
-        mcu_baud = msgparser.get_constant_float('SERIAL_BAUD', None)
-        if mcu_baud is not None:
-            baud_adjust = self.BITS_PER_BYTE / mcu_baud
-            self.ffi_lib.serialqueue_set_baud_adjust(
-                self.serialqueue, baud_adjust)
-        receive_window = msgparser.get_constant_int('RECEIVE_WINDOW', None)
-        if receive_window is not None:
-            self.ffi_lib.serialqueue_set_receive_window(
-                self.serialqueue, receive_window)
     def connect_file(self, debugoutput, dictionary, pace=False):
         self.ser = debugoutput
         self.msgparser.process_identify(dictionary, decompress=False)
+        self.decoder = self._build_decoder(self.msgparser)
         self.serialqueue = self.ffi_main.gc(
-            self.ffi_lib.serialqueue_alloc(self.ser.fileno(), 1),
+            self.ffi_lib.serialqueue_alloc(self.ser.fileno(), 'f', 0),
             self.ffi_lib.serialqueue_free)
     def set_clock_est(self, freq, last_time, last_clock):
         self.ffi_lib.serialqueue_set_clock_est(
@@ -166,6 +372,24 @@ class SerialReader:
                 del self.handlers[name, oid]
             else:
                 self.handlers[name, oid] = callback
+    def register_bulk_response(self, callback, name, oid=None):
+        # The callback is invoked with a list of (receive_time, values)
+        # tuples (values in message format order) for all matching
+        # messages received in a single pull from the serialqueue
+        with self.lock:
+            if callback is None:
+                del self.bulk_handlers[name, oid]
+            else:
+                self.bulk_handlers[name, oid] = callback
+    def alloc_message_capture(self, name, oid=None, size=CAPTURE_SIZE,
+                              buf_size=CAPTURE_BUF_SIZE):
+        # Messages stored by a capture bypass the response handlers and
+        # are read in bulk as numpy arrays (None if numpy is unavailable)
+        try:
+            np = importlib.import_module('numpy')
+        except ImportError:
+            return None
+        return MessageCapture(self, np, name, oid, size, buf_size)
     # Command sending
     def raw_send(self, cmd, minclock, reqclock, cmd_queue):
         self.ffi_lib.serialqueue_send(self.serialqueue, cmd_queue,
@@ -188,9 +412,15 @@ class SerialReader:
         cmd = self.msgparser.create_command(msg)
         src = SerialRetryCommand(self, response)
         return src.get_response(cmd, self.default_cmd_queue)
-    def alloc_command_queue(self):
-        return self.ffi_main.gc(self.ffi_lib.serialqueue_alloc_commandqueue(),
-                                self.ffi_lib.serialqueue_free_commandqueue)
+    def alloc_command_queue(self, high_priority=False):
+        cmd_queue = self.ffi_main.gc(
+            self.ffi_lib.serialqueue_alloc_commandqueue(),
+            self.ffi_lib.serialqueue_free_commandqueue)
+        if high_priority:
+            # Messages on this queue preempt bulk messages (eg, steps)
+            self.ffi_lib.serialqueue_set_commandqueue_priority(
+                cmd_queue, self.ffi_lib.SQ_PRIORITY_HIGH)
+        return cmd_queue
     # Dumping debug lists
     def dump_debug(self):
         out = []
@@ -254,6 +484,100 @@ class SerialRetryCommand:
             retries -= 1
             retry_delay *= 2.
 
+# Bulk storage of a high rate response message (see msgdecode.c)
+class MessageCapture:
+    def __init__(self, serial, np, name, oid, size, buf_size):
+        self.np = np
+        self.ffi_main, self.ffi_lib = serial.ffi_main, serial.ffi_lib
+        self.serialqueue = serial.serialqueue
+        mp = serial.get_msgparser().messages_by_name.get(name)
+        if mp is None:
+            raise error("Unknown message '%s'" % (name,))
+        types = [t.decode_type for t in mp.param_types]
+        if None in types:
+            raise error("Message '%s' can not be captured" % (name,))
+        self.names = [n for n, t in mp.param_names if not t.is_dynamic_string]
+        oid_index = -1
+        if oid is not None:
+            oid_index = [n for n, t in mp.param_names].index('oid')
+        capture = self.ffi_lib.msgcapture_alloc(
+            mp.msgid, types, len(types), oid_index, oid or 0, buf_size, size)
+        if capture == self.ffi_main.NULL:
+            raise error("Unable to capture message '%s'" % (name,))
+        self.capture = self.ffi_main.gc(capture, self.ffi_lib.msgcapture_free)
+        self.region = self.ffi_main.new('struct msgcapture_region *')
+        self.dropped = 0
+        if self.ffi_lib.serialqueue_add_capture(self.serialqueue,
+                                                self.capture):
+            raise error("Too many message captures")
+    def get_samples(self):
+        # Return (times, values, data, lengths) views of the next run of
+        # stored messages - call release() once they are no longer used
+        np, ffi_main = self.np, self.ffi_main
+        r = self.region
+        count = self.ffi_lib.msgcapture_peek(self.capture, r)
+        self.dropped = r.dropped
+        times = np.frombuffer(ffi_main.buffer(r.times, count * 8),
+                              np.float64)
+        values = np.frombuffer(
+            ffi_main.buffer(r.values, count * r.int_count * 8), np.int64)
+        data = np.frombuffer(ffi_main.buffer(r.data, count * r.buf_size),
+                             np.uint8)
+        lengths = np.frombuffer(ffi_main.buffer(r.lengths, count), np.uint8)
+        return (times, values.reshape(count, r.int_count),
+                data.reshape(count, r.buf_size), lengths)
+    def release(self, count):
+        self.ffi_lib.msgcapture_release(self.capture, count)
+    def close(self):
+        self.ffi_lib.serialqueue_remove_capture(self.serialqueue, self.capture)
+
+######################################################################
+# CAN bus support
+######################################################################
+
+CANBUS_FRAME = struct.Struct('<IB3x8s')
+
+# Convert a canbus_uuid config string (12 hex digits) to its wire format
+def canbus_uuid_to_bytes(canbus_uuid):
+    try:
+        uuid = binascii.unhexlify(canbus_uuid)
+    except (TypeError, binascii.Error):
+        uuid = ""
+    if len(uuid) != CANBUS_UUID_LEN:
+        raise error("Invalid canbus_uuid '%s'" % (canbus_uuid,))
+    return uuid
+
+# Raw SocketCAN socket (opened in C as python2 lacks AF_CAN support)
+class CANSocket:
+    def __init__(self, iface, rx_ids):
+        ffi_main, self.ffi_lib = chelper.get_ffi()
+        self.fd = self.ffi_lib.serialqueue_open_canbus(
+            iface, ffi_main.new('uint32_t[]', rx_ids), len(rx_ids))
+        if self.fd < 0:
+            raise error("Unable to open CAN interface '%s'" % (iface,))
+        util.set_nonblock(self.fd)
+    def fileno(self):
+        return self.fd
+    def send(self, can_id, data=""):
+        os.write(self.fd, CANBUS_FRAME.pack(can_id, len(data), data))
+    def recv(self):
+        # Return (can_id, data) of the next pending frame or None
+        try:
+            frame = os.read(self.fd, CANBUS_FRAME.size)
+        except OSError as e:
+            if e.errno == errno.EAGAIN:
+                return None
+            raise
+        can_id, dlc, data = CANBUS_FRAME.unpack(frame)
+        return can_id, data[:dlc]
+    def close(self):
+        os.close(self.fd)
+
+
+######################################################################
+# Serial port reset helpers
+######################################################################
+
 # Attempt to place an AVR stk500v2 style programmer into normal mode
 def stk500v2_leave(ser, reactor):
     logging.debug("Starting stk500v2 leave programmer sequence")
@@ -10,6 +10,40 @@ import mcu, homing, chelper, kinematics.extruder
 #   mm/second), _v2 is velocity squared (mm^2/s^2), _t is time (in
 #   seconds), _r is ratio (scalar between 0.0 and 1.0)
 
+# Return the duration of a jerk limited (S-curve) velocity change of
+# 'delta_v' and the length of the linear acceleration ramps at each
+# end of it
+def calc_scurve_t(delta_v, accel, max_jerk):
+    if delta_v * max_jerk >= accel**2:
+        # The acceleration reaches 'accel' and holds it between ramps
+        jerk_t = accel / max_jerk
+        return delta_v / accel + jerk_t, jerk_t
+    # The acceleration ramps up and straight back down
+    jerk_t = math.sqrt(delta_v / max_jerk)
+    return 2. * jerk_t, jerk_t
+
+# Return the highest velocity that a jerk limited velocity change from
+# (or to) 'start_v' can reach within 'move_d'
+def calc_scurve_reach_v(start_v, move_d, accel, max_jerk):
+    jerk_v = accel**2 / max_jerk
+    if move_d >= (2. * start_v + jerk_v) * accel / max_jerk:
+        # Long enough to reach 'accel' - solve
+        # (start_v + reach_v) * .5 * calc_scurve_t(...) = move_d
+        half_jerk_v = .5 * jerk_v
+        return math.sqrt((start_v - half_jerk_v)**2
+                         + 2. * accel * move_d) - half_jerk_v
+    # Solve (2*start_v + delta_v) * sqrt(delta_v / max_jerk) = move_d
+    # for sqrt(delta_v) (a depressed cubic with a single real root)
+    # using Cardano's formula (root = a - b with a*b = p/3, written in
+    # a form that avoids the cancellation of a - b)
+    p, q = 2. * start_v, move_d * math.sqrt(max_jerk)
+    a = (math.sqrt(.25 * q**2 + p**3 / 27.) + .5 * q)**(1. / 3.)
+    b = p / (3. * a)
+    root_dv = q / (a * a + a * b + b * b)
+    return start_v + root_dv**2
+
+SCURVE_CRUISE_ITERATIONS = 12
+
 # Class to track each move request
 class Move:
     def __init__(self, toolhead, start_pos, end_pos, speed):
@@ -17,9 +51,11 @@ class Move:
         self.start_pos = tuple(start_pos)
         self.end_pos = tuple(end_pos)
         self.accel = toolhead.max_accel
+        self.max_jerk = toolhead.max_jerk
         self.timing_callbacks = []
         velocity = min(speed, toolhead.max_velocity)
         self.is_kinematic_move = True
+        self.is_arc_move = False
         self.axes_d = axes_d = [end_pos[i] - start_pos[i] for i in (0, 1, 2, 3)]
         self.move_d = move_d = math.sqrt(sum([d*d for d in axes_d[:3]]))
         if move_d < .000000001:
@@ -32,11 +68,12 @@ class Move:
             if move_d:
                 inv_move_d = 1. / move_d
             self.accel = 99999999.9
+            self.max_jerk = 0.
             velocity = speed
             self.is_kinematic_move = False
         else:
             inv_move_d = 1. / move_d
-        self.axes_r = [d * inv_move_d for d in axes_d]
+        self.axes_r = self.end_axes_r = [d * inv_move_d for d in axes_d]
         self.min_move_t = move_d / velocity
         # Junction speeds are tracked in velocity squared.  The
         # delta_v2 is the maximum amount of this squared-velocity that
@@ -46,6 +83,7 @@ class Move:
         self.delta_v2 = 2.0 * move_d * self.accel
         self.max_smoothed_v2 = 0.
         self.smooth_delta_v2 = 2.0 * move_d * toolhead.max_accel_to_decel
+        self.curve_v2 = 0.
     def limit_speed(self, speed, accel):
         speed2 = speed**2
         if speed2 < self.max_cruise_v2:
@@ -54,10 +92,29 @@ class Move:
         self.accel = min(self.accel, accel)
         self.delta_v2 = 2.0 * self.move_d * self.accel
         self.smooth_delta_v2 = min(self.smooth_delta_v2, self.delta_v2)
+    def calc_reachable_v2(self, v2):
+        # Return the highest velocity (squared) that can be changed to
+        # or from 'v2' within the move.  Jerk limited velocity changes
+        # take longer than constant acceleration ones.
+        if not self.max_jerk:
+            return v2 + self.delta_v2
+        return calc_scurve_reach_v(math.sqrt(v2), self.move_d, self.accel,
+                                   self.max_jerk)**2
+    def calc_reachable_smoothed_v2(self, v2):
+        # The smoothed velocity must not be able to change more than
+        # the real one
+        reach_v2 = v2 + self.smooth_delta_v2
+        if not self.max_jerk:
+            return reach_v2
+        return min(reach_v2, self.calc_reachable_v2(v2))
     def move_error(self, msg="Move out of range"):
         ep = self.end_pos
         m = "%s: %.3f %.3f %.3f [%.3f]" % (msg, ep[0], ep[1], ep[2], ep[3])
         return self.toolhead.printer.command_error(m)
+    def get_pos(self, dist):
+        # Return the XYZ position 'dist' mm along the move
+        return tuple([self.start_pos[i] + self.axes_r[i] * dist
+                      for i in (0, 1, 2)])
     def calc_junction(self, prev_move):
         if not self.is_kinematic_move or not prev_move.is_kinematic_move:
             return
@@ -65,7 +122,7 @@ class Move:
         extruder_v2 = self.toolhead.extruder.calc_junction(prev_move, self)
         # Find max velocity using "approximated centripetal velocity"
         axes_r = self.axes_r
-        prev_axes_r = prev_move.axes_r
+        prev_axes_r = prev_move.end_axes_r
         junction_cos_theta = -(axes_r[0] * prev_axes_r[0]
                                + axes_r[1] * prev_axes_r[1]
                                + axes_r[2] * prev_axes_r[2])
@@ -80,16 +137,31 @@ class Move:
         move_centripetal_v2 = .5 * self.move_d * tan_theta_d2 * self.accel
         prev_move_centripetal_v2 = (.5 * prev_move.move_d * tan_theta_d2
                                     * prev_move.accel)
+        junction_v2 = min(R * self.accel, R * prev_move.accel,
+                          move_centripetal_v2, prev_move_centripetal_v2)
+        if self.curve_v2:
+            # Junction lies on a smooth curve - also apply its
+            # centripetal limit
+            junction_v2 = min(junction_v2, self.curve_v2)
         # Apply limits
         self.max_start_v2 = min(
-            R * self.accel, R * prev_move.accel,
-            move_centripetal_v2, prev_move_centripetal_v2,
+            junction_v2,
             extruder_v2, self.max_cruise_v2, prev_move.max_cruise_v2,
-            prev_move.max_start_v2 + prev_move.delta_v2)
+            prev_move.calc_reachable_v2(prev_move.max_start_v2))
         self.max_smoothed_v2 = min(
             self.max_start_v2
-            , prev_move.max_smoothed_v2 + prev_move.smooth_delta_v2)
+            , prev_move.calc_reachable_smoothed_v2(prev_move.max_smoothed_v2))
     def set_junction(self, start_v2, cruise_v2, end_v2):
+        self.accel_jerk_t = self.decel_jerk_t = 0.
+        if self.max_jerk:
+            # Keep the junction velocities - a cruise velocity of
+            # max(start_v, end_v) always fits (see set_scurve_junction)
+            cruise_v2 = max(cruise_v2, start_v2, end_v2)
+            self.set_scurve_junction(math.sqrt(start_v2), math.sqrt(cruise_v2),
+                                     math.sqrt(end_v2))
+            return
+        start_v2 = min(start_v2, cruise_v2)
+        end_v2 = min(end_v2, cruise_v2)
         # Determine accel, cruise, and decel portions of the move distance
         half_inv_accel = .5 / self.accel
         accel_d = (cruise_v2 - start_v2) * half_inv_accel
@@ -104,8 +176,119 @@ class Move:
         self.accel_t = accel_d / ((start_v + cruise_v) * 0.5)
         self.cruise_t = cruise_d / cruise_v
         self.decel_t = decel_d / ((end_v + cruise_v) * 0.5)
+    def calc_scurve_cruise_d(self, start_v, cruise_v, end_v):
+        # Determine the jerk limited accel and decel portions and
+        # return the distance left for cruising
+        accel, max_jerk = self.accel, self.max_jerk
+        self.accel_t, self.accel_jerk_t = calc_scurve_t(
+            cruise_v - start_v, accel, max_jerk)
+        self.decel_t, self.decel_jerk_t = calc_scurve_t(
+            cruise_v - end_v, accel, max_jerk)
+        # The acceleration ramps are symmetric, so the average velocity
+        # of each portion is the mean of its start and end velocity
+        return (self.move_d - (start_v + cruise_v) * .5 * self.accel_t
+                - (end_v + cruise_v) * .5 * self.decel_t)
+    def set_scurve_junction(self, start_v, cruise_v, end_v):
+        # Jerk limited velocity changes take longer (and cover more
+        # distance) than the constant acceleration ones that lookahead
+        # planned with.  Lower the cruise velocity until they fit in
+        # the move.  Lookahead limits the junction velocities (see
+        # calc_reachable_v2) so they fit with a cruise velocity of
+        # max(start_v, end_v).
+        cruise_d = self.calc_scurve_cruise_d(start_v, cruise_v, end_v)
+        if cruise_d < 0.:
+            low_v, high_v = max(start_v, end_v), cruise_v
+            for i in range(SCURVE_CRUISE_ITERATIONS):
+                cruise_v = .5 * (low_v + high_v)
+                if self.calc_scurve_cruise_d(start_v, cruise_v, end_v) < 0.:
+                    high_v = cruise_v
+                else:
+                    low_v = cruise_v
+            cruise_v = low_v
+            cruise_d = self.calc_scurve_cruise_d(start_v, cruise_v, end_v)
+        self.start_v = start_v
+        self.cruise_v = cruise_v
+        self.end_v = end_v
+        self.cruise_t = 0.
+        if cruise_d > 0.:
+            self.cruise_t = cruise_d / cruise_v
+
+# Class to track a move along a circular arc in the XY plane
+class ArcMove(Move):
+    def __init__(self, toolhead, start_pos, end_pos, center, angle, speed):
+        self.toolhead = toolhead
+        self.start_pos = tuple(start_pos)
+        self.end_pos = tuple(end_pos)
+        self.center = tuple(center)
+        self.accel = toolhead.max_accel
+        self.max_jerk = toolhead.max_jerk
+        self.timing_callbacks = []
+        velocity = min(speed, toolhead.max_velocity)
+        self.is_kinematic_move = self.is_arc_move = True
+        self.axes_d = axes_d = [end_pos[i] - start_pos[i] for i in (0, 1, 2, 3)]
+        # Path length of the (possibly helical) arc
+        rx, ry = start_pos[0] - center[0], start_pos[1] - center[1]
+        self.radius = radius = math.sqrt(rx*rx + ry*ry)
+        arc_d = radius * abs(angle)
+        self.move_d = move_d = math.sqrt(arc_d*arc_d + axes_d[2]*axes_d[2])
+        if move_d < .000000001:
+            self.move_d = 0.
+            return
+        inv_move_d = 1. / move_d
+        self.angle_r = angle_r = angle * inv_move_d
+        # The move direction is the arc tangent at each end of the move
+        erx, ery = end_pos[0] - center[0], end_pos[1] - center[1]
+        self.axes_r = [-ry * angle_r, rx * angle_r,
+                       axes_d[2] * inv_move_d, axes_d[3] * inv_move_d]
+        self.end_axes_r = [-ery * angle_r, erx * angle_r,
+                           axes_d[2] * inv_move_d, axes_d[3] * inv_move_d]
+        # Limit velocity so that the centripetal acceleration of the
+        # XY motion stays within max_accel
+        max_cruise_v2 = velocity**2
+        if arc_d:
+            xy_r = arc_d * inv_move_d
+            max_cruise_v2 = min(max_cruise_v2,
+                                self.accel * radius / (xy_r * xy_r))
+        self.min_move_t = move_d / math.sqrt(max_cruise_v2)
+        self.max_start_v2 = 0.
+        self.max_cruise_v2 = max_cruise_v2
+        self.delta_v2 = 2.0 * move_d * self.accel
+        self.max_smoothed_v2 = 0.
+        self.smooth_delta_v2 = 2.0 * move_d * toolhead.max_accel_to_decel
+        self.curve_v2 = 0.
+    def get_pos(self, dist):
+        cx, cy = self.center[:2]
+        rx, ry = self.start_pos[0] - cx, self.start_pos[1] - cy
+        angle = self.angle_r * dist
+        c, s = math.cos(angle), math.sin(angle)
+        return (cx + rx * c - ry * s, cy + rx * s + ry * c,
+                self.start_pos[2] + self.axes_r[2] * dist)
+    def get_extreme_positions(self):
+        # Return the points where the arc reaches its extent along X
+        # and Y, or reaches its closest or furthest from the XY origin
+        cx, cy = self.center[:2]
+        rx, ry = self.start_pos[0] - cx, self.start_pos[1] - cy
+        start_angle = math.atan2(ry, rx)
+        sweep = self.angle_r * self.move_d
+        angles = [0., .5 * math.pi, math.pi, 1.5 * math.pi]
+        if cx or cy:
+            origin_angle = math.atan2(cy, cx)
+            angles += [origin_angle, origin_angle + math.pi]
+        res = []
+        for angle in angles:
+            if sweep > 0.:
+                turn = (angle - start_angle) % (2. * math.pi)
+            else:
+                turn = (start_angle - angle) % (2. * math.pi)
+            if turn < abs(sweep):
+                pos = list(self.start_pos)
+                pos[0] = cx + self.radius * math.cos(angle)
+                pos[1] = cy + self.radius * math.sin(angle)
+                res.append(pos)
+        return res
 
 LOOKAHEAD_FLUSH_TIME = 0.250
+CURVATURE_MAX_MOVES = 32
 
 # Class to track a list of pending move requests and to facilitate
 # "look-ahead" across moves to reduce acceleration between moves.
@@ -114,16 +297,104 @@ class MoveQueue:
         self.toolhead = toolhead
         self.queue = []
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
+        # Curvature estimation - moves are held in 'pending' until the
+        # path 'curvature_window' mm ahead of them is known
+        self.curvature_window = 0.
+        self.pending = []
+        self.pending_d = 0.
+        self.history = []
     def reset(self):
         del self.queue[:]
+        del self.pending[:]
+        del self.history[:]
+        self.pending_d = 0.
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
     def set_flush_time(self, flush_time):
         self.junction_flush = flush_time
+    def set_curvature_window(self, window):
+        self.curvature_window = window
     def get_last(self):
+        if self.pending:
+            return self.pending[-1]
         if self.queue:
             return self.queue[-1]
         return None
+    def is_empty(self):
+        return not self.queue and not self.pending
+    def _calc_curvature_radius(self, move):
+        # Find the path points curvature_window mm (along the path)
+        # before and after the start of this move
+        window = self.curvature_window
+        back_pos = None
+        start_pos = move.start_pos
+        dist = 0.
+        for m in reversed(self.history):
+            if m.end_pos[:3] != start_pos[:3]:
+                break
+            if dist + m.move_d >= window:
+                back_pos = m.get_pos(dist + m.move_d - window)
+                break
+            back_pos = start_pos = m.start_pos
+            dist += m.move_d
+        if back_pos is None:
+            return None
+        fwd_pos = None
+        end_pos = move.start_pos
+        dist = 0.
+        for m in [move] + self.pending:
+            if not m.is_kinematic_move or m.start_pos[:3] != end_pos[:3]:
+                break
+            if dist + m.move_d >= window:
+                fwd_pos = m.get_pos(window - dist)
+                break
+            fwd_pos = end_pos = m.end_pos
+            dist += m.move_d
+        # Radius of the circle through the three points
+        a = [back_pos[i] - move.start_pos[i] for i in (0, 1, 2)]
+        b = [fwd_pos[i] - move.start_pos[i] for i in (0, 1, 2)]
+        cross = [a[1]*b[2] - a[2]*b[1], a[2]*b[0] - a[0]*b[2],
+                 a[0]*b[1] - a[1]*b[0]]
+        cross_d = math.sqrt(sum([c*c for c in cross]))
+        if cross_d < .000000001:
+            return None
+        a_d2 = sum([c*c for c in a])
+        b_d2 = sum([c*c for c in b])
+        ab_d2 = sum([(b[i] - a[i])**2 for i in (0, 1, 2)])
+        return math.sqrt(a_d2 * b_d2 * ab_d2) / (2. * cross_d)
+    def _calc_curvature_limit(self, move):
+        radius = self._calc_curvature_radius(move)
+        if radius is None:
+            return
+        # The junction with the previous move is part of a curve (and
+        # not a sharp corner) if the estimated circle makes its turn
+        # within both the window and the two moves.  (The circle
+        # through a corner and the path points a window away from it
+        # always takes more than the window to make the corner's turn.)
+        prev_move = self.history[-1]
+        junction_cos_theta = sum([prev_move.end_axes_r[i] * move.axes_r[i]
+                                  for i in (0, 1, 2)])
+        turn = math.acos(max(-1., min(1., junction_cos_theta)))
+        max_turn_d = min(prev_move.move_d + move.move_d,
+                         self.curvature_window)
+        if turn * radius > max_turn_d:
+            return
+        # Limit the centripetal acceleration along the estimated circle
+        move.curve_v2 = curve_v2 = move.accel * radius
+        move.limit_speed(math.sqrt(curve_v2), move.accel)
+    def _queue_pending(self):
+        move = self.pending.pop(0)
+        self.pending_d -= move.move_d
+        if move.is_kinematic_move:
+            self._calc_curvature_limit(move)
+            self.history.append(move)
+            del self.history[:-CURVATURE_MAX_MOVES]
+        else:
+            del self.history[:]
+        self._queue_move(move)
     def flush(self, lazy=False):
+        if not lazy:
+            while self.pending:
+                self._queue_pending()
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
         update_flush_count = lazy
         queue = self.queue
@@ -135,14 +406,15 @@ class MoveQueue:
         next_end_v2 = next_smoothed_v2 = peak_cruise_v2 = 0.
         for i in range(flush_count-1, -1, -1):
             move = queue[i]
-            reachable_start_v2 = next_end_v2 + move.delta_v2
+            reachable_start_v2 = move.calc_reachable_v2(next_end_v2)
             start_v2 = min(move.max_start_v2, reachable_start_v2)
-            reachable_smoothed_v2 = next_smoothed_v2 + move.smooth_delta_v2
+            reachable_smoothed_v2 = move.calc_reachable_smoothed_v2(
+                next_smoothed_v2)
             smoothed_v2 = min(move.max_smoothed_v2, reachable_smoothed_v2)
             if smoothed_v2 < reachable_smoothed_v2:
                 # It's possible for this move to accelerate
-                if (smoothed_v2 + move.smooth_delta_v2 > next_smoothed_v2
-                    or delayed):
+                if (move.calc_reachable_smoothed_v2(smoothed_v2)
+                    > next_smoothed_v2 or delayed):
                     # This move can decelerate or this is a full accel
                     # move after a full decel move
                     if update_flush_count and peak_cruise_v2:
@@ -156,14 +428,12 @@ class MoveQueue:
                             mc_v2 = peak_cruise_v2
                             for m, ms_v2, me_v2 in reversed(delayed):
                                 mc_v2 = min(mc_v2, ms_v2)
-                                m.set_junction(min(ms_v2, mc_v2), mc_v2
-                                               , min(me_v2, mc_v2))
+                                m.set_junction(ms_v2, mc_v2, me_v2)
                         del delayed[:]
                 if not update_flush_count and i < flush_count:
                     cruise_v2 = min((start_v2 + reachable_start_v2) * .5
                                     , move.max_cruise_v2, peak_cruise_v2)
-                    move.set_junction(min(start_v2, cruise_v2), cruise_v2
-                                      , min(next_end_v2, cruise_v2))
+                    move.set_junction(start_v2, cruise_v2, next_end_v2)
             else:
                 # Delay calculating this move until peak_cruise_v2 is known
                 delayed.append((move, start_v2, next_end_v2))
@@ -176,6 +446,16 @@ class MoveQueue:
         # Remove processed moves from the queue
         del queue[:flush_count]
     def add_move(self, move):
+        if self.curvature_window:
+            self.pending.append(move)
+            self.pending_d += move.move_d
+            pending = self.pending
+            while pending and (self.pending_d >= self.curvature_window
+                               or len(pending) > CURVATURE_MAX_MOVES):
+                self._queue_pending()
+            return
+        self._queue_move(move)
+    def _queue_move(self, move):
         self.queue.append(move)
         if len(self.queue) == 1:
             return
@@ -207,6 +487,7 @@ class ToolHead:
             self.can_pause = False
         self.move_queue = MoveQueue(self)
         self.commanded_pos = [0., 0., 0., 0.]
+        self.pending_move_flushers = []
         self.printer.register_event_handler("klippy:shutdown",
                                             self._handle_shutdown)
         # Velocity and acceleration control
@@ -217,6 +498,9 @@ class ToolHead:
         self.max_accel_to_decel = self.requested_accel_to_decel
         self.square_corner_velocity = config.getfloat(
             'square_corner_velocity', 5., minval=0.)
+        self.move_queue.set_curvature_window(
+            config.getfloat('curvature_window', 0., minval=0.))
+        self.max_jerk = config.getfloat('max_jerk', 0., minval=0.)
         self.config_max_velocity = self.max_velocity
         self.config_max_accel = self.max_accel
         self.config_square_corner_velocity = self.square_corner_velocity
@@ -247,6 +531,8 @@ class ToolHead:
         ffi_main, ffi_lib = chelper.get_ffi()
         self.trapq = ffi_main.gc(ffi_lib.trapq_alloc(), ffi_lib.trapq_free)
         self.trapq_append = ffi_lib.trapq_append
+        self.trapq_append_scurve = ffi_lib.trapq_append_scurve
+        self.trapq_append_arc = ffi_lib.trapq_append_arc
         self.trapq_free_moves = ffi_lib.trapq_free_moves
         self.step_generators = []
         # Create kinematics class
@@ -316,7 +602,24 @@ class ToolHead:
         # Queue moves into trapezoid motion queue (trapq)
         next_move_time = self.print_time
         for move in moves:
-            if move.is_kinematic_move:
+            if move.is_arc_move:
+                self.trapq_append_arc(
+                    self.trapq, next_move_time,
+                    move.accel_t, move.accel_jerk_t, move.cruise_t,
+                    move.decel_t, move.decel_jerk_t,
+                    move.start_pos[0], move.start_pos[1], move.start_pos[2],
+                    move.center[0], move.center[1],
+                    move.angle_r, move.axes_r[2],
+                    move.start_v, move.cruise_v, move.end_v)
+            elif move.is_kinematic_move and move.max_jerk:
+                self.trapq_append_scurve(
+                    self.trapq, next_move_time,
+                    move.accel_t, move.accel_jerk_t, move.cruise_t,
+                    move.decel_t, move.decel_jerk_t,
+                    move.start_pos[0], move.start_pos[1], move.start_pos[2],
+                    move.axes_r[0], move.axes_r[1], move.axes_r[2],
+                    move.start_v, move.cruise_v, move.end_v)
+            elif move.is_kinematic_move:
                 self.trapq_append(
                     self.trapq, next_move_time,
                     move.accel_t, move.cruise_t, move.decel_t,
@@ -334,8 +637,13 @@ class ToolHead:
             self._update_drip_move_time(next_move_time)
         self._update_move_time(next_move_time)
         self.last_kin_move_time = next_move_time
+    def _flush_pending_moves(self):
+        # Have any pre-planner stage submit the moves it is holding back
+        for cb in self.pending_move_flushers:
+            cb()
     def flush_step_generation(self):
         # Transition from "Flushed"/"Priming"/main state to "Flushed" state
+        self._flush_pending_moves()
         self.move_queue.flush()
         self.special_queuing_state = "Flushed"
         self.need_check_stall = -1.
@@ -347,6 +655,7 @@ class ToolHead:
         self.last_kin_flush_time = max(self.last_kin_flush_time, flush_time)
         self._update_move_time(max(self.print_time, self.last_kin_flush_time))
     def _flush_lookahead(self):
+        self._flush_pending_moves()
         if self.special_queuing_state:
             return self.flush_step_generation()
         self.move_queue.flush()
@@ -400,6 +709,7 @@ class ToolHead:
         return self.reactor.NEVER
     # Movement commands
     def get_position(self):
+        self._flush_pending_moves()
         return list(self.commanded_pos)
     def set_position(self, newpos, homing_axes=()):
         self.flush_step_generation()
@@ -419,7 +729,44 @@ class ToolHead:
         self.move_queue.add_move(move)
         if self.print_time > self.need_check_stall:
             self._check_stall()
+    def arc_move(self, newpos, center, angle, speed):
+        # The arc keeps its start radius.  If 'newpos' is not on that
+        # circle, end the arc on it and finish with a short line so the
+        # queued moves end at 'newpos'.
+        start_pos = self.commanded_pos
+        rx, ry = start_pos[0] - center[0], start_pos[1] - center[1]
+        c, s = math.cos(angle), math.sin(angle)
+        arc_end = list(newpos)
+        arc_end[0] = center[0] + rx * c - ry * s
+        arc_end[1] = center[1] + rx * s + ry * c
+        miss_d = math.sqrt((newpos[0] - arc_end[0])**2
+                           + (newpos[1] - arc_end[1])**2)
+        if miss_d < .000000001:
+            miss_d = 0.
+            arc_end[0], arc_end[1] = newpos[0], newpos[1]
+        elif newpos[3] != start_pos[3]:
+            # Share the extrusion between the arc and the line
+            arc_d = math.sqrt(rx*rx + ry*ry) * abs(angle)
+            arc_d = math.sqrt(arc_d**2 + (newpos[2] - start_pos[2])**2)
+            arc_end[3] = start_pos[3] + ((newpos[3] - start_pos[3])
+                                         * arc_d / (arc_d + miss_d))
+        move = ArcMove(self, start_pos, arc_end, center, angle, speed)
+        if not move.move_d:
+            self.move(newpos, speed)
+            return
+        for pos in move.get_extreme_positions():
+            self.kin.check_move(Move(self, move.start_pos, pos, speed))
+        self.kin.check_move(move)
+        if move.axes_d[3]:
+            self.extruder.check_move(move)
+        self.commanded_pos[:] = move.end_pos
+        self.move_queue.add_move(move)
+        if miss_d:
+            self.move(newpos, speed)
+        elif self.print_time > self.need_check_stall:
+            self._check_stall()
     def manual_move(self, coord, speed):
+        self._flush_pending_moves()
         curpos = list(self.commanded_pos)
         for i in range(len(coord)):
             if coord[i] is not None:
@@ -460,6 +807,7 @@ class ToolHead:
             self._update_move_time(npt)
     def drip_move(self, newpos, speed, drip_completion):
         # Transition from "Flushed"/"Priming"/main state to "Drip" state
+        self._flush_pending_moves()
         self.move_queue.flush()
         self.special_queuing_state = "Drip"
         self.need_check_stall = self.reactor.NEVER
@@ -493,7 +841,7 @@ class ToolHead:
             self.print_time, max(buffer_time, 0.), self.print_stall)
     def check_busy(self, eventtime):
         est_print_time = self.mcu.estimated_print_time(eventtime)
-        lookahead_empty = not self.move_queue.queue
+        lookahead_empty = self.move_queue.is_empty()
         return self.print_time, est_print_time, lookahead_empty
     def get_status(self, eventtime):
         print_time = self.print_time
@@ -506,6 +854,7 @@ class ToolHead:
                      'max_velocity': self.max_velocity,
                      'max_accel': self.max_accel,
                      'max_accel_to_decel': self.requested_accel_to_decel,
+                     'max_jerk': self.max_jerk,
                      'square_corner_velocity': self.square_corner_velocity})
         return res
     def _handle_shutdown(self):
@@ -526,7 +875,10 @@ class ToolHead:
             self.kin_flush_times.append(delay)
         new_delay = max(self.kin_flush_times + [SDS_CHECK_TIME])
         self.kin_flush_delay = new_delay
+    def register_pending_move_flusher(self, cb):
+        self.pending_move_flushers.append(cb)
     def register_lookahead_callback(self, callback):
+        self._flush_pending_moves()
         last_move = self.move_queue.get_last()
         if last_move is None:
             callback(self.get_last_move_time())
@@ -563,6 +915,7 @@ class ToolHead:
             'SQUARE_CORNER_VELOCITY', self.square_corner_velocity, minval=0.)
         self.requested_accel_to_decel = gcmd.get_float(
             'ACCEL_TO_DECEL', self.requested_accel_to_decel, above=0.)
+        self.max_jerk = gcmd.get_float('JERK', self.max_jerk, minval=0.)
         self.max_velocity = min(max_velocity, self.config_max_velocity)
         self.max_accel = min(max_accel, self.config_max_accel)
         self.square_corner_velocity = min(square_corner_velocity,
@@ -571,9 +924,10 @@ class ToolHead:
         msg = ("max_velocity: %.6f\n"
                "max_accel: %.6f\n"
                "max_accel_to_decel: %.6f\n"
+               "max_jerk: %.6f\n"
                "square_corner_velocity: %.6f"% (
                    self.max_velocity, self.max_accel,
-                   self.requested_accel_to_decel,
+                   self.requested_accel_to_decel, self.max_jerk,
                    self.square_corner_velocity))
         self.printer.set_rollover_info("toolhead", "toolhead: %s" % (msg,))
         gcmd.respond_info(msg, log=False)
@@ -0,0 +1,63 @@
+#!/usr/bin/env python2
+# Benchmark the mcu connect time with and without the dictionary cache
+#
+# Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import optparse, os, sys, shutil, tempfile, logging
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                             '../klippy'))
+import reactor, serialhdl
+
+def time_connect(r, serialport, baud, cache_dir):
+    ser = serialhdl.SerialReader(r, serialport, baud)
+    ser.identify_cache_dir = cache_dir
+    start = r.monotonic()
+    ser.connect()
+    elapsed = r.monotonic() - start
+    size = len(ser.get_msgparser().raw_identify_data)
+    ser.disconnect()
+    return elapsed, size
+
+def run_bench(r, serialport, baud, loops):
+    cache_dir = tempfile.mkdtemp(prefix="identify-")
+    try:
+        results = []
+        for name, cdir in [("uncached", None), ("cached", cache_dir)]:
+            if cdir is not None:
+                # Populate the cache
+                time_connect(r, serialport, baud, cdir)
+            times = []
+            for i in range(loops):
+                elapsed, size = time_connect(r, serialport, baud, cdir)
+                times.append(elapsed)
+            results.append((name, times, size))
+    finally:
+        shutil.rmtree(cache_dir)
+    base = min(results[0][1])
+    for name, times, size in results:
+        print("%-9s min=%.3fs avg=%.3fs max=%.3fs (%d byte dictionary) x%.2f"
+              % (name, min(times), sum(times) / len(times), max(times),
+                 size, base / min(times)))
+    r.end()
+
+def main():
+    usage = "%prog [options] <serialdevice> <baud>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-l", "--loops", type="int", dest="loops", default=5,
+                    help="number of timed connects of each type")
+    opts.add_option("-v", action="store_true", dest="verbose",
+                    help="enable debug messages")
+    options, args = opts.parse_args()
+    if len(args) != 2:
+        opts.error("Incorrect number of arguments")
+    serialport, baud = args
+    if options.verbose:
+        logging.basicConfig(level=logging.DEBUG)
+    r = reactor.Reactor()
+    r.register_callback(lambda e: run_bench(r, serialport, int(baud),
+                                            options.loops))
+    r.run()
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,90 @@
+#!/usr/bin/env python2
+# Benchmark reactor wakeup latency as the number of timers and fds grows
+#
+# Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import optparse, os, sys, random
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                             '../klippy'))
+import reactor
+
+REACTORS = [("select", reactor.SelectReactor), ("poll", reactor.PollReactor),
+            ("epoll", reactor.EPollReactor)]
+PROBE_INTERVAL = .001
+BACKGROUND_PERIOD = 1.
+
+class ReactorBench:
+    def __init__(self, r, num_timers, num_fds, duration):
+        self.r = r
+        self.duration = duration
+        self.pipes = []
+        self.latencies = []
+        self.passes = 0
+        # Background timers (eg, heaters, stats, buttons) that rarely run
+        now = r.monotonic()
+        for i in range(num_timers):
+            r.register_timer(self._background_event,
+                             now + random.uniform(0., BACKGROUND_PERIOD))
+        # Idle file descriptors (eg, mcu connections, webhooks clients)
+        for i in range(num_fds):
+            rfd, wfd = os.pipe()
+            self.pipes.append((rfd, wfd))
+            r.register_fd(rfd, self._fd_event)
+        self.probe_waketime = now + PROBE_INTERVAL
+        self.probe_timer = r.register_timer(self._probe_event,
+                                            self.probe_waketime)
+        self.end_time = now + duration
+    def _background_event(self, eventtime):
+        return eventtime + BACKGROUND_PERIOD
+    def _fd_event(self, eventtime):
+        pass
+    def _probe_event(self, eventtime):
+        # Time from the scheduled wake time until the callback runs
+        self.latencies.append(self.r.monotonic() - self.probe_waketime)
+        if eventtime >= self.end_time:
+            self.r.end()
+            return self.r.NEVER
+        self.probe_waketime = eventtime + PROBE_INTERVAL
+        return self.probe_waketime
+    def run(self):
+        self.r.run()
+        for rfd, wfd in self.pipes:
+            os.close(rfd)
+            os.close(wfd)
+        self.r.finalize()
+        lat = sorted(self.latencies)
+        return (sum(lat) / len(lat), lat[len(lat) // 2],
+                lat[int(len(lat) * .99)], lat[-1])
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-t", "--timers", type="string", dest="timers",
+                    default="10,100,1000",
+                    help="comma separated list of timer counts")
+    opts.add_option("-f", "--fds", type="string", dest="fds",
+                    default="0,50", help="comma separated list of fd counts")
+    opts.add_option("-d", "--duration", type="float", dest="duration",
+                    default=2., help="seconds to run each test")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+    random.seed(0)
+    print("%-7s %6s %4s %10s %10s %10s %10s" % (
+        "reactor", "timers", "fds", "avg(us)", "p50(us)", "p99(us)",
+        "max(us)"))
+    for num_fds in [int(v) for v in options.fds.split(',')]:
+        for num_timers in [int(v) for v in options.timers.split(',')]:
+            for name, cls in REACTORS:
+                if name == "epoll" and not hasattr(reactor.select, 'epoll'):
+                    continue
+                bench = ReactorBench(cls(), num_timers, num_fds,
+                                     options.duration)
+                res = bench.run()
+                print("%-7s %6d %4d %10.1f %10.1f %10.1f %10.1f" % (
+                    (name, num_timers, num_fds)
+                    + tuple([v * 1000000. for v in res])))
+
+if __name__ == '__main__':
+    main()
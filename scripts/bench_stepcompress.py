@@ -0,0 +1,132 @@
+#!/usr/bin/env python2
+# Benchmark the step compression point range checkers
+#
+# Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import optparse, os, sys, math
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                             '../klippy'))
+import chelper
+
+EVALUATORS = [(0, "scalar"), (1, "sse2"), (2, "avx2")]
+
+# Expand the queue_step commands of a parsed message log (see
+# parsedump.py) into a list of step clocks for each stepper
+def read_steps(filename):
+    streams = {}
+    for line in open(filename, 'r'):
+        parts = line.split()
+        if not parts:
+            continue
+        if parts[0] not in ('queue_step', 'set_next_step_dir',
+                            'reset_step_clock'):
+            continue
+        args = dict([p.split('=', 1) for p in parts[1:]])
+        s = streams.setdefault(args['oid'], {'clock': 0, 'steps': []})
+        if parts[0] == 'reset_step_clock':
+            s['clock'] = int(args['clock'])
+            s['steps'].append(0)
+        elif parts[0] == 'set_next_step_dir':
+            s['steps'].append(0)
+        else:
+            interval, add = int(args['interval']), int(args['add'])
+            for i in range(int(args['count'])):
+                s['clock'] += interval
+                s['steps'].append(s['clock'])
+                interval += add
+    return [(oid, s['steps']) for oid, s in sorted(streams.items())]
+
+# Generate a stream of steps for a series of accelerating, cruising,
+# and decelerating moves
+def gen_steps(moves, freq, step_dist, velocity, accel):
+    steps = []
+    print_time = 1.
+    for i in range(moves):
+        dist = 5. + (i % 7) * 11.
+        accel_t = velocity / accel
+        accel_d = .5 * accel * accel_t**2
+        if 2. * accel_d > dist:
+            accel_d = .5 * dist
+            accel_t = math.sqrt(dist / accel)
+        cruise_v = accel * accel_t
+        cruise_t = (dist - 2. * accel_d) / cruise_v
+        pos = step_dist
+        while pos < dist:
+            if pos < accel_d:
+                t = math.sqrt(2. * pos / accel)
+            elif pos <= dist - accel_d:
+                t = accel_t + (pos - accel_d) / cruise_v
+            else:
+                rem = dist - pos
+                t = 2. * accel_t + cruise_t - math.sqrt(2. * rem / accel)
+            steps.append(int((print_time + t) * freq))
+            pos += step_dist
+        print_time += 2. * accel_t + cruise_t + .010
+        steps.append(0)
+    return [('synthetic', steps)]
+
+def run_bench(ffi_main, ffi_lib, streams, max_error, loops):
+    results = []
+    for eval_type, name in EVALUATORS:
+        if ffi_lib.stepcompress_set_evaluator(eval_type) != eval_type:
+            print("%-8s not supported on this cpu" % (name,))
+            continue
+        elapsed = 0.
+        total_moves = 0
+        outputs = []
+        for oid, steps in streams:
+            if not steps:
+                continue
+            csteps = ffi_main.new('uint64_t[]', steps)
+            cmoves = ffi_main.new('int32_t[]', 3 * len(steps))
+            # Use the fastest run to filter out scheduling noise
+            best = 99999999.
+            for i in range(loops):
+                start = ffi_lib.get_monotonic()
+                count = ffi_lib.stepcompress_bench(
+                    max_error, 0, csteps, len(steps), cmoves, len(steps))
+                best = min(best, ffi_lib.get_monotonic() - start)
+            elapsed += best
+            if count < 0:
+                print("stepcompress_bench failed on oid %s" % (oid,))
+                sys.exit(-1)
+            total_moves += count
+            outputs.append(list(cmoves[0:3*count]))
+        results.append((name, elapsed, total_moves, outputs))
+    ffi_lib.stepcompress_set_evaluator(-1)
+    # Report
+    total_steps = sum([len([s for s in st if s]) for oid, st in streams])
+    base_name, base_time, base_moves, base_out = results[0]
+    for name, elapsed, total_moves, outputs in results:
+        status = "identical" if outputs == base_out else "MISMATCH"
+        print("%-8s %9.3fms  %8.1f Msteps/s  %7d moves  x%.2f  %s" % (
+            name, elapsed * 1000., total_steps / elapsed / 1000000.,
+            total_moves,
+            base_time / elapsed, status))
+        if outputs != base_out:
+            sys.exit(-1)
+
+def main():
+    usage = "%prog [options] [<parsed message log>]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-e", "--max-error", type="int", dest="max_error",
+                    default=400, help="maximum step error in clock ticks")
+    opts.add_option("-l", "--loops", type="int", dest="loops", default=10,
+                    help="number of timed runs over each stream")
+    opts.add_option("-f", "--freq", type="float", dest="freq",
+                    default=16000000., help="mcu frequency of generated steps")
+    opts.add_option("-m", "--moves", type="int", dest="moves", default=200,
+                    help="number of generated moves")
+    options, args = opts.parse_args()
+    if len(args) > 1:
+        opts.error("Incorrect number of arguments")
+    if args:
+        streams = read_steps(args[0])
+    else:
+        streams = gen_steps(options.moves, options.freq, .0125, 300., 3000.)
+    ffi_main, ffi_lib = chelper.get_ffi()
+    run_bench(ffi_main, ffi_lib, streams, options.max_error, options.loops)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,74 @@
+#!/usr/bin/env python2
+# Benchmark the sustained command block rate to an mcu (eg, over usb)
+#
+# Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import optparse, os, sys, logging
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                             '../klippy'))
+import reactor, serialhdl
+
+def get_stats(ser, eventtime):
+    parts = [p.split('=', 1) for p in ser.stats(eventtime).split()]
+    return dict([(n, float(v)) for n, v in parts])
+
+# Send 'count' debug_nop commands as fast as the link accepts them and
+# wait for the mcu to acknowledge the last one
+def time_burst(r, ser, cmd_queue, cmd, count):
+    before = get_stats(ser, r.monotonic())
+    start = r.monotonic()
+    for i in range(count - 1):
+        ser.raw_send(cmd, 0, 0, cmd_queue)
+    ser.raw_send_wait_ack(cmd, 0, 0, cmd_queue)
+    elapsed = r.monotonic() - start
+    after = get_stats(ser, r.monotonic())
+    diff = dict([(n, after[n] - before[n]) for n in after])
+    return elapsed, diff
+
+def run_bench(r, serialport, baud, count, size, loops):
+    ser = serialhdl.SerialReader(r, serialport, baud)
+    ser.connect()
+    mp = ser.get_msgparser().lookup_command("debug_nop data=%*s")
+    cmd = mp.encode([[0x55] * size])
+    cmd_queue = ser.alloc_command_queue()
+    print("%d byte commands (%d bytes of data), %d per burst" % (
+        len(cmd), size, count))
+    for i in range(loops):
+        elapsed, diff = time_burst(r, ser, cmd_queue, cmd, count)
+        blocks = diff['send_seq']
+        print("blocks/s=%.0f cmds/s=%.0f bytes/s=%.0f"
+              " (%.1f cmds per block, %d bytes retransmitted)" % (
+                  blocks / elapsed, count / elapsed,
+                  diff['bytes_write'] / elapsed, count / max(1., blocks),
+                  diff['bytes_retransmit']))
+    ser.disconnect()
+    r.end()
+
+def main():
+    usage = "%prog [options] <serialdevice> <baud>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-c", "--count", type="int", dest="count", default=20000,
+                    help="number of commands sent in each burst")
+    opts.add_option("-s", "--size", type="int", dest="size", default=8,
+                    help="data bytes in each command (0-48)")
+    opts.add_option("-l", "--loops", type="int", dest="loops", default=3,
+                    help="number of timed bursts")
+    opts.add_option("-v", action="store_true", dest="verbose",
+                    help="enable debug messages")
+    options, args = opts.parse_args()
+    if len(args) != 2:
+        opts.error("Incorrect number of arguments")
+    if options.size < 0 or options.size > 48 or options.count < 1:
+        opts.error("Invalid size or count")
+    serialport, baud = args
+    if options.verbose:
+        logging.basicConfig(level=logging.DEBUG)
+    r = reactor.Reactor()
+    r.register_callback(lambda e: run_bench(
+        r, serialport, int(baud), options.count, options.size,
+        options.loops))
+    r.run()
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,159 @@
+#!/usr/bin/env python2
+# Convert a Klipper binary log (klippy.py -b) to text or CSV
+#
+# Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import optparse, os, sys, csv, time
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                             '../klippy'))
+import binlog, msgproto
+
+# Iterate over the (type, source, time, data) records of a log file
+def read_records(f, fname):
+    hdr = f.read(binlog.FILE_HEADER.size)
+    if len(hdr) < binlog.FILE_HEADER.size:
+        raise IOError("%s: file too short" % (fname,))
+    magic, version, realtime, monotonic = binlog.FILE_HEADER.unpack(hdr)
+    if magic != 'KBLG' or version != 1:
+        raise IOError("%s: not a binary log (or unknown version)" % (fname,))
+    yield None, None, monotonic, realtime
+    while 1:
+        hdr = f.read(binlog.RECORD_HEADER.size)
+        if len(hdr) < binlog.RECORD_HEADER.size:
+            break
+        length, rtype, source, eventtime = binlog.RECORD_HEADER.unpack(hdr)
+        data = f.read(length)
+        if len(data) < length:
+            # Truncated record (log still being written)
+            break
+        yield rtype, source, eventtime, data
+
+# Decode the message blocks of a sent / received / retransmit record
+def decode_blocks(msgparser, data):
+    out = []
+    pos = 0
+    if data[:1] == msgproto.MESSAGE_SYNC:
+        pos = 1
+    while pos < len(data):
+        blen = ord(data[pos])
+        block = [ord(c) for c in data[pos:pos+blen]]
+        pos += blen
+        if blen < msgproto.MESSAGE_MIN or len(block) != blen:
+            out.append("invalid block")
+            break
+        if blen == msgproto.MESSAGE_MIN:
+            out.append("ack seq: %02x" % (block[msgproto.MESSAGE_POS_SEQ],))
+            continue
+        if msgparser is None:
+            out.append("undecoded %s" % (repr(data[pos-blen:pos]),))
+            continue
+        try:
+            out.extend(msgparser.dump(block))
+        except Exception as e:
+            out.append("undecodable block (%s)" % (e,))
+    return out
+
+class LogDecoder:
+    def __init__(self, writer, types, wall_time):
+        self.writer = writer
+        self.types = types
+        self.wall_time = wall_time
+        self.time_offset = 0.
+        self.sources = {0: ("host", None)}
+    def decode_file(self, fname):
+        f = open(fname, 'rb')
+        for rtype, source, eventtime, data in read_records(f, fname):
+            if rtype is None:
+                # File header
+                if self.wall_time:
+                    self.time_offset = data - eventtime
+                continue
+            if rtype == binlog.BLR_SOURCE:
+                name, identify_data = data.split('\0', 1)
+                msgparser = None
+                if identify_data:
+                    msgparser = msgproto.MessageParser()
+                    msgparser.process_identify(identify_data)
+                self.sources[source] = (name, msgparser)
+            rname = binlog.RECORD_NAMES.get(rtype, "type%d" % (rtype,))
+            if self.types and rname not in self.types:
+                continue
+            name, msgparser = self.sources.get(
+                source, ("source%d" % (source,), None))
+            if rtype == binlog.BLR_THC_SAMPLE:
+                # One output line per sample
+                size = binlog.THC_SAMPLE.size
+                for pos in range(0, len(data) - size + 1, size):
+                    sample = binlog.THC_SAMPLE.unpack_from(data, pos)
+                    self.writer(sample[0] + self.time_offset, rname, name,
+                                ["%.6f" % (v,) for v in sample[1:]])
+                continue
+            if rtype == binlog.BLR_SOURCE:
+                fields = ["dictionary %d bytes" % (len(identify_data),)]
+            elif rtype in (binlog.BLR_SENT, binlog.BLR_RETRANSMIT,
+                           binlog.BLR_RECEIVE):
+                fields = decode_blocks(msgparser, data)
+            else:
+                fields = [data]
+            self.writer(eventtime + self.time_offset, rname, name, fields)
+        f.close()
+
+def text_writer(out, wall_time):
+    def write(eventtime, rname, source, fields):
+        if wall_time:
+            ts = time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(eventtime))
+            ts += "%.6f" % (eventtime % 1.,)[1:]
+        else:
+            ts = "%.6f" % (eventtime,)
+        out.write("%s %s %s: %s\n" % (ts, source, rname, ', '.join(fields)))
+    return write
+
+def csv_writer(out):
+    w = csv.writer(out)
+    w.writerow(["time", "type", "source", "data"])
+    def write(eventtime, rname, source, fields):
+        w.writerow(["%.6f" % (eventtime,), rname, source] + fields)
+    return write
+
+def main():
+    usage = "%prog [options] <binary log> [<binary log> ...]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-c", "--csv", action="store_true", dest="csv",
+                    help="write CSV instead of text")
+    opts.add_option("-t", "--types", type="string", dest="types",
+                    help="comma separated list of record types to output"
+                    " (%s)" % (', '.join(sorted(
+                        binlog.RECORD_NAMES.values())),))
+    opts.add_option("-w", "--wall-time", action="store_true",
+                    dest="wall_time", help="report times as wall clock time")
+    opts.add_option("-o", "--output", type="string", dest="output",
+                    default="-", help="output file (default stdout)")
+    options, args = opts.parse_args()
+    if not args:
+        opts.error("Incorrect number of arguments")
+    types = None
+    if options.types:
+        types = [t.strip() for t in options.types.split(',')]
+        unknown = set(types) - set(binlog.RECORD_NAMES.values())
+        if unknown:
+            opts.error("Unknown record types: %s" % (', '.join(unknown),))
+    out = sys.stdout
+    if options.output != "-":
+        out = open(options.output, 'wb')
+    if options.csv:
+        writer = csv_writer(out)
+    else:
+        writer = text_writer(out, options.wall_time)
+    decoder = LogDecoder(writer, types, options.wall_time)
+    # Rotated files (log.2, log.1, log) are given oldest first
+    try:
+        for fname in args:
+            decoder.decode_file(fname)
+    except IOError as e:
+        sys.stderr.write("%s\n" % (e,))
+        sys.exit(-1)
+    out.close()
+
+if __name__ == '__main__':
+    main()
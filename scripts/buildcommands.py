@@ -5,7 +5,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import sys, os, subprocess, optparse, logging, shlex, socket, time, traceback
-import json, zlib
+import json, zlib, struct
 sys.path.append('./klippy')
 import msgproto
 
@@ -34,19 +34,50 @@ Handlers = []
 class HandleCallList:
     def __init__(self):
         self.call_lists = {'ctr_run_initfuncs': []}
-        self.ctr_dispatch = { '_DECL_CALLLIST': self.decl_calllist }
+        self.priority_tasks = []
+        self.ctr_dispatch = { '_DECL_CALLLIST': self.decl_calllist,
+                              '_DECL_PRIORITY_TASK': self.decl_priority_task }
     def decl_calllist(self, req):
         funcname, callname = req.split()[1:]
         self.call_lists.setdefault(funcname, []).append(callname)
+    def decl_priority_task(self, req):
+        callname = req.split()[1]
+        HandlerEnumerations.add_enumeration(
+            "priority_task", callname, len(self.priority_tasks))
+        self.priority_tasks.append(callname)
     def update_data_dictionary(self, data):
         pass
+    def generate_priority_code(self):
+        # High priority tasks are run (and their latency tracked) when
+        # woken by sched_wake_priority_task()
+        func_code = ['    extern void %s(void);\n    %s();\n'
+                     '    sched_note_priority_task(%d, wake_time);' % (f, f, i)
+                     for i, f in enumerate(self.priority_tasks)]
+        fmt = """
+void
+ctr_run_priority_taskfuncs(uint32_t wake_time)
+{
+    extern void sched_note_priority_task(uint_fast8_t id, uint32_t wake_time);
+    %s
+}
+
+uint32_t priority_task_latency[%d];
+const uint8_t priority_task_count PROGMEM = %d;
+"""
+        return fmt % ("\n".join(func_code).strip(),
+                      max(1, len(self.priority_tasks)),
+                      len(self.priority_tasks))
     def generate_code(self, options):
         code = []
         for funcname, funcs in self.call_lists.items():
             func_code = ['    extern void %s(void);\n    %s();' % (f, f)
                          for f in funcs]
             if funcname == 'ctr_run_taskfuncs':
-                func_code = ['    irq_poll();\n' + fc for fc in func_code]
+                func_code = ['    irq_poll();\n'
+                             '    sched_run_priority_tasks();\n' + fc
+                             for fc in func_code]
+                func_code.insert(0, '    extern void'
+                                 ' sched_run_priority_tasks(void);')
             fmt = """
 void
 %s(void)
@@ -55,6 +86,7 @@ void
 }
 """
             code.append(fmt % (funcname, "\n".join(func_code).strip()))
+        code.append(self.generate_priority_code())
         return "".join(code)
 
 Handlers.append(HandleCallList())
@@ -549,6 +581,10 @@ class HandleIdentify:
             if i % 8 == 0:
                 out.append('\n   ')
             out.append(" 0x%02x," % (ord(zdatadict[i]),))
+        # The crc32 and size allow the host to cache the dictionary
+        crc = zlib.crc32(zdatadict) & 0xffffffff
+        info = struct.pack('<II', crc, len(zdatadict))
+        info = ["0x%02x" % (ord(c),) for c in info]
         fmt = """
 const uint8_t command_identify_data[] PROGMEM = {%s
 };
@@ -556,8 +592,14 @@ const uint8_t command_identify_data[] PROGMEM = {%s
 // Identify size = %d (%d uncompressed)
 const uint32_t command_identify_size PROGMEM
     = ARRAY_SIZE(command_identify_data);
+
+// Identify crc32 = 0x%08x
+const uint8_t command_identify_info[IDENTIFY_INFO_SIZE] PROGMEM = {
+    %s
+};
 """
-        return fmt % (''.join(out), len(zdatadict), len(datadict))
+        return fmt % (''.join(out), len(zdatadict), len(datadict),
+                      crc, ', '.join(info))
 
 Handlers.append(HandleIdentify())
 
@@ -0,0 +1,97 @@
+#!/usr/bin/env python2
+# Attach a Linux process mcu to a CAN bus (for testing CAN support)
+#
+# Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import optparse, os, sys, select, struct, hashlib, binascii, logging
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                             '../klippy'))
+import serialhdl, util
+
+# Emulation of the node side of the CAN protocol (see src/stm32/can.c)
+# that passes the message stream to and from the mcu pseudo-tty
+class CANBridge:
+    def __init__(self, iface, uuid, mcu_fd):
+        self.iface = iface
+        self.uuid = uuid
+        self.mcu_fd = mcu_fd
+        self.node_id = None
+        self.sock = None
+        self._release()
+    def _open(self, rx_ids):
+        if self.sock is not None:
+            self.sock.close()
+        self.sock = serialhdl.CANSocket(self.iface, rx_ids)
+    def _release(self):
+        # Wait for the host to assign a node id
+        self.node_id = None
+        self._open([serialhdl.CANBUS_ID_UUID, serialhdl.CANBUS_ID_SET])
+        self.sock.send(serialhdl.CANBUS_ID_UUID_RESP, self.uuid)
+    def _handle_frame(self, can_id, data):
+        if self.node_id is None:
+            if can_id == serialhdl.CANBUS_ID_UUID and not data:
+                self.sock.send(serialhdl.CANBUS_ID_UUID_RESP, self.uuid)
+            elif can_id == serialhdl.CANBUS_ID_SET and data[2:] == self.uuid:
+                self.node_id = struct.unpack('<H', data[:2])[0]
+                logging.info("Assigned CAN id 0x%x", self.node_id)
+                self._open([self.node_id, serialhdl.CANBUS_ID_UUID])
+        elif can_id == self.node_id:
+            if not data:
+                # Ping
+                self.sock.send(self.node_id + 1)
+            else:
+                os.write(self.mcu_fd, data)
+        elif (can_id == serialhdl.CANBUS_ID_UUID
+              and data[:2] == struct.pack('<H', self.node_id)):
+            # A Linux process can not be reset - just release the id
+            logging.info("Reset request - releasing CAN id")
+            self._release()
+    def _handle_mcu(self):
+        data = os.read(self.mcu_fd, 4096)
+        if not data:
+            raise serialhdl.error("mcu pseudo-tty closed")
+        if self.node_id is None:
+            return
+        for pos in range(0, len(data), 8):
+            self.sock.send(self.node_id + 1, data[pos:pos+8])
+    def run(self):
+        while 1:
+            rfds, wfds, efds = select.select(
+                [self.sock.fileno(), self.mcu_fd], [], [])
+            if self.mcu_fd in rfds:
+                self._handle_mcu()
+            while 1:
+                frame = self.sock.recv()
+                if frame is None:
+                    break
+                self._handle_frame(*frame)
+
+def main():
+    usage = "%prog [options] <mcu pseudo-tty>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-i", "--interface", type="string", dest="iface",
+                    default="vcan0", help="CAN network interface")
+    opts.add_option("-u", "--uuid", type="string", dest="uuid",
+                    help="canbus_uuid to report (12 hex digits)")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    logging.basicConfig(level=logging.INFO)
+    uuid = options.uuid
+    if uuid is None:
+        uuid = hashlib.sha1(args[0]).hexdigest()[:12]
+    try:
+        uuid = serialhdl.canbus_uuid_to_bytes(uuid)
+        mcu_fd = os.open(args[0], os.O_RDWR | os.O_NOCTTY)
+        util.set_nonblock(mcu_fd)
+        bridge = CANBridge(options.iface, uuid, mcu_fd)
+        logging.info("Bridging %s to %s as canbus_uuid=%s", args[0],
+                     options.iface, binascii.hexlify(uuid))
+        bridge.run()
+    except (OSError, serialhdl.error) as e:
+        sys.stderr.write("%s\n" % (e,))
+        sys.exit(-1)
+
+if __name__ == '__main__':
+    main()
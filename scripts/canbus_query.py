@@ -0,0 +1,47 @@
+#!/usr/bin/env python2
+# List the unique ids of unassigned Klipper nodes on a CAN bus
+#
+# Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import optparse, os, sys, time, select, binascii
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                             '../klippy'))
+import serialhdl
+
+def query_unassigned(iface, wait):
+    sock = serialhdl.CANSocket(iface, [serialhdl.CANBUS_ID_UUID_RESP])
+    sock.send(serialhdl.CANBUS_ID_UUID)
+    end_time = time.time() + wait
+    found = []
+    while 1:
+        timeout = end_time - time.time()
+        if timeout <= 0.:
+            break
+        select.select([sock.fileno()], [], [], timeout)
+        frame = sock.recv()
+        if frame is None:
+            continue
+        uuid = binascii.hexlify(frame[1])
+        if uuid not in found:
+            found.append(uuid)
+            print("Found canbus_uuid=%s" % (uuid,))
+    sock.close()
+    print("Total %d uuids found" % (len(found),))
+
+def main():
+    usage = "%prog [options] <can interface>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-w", "--wait", type="float", dest="wait", default=2.,
+                    help="seconds to wait for responses")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    try:
+        query_unassigned(args[0], options.wait)
+    except serialhdl.error as e:
+        sys.stderr.write("%s\n" % (e,))
+        sys.exit(-1)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,108 @@
+#!/usr/bin/env python2
+# Compare the mcu speed mode integer math (src/speed_math.c) with float math
+#
+# Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import optparse, os, sys, math, random, shutil, subprocess, tempfile
+import cffi
+
+SRCDIR = os.path.join(os.path.dirname(os.path.realpath(__file__)), '../src')
+
+DEFS = """
+    struct speed_limit {
+        uint32_t max_acc, max_dist;
+        uint8_t shift;
+        uint32_t speeds[33];
+    };
+    uint32_t speed_isqrt(uint32_t v);
+    uint32_t speed_period(uint32_t speed);
+    void speed_limit_init(struct speed_limit *sl, uint32_t max_acc
+                          , uint32_t max_dist);
+    uint32_t speed_limit_lookup(struct speed_limit *sl, uint32_t dist);
+"""
+
+# Build speed_math.c for the host with the given clock frequency
+def build(clock_freq, tmpdir):
+    cfgdir = os.path.join(tmpdir, str(clock_freq))
+    os.mkdir(cfgdir)
+    f = open(os.path.join(cfgdir, 'autoconf.h'), 'w')
+    f.write("#define CONFIG_CLOCK_FREQ %d\n" % (clock_freq,))
+    f.close()
+    os.symlink(os.path.join(SRCDIR, 'generic'),
+               os.path.join(cfgdir, 'board'))
+    lib = os.path.join(cfgdir, 'speed_math.so')
+    subprocess.check_call(["gcc", "-O2", "-shared", "-fPIC", "-I", cfgdir,
+                           "-I", SRCDIR, "-o", lib,
+                           os.path.join(SRCDIR, 'speed_math.c')])
+    ffi = cffi.FFI()
+    ffi.cdef(DEFS)
+    return ffi, ffi.dlopen(lib)
+
+def check_isqrt(lib, count):
+    worst = 0
+    for i in range(count):
+        v = random.randrange(1 << random.randrange(1, 33))
+        r = lib.speed_isqrt(v)
+        if r * r > v or (r + 1) * (r + 1) <= v:
+            worst += 1
+    return worst
+
+def check_period(clock_freq, lib, count):
+    worst = 0.
+    for i in range(count):
+        speed = random.randrange(1, 1 << random.randrange(1, 24))
+        exact = float(clock_freq) / speed
+        if exact < 1.:
+            continue
+        # Ignore the rounding to an integer number of ticks
+        err = max(0., abs(lib.speed_period(speed) - exact) - 1.) / exact
+        worst = max(worst, err)
+    return worst
+
+def check_limit(ffi, lib, count):
+    over = 0
+    worst = 0.
+    for i in range(count):
+        max_acc = random.randrange(1, 1 << random.randrange(1, 24))
+        max_dist = random.randrange(1, 1 << random.randrange(1, 24))
+        sl = ffi.new("struct speed_limit *")
+        lib.speed_limit_init(sl, max_acc, max_dist)
+        for j in range(16):
+            dist = random.randrange(max_dist + 1)
+            exact = math.sqrt(float(max_acc) * dist)
+            speed = lib.speed_limit_lookup(sl, dist)
+            if speed > exact:
+                over += 1
+            elif exact >= 100.:
+                worst = max(worst, (exact - speed) / exact)
+    return over, worst
+
+def main():
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-c", "--count", type="int", dest="count", default=20000,
+                    help="number of random values to check")
+    opts.add_option("-f", "--clock-freq", type="int", dest="clock_freqs",
+                    action="append", help="mcu clock frequency to check")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+    clock_freqs = options.clock_freqs or [16000000, 20000000, 72000000,
+                                          168000000]
+    tmpdir = tempfile.mkdtemp()
+    try:
+        for clock_freq in clock_freqs:
+            ffi, lib = build(clock_freq, tmpdir)
+            bad_sqrt = check_isqrt(lib, options.count)
+            period_err = check_period(clock_freq, lib, options.count)
+            over, deficit = check_limit(ffi, lib, options.count // 16)
+            print("%9d: isqrt errors %d, period error %.4f%%,"
+                  " limit over sqrt %d, limit deficit %.2f%%" % (
+                      clock_freq, bad_sqrt, period_err * 100., over,
+                      deficit * 100.))
+    finally:
+        shutil.rmtree(tmpdir)
+
+if __name__ == '__main__':
+    main()
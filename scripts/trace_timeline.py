@@ -0,0 +1,107 @@
+#!/usr/bin/env python2
+# Show the timeline and latency histograms of an mcu trace dump
+#
+# Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import optparse, math
+
+# Events whose value is a duration (or latency) worth a histogram
+HISTOGRAM_EVENTS = ["timer", "tasks", "priority_task", "command",
+                    "unfreeze", "step_margin"]
+EVENT_DESC = {
+    "timer": "late by", "tasks": "busy for", "priority_task": "latency",
+    "command": "ran for", "freeze": "timeout", "unfreeze": "drift",
+    "step_margin": "queue ends in",
+}
+
+# Parse a file written by the MCU_TRACE_DUMP command (or on a shutdown)
+def parse_trace(fname):
+    header = {}
+    events = []
+    f = open(fname, 'rb')
+    for line in f:
+        parts = line.split()
+        if not parts:
+            continue
+        if parts[0] == '#':
+            header.update([p.split('=', 1) for p in parts[2:] if '=' in p])
+            continue
+        events.append((float(parts[0]), parts[1], parts[2], float(parts[3])))
+    f.close()
+    return header, events
+
+def show_timeline(events, names):
+    start = events[0][0]
+    for print_time, event, arg, value in events:
+        if names and event not in names:
+            continue
+        desc = EVENT_DESC.get(event, "value")
+        argdesc = "" if arg == '-' else " " + arg
+        print("%12.1f %-13s%s %s %.1fus" % (
+            (print_time - start) * 1000000., event, argdesc, desc,
+            value * 1000000.))
+
+# Power of two buckets (in microseconds)
+def bucket(value):
+    us = abs(value) * 1000000.
+    if us < 1.:
+        return 0
+    return int(math.log(us, 2)) + 1
+
+def bucket_desc(b):
+    if not b:
+        return "<1us"
+    return "%dus+" % (1 << (b - 1),)
+
+def show_histograms(events, names, width):
+    for name in HISTOGRAM_EVENTS:
+        if names and name not in names:
+            continue
+        values = [e[3] for e in events if e[1] == name]
+        if not values:
+            continue
+        print("%s %s (%d events, max %.1fus, avg %.1fus)" % (
+            name, EVENT_DESC[name], len(values), max(values) * 1000000.,
+            sum(values) / len(values) * 1000000.))
+        counts = {}
+        for v in values:
+            b = bucket(v)
+            if v < 0.:
+                b = -b - 1
+            counts[b] = counts.get(b, 0) + 1
+        maxcount = max(counts.values())
+        for b in sorted(counts):
+            desc = bucket_desc(b) if b >= 0 else "-" + bucket_desc(-b - 1)
+            bar = '#' * max(1, counts[b] * width // maxcount)
+            print("  %8s %6d %s" % (desc, counts[b], bar))
+        print("")
+
+def main():
+    usage = "%prog [options] <trace file>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-t", "--timeline", action="store_true", dest="timeline",
+                    help="show the event timeline")
+    opts.add_option("-e", "--events", type="string", dest="events",
+                    help="comma separated list of events to show")
+    opts.add_option("-w", "--width", type="int", dest="width", default=50,
+                    help="width of the histogram bars")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    header, events = parse_trace(args[0])
+    if not events:
+        print("No events in trace")
+        return
+    names = None
+    if options.events:
+        names = [e.strip() for e in options.events.split(',')]
+    print("mcu %s: %d events over %.6f seconds\n" % (
+        header.get('mcu', '?'), len(events), events[-1][0] - events[0][0]))
+    if options.timeline:
+        show_timeline(events, names)
+        print("")
+    show_histograms(events, names, options.width)
+
+if __name__ == '__main__':
+    main()
@@ -66,6 +66,10 @@ static struct move_freed *move_free_list;
 static void *move_list;
 static uint16_t move_count;
 static uint8_t move_item_size;
+// Number of free moves (and its low-water mark) and a running count
+// of freed moves - reported to the host with the stats
+static uint16_t move_free_count, move_free_low;
+static uint32_t move_freed_total;
 
 // Is the config and move queue finalized?
 static int
@@ -82,6 +86,8 @@ move_free(void *m)
     struct move_freed *mf = m;
     mf->next = move_free_list;
     move_free_list = mf;
+    move_free_count++;
+    move_freed_total++;
 }
 
 // Allocate runtime storage
@@ -93,6 +99,9 @@ move_alloc(void)
     if (!mf)
         shutdown("Move queue empty");
     move_free_list = mf->next;
+    move_free_count--;
+    if (move_free_count < move_free_low)
+        move_free_low = move_free_count;
     irq_restore(flag);
     return mf;
 }
@@ -121,6 +130,7 @@ move_reset(void)
     struct move_freed *mf = move_list + (move_count - 1)*move_item_size;
     mf->next = NULL;
     move_free_list = move_list;
+    move_free_count = move_free_low = move_count;
 }
 DECL_SHUTDOWN(move_reset);
 
@@ -227,6 +237,7 @@ config_reset(uint32_t *args)
     move_free_list = NULL;
     move_list = NULL;
     move_count = move_item_size = 0;
+    move_free_count = move_free_low = 0;
     alloc_init();
     sched_timer_reset();
     sched_clear_shutdown();
@@ -281,7 +292,15 @@ stats_update(uint32_t start, uint32_t cur)
 
     if (timer_is_before(cur, stats_send_time + timer_from_us(5000000)))
         return;
-    sendf("stats count=%u sum=%u sumsq=%u", count, sum, sumsq);
+    irq_disable();
+    uint16_t move_free = move_free_count, move_low = move_free_low;
+    uint32_t moves_freed = move_freed_total;
+    move_free_low = move_free_count;
+    irq_enable();
+    sendf("stats count=%u sum=%u sumsq=%u move_free=%hu move_low=%hu"
+          " moves_freed=%u", count, sum, sumsq, move_free, move_low
+          , moves_freed);
+    sched_report_priority_tasks();
     if (cur < stats_send_time)
         stats_send_time_high++;
     stats_send_time = cur;
@@ -307,11 +326,19 @@ command_clear_shutdown(uint32_t *args)
 }
 DECL_COMMAND_FLAGS(command_clear_shutdown, HF_IN_SHUTDOWN, "clear_shutdown");
 
+// Offset of the identify query that reports the dictionary crc and size
+#define IDENTIFY_INFO_OFFSET 0xffffffff
+
 void
 command_identify(uint32_t *args)
 {
     uint32_t offset = args[0];
     uint8_t count = args[1];
+    if (offset == IDENTIFY_INFO_OFFSET) {
+        sendf("identify_response offset=%u data=%.*s"
+              , offset, IDENTIFY_INFO_SIZE, command_identify_info);
+        return;
+    }
     uint32_t isize = READP(command_identify_size);
     if (offset >= isize)
         count = 0;
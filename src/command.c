@@ -12,6 +12,7 @@
 #include "board/pgm.h" // READP
 #include "command.h" // output_P
 #include "sched.h" // sched_is_shutdown
+#include "trace.h" // trace_event
 #include "autoconf.h" // CONFIG_CLOCK_FREQ
 
 static uint8_t next_sequence = MESSAGE_DEST;
@@ -348,7 +349,9 @@ command_dispatch(uint8_t *buf, uint_fast8_t msglen)
 
         host_watchdog_reset();
         void (*func)(uint32_t*) = READP(cp->func);
+        uint32_t start = CONFIG_WANT_TRACE ? timer_read_time() : 0;
         func(args);
+        trace_event(TE_COMMAND, cmdid, start);
     }
 }
 
@@ -0,0 +1,20 @@
+#ifndef __GENERIC_STEP_DMA_H
+#define __GENERIC_STEP_DMA_H
+
+#include <stdint.h> // uint32_t
+
+// Number of timer ticks per DMA slot
+#define STEP_DMA_SLOT_TICKS (CONFIG_CLOCK_FREQ / CONFIG_STEP_DMA_FREQ)
+
+// callbacks provided by board specific code
+int step_dma_setup_pins(uint32_t step_pin, uint32_t dir_pin
+                        , uint32_t *step_bit, uint32_t *dir_bit);
+uint32_t *step_dma_get_block(uint32_t *start_time);
+void step_dma_commit(void);
+int32_t step_dma_pending(uint32_t step_mask, uint32_t dir_mask
+                         , uint_fast8_t clear);
+
+// stepper.c
+void step_dma_block_free(void);
+
+#endif // step_dma.h
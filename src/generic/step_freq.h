@@ -0,0 +1,13 @@
+#ifndef __GENERIC_STEP_FREQ_H
+#define __GENERIC_STEP_FREQ_H
+
+#include <stdint.h> // uint32_t
+
+// callbacks provided by board specific code
+int step_freq_setup(uint32_t step_pin, uint8_t invert);
+void step_freq_enable(void);
+void step_freq_set(uint32_t period);
+uint16_t step_freq_count(void);
+void step_freq_disable(void);
+
+#endif // step_freq.h
@@ -20,8 +20,9 @@
  * Message block sending
  ****************************************************************/
 
+// Data between transmit_start and transmit_pos is waiting to be sent
 static struct task_wake usb_bulk_in_wake;
-static uint8_t transmit_buf[96], transmit_pos;
+static uint8_t transmit_buf[96], transmit_start, transmit_pos;
 
 void
 usb_notify_bulk_in(void)
@@ -34,20 +35,22 @@ usb_bulk_in_task(void)
 {
     if (!sched_check_wake(&usb_bulk_in_wake))
         return;
-    uint_fast8_t tpos = transmit_pos;
-    if (!tpos)
+    uint_fast8_t tstart = transmit_start, tlen = transmit_pos - tstart;
+    if (!tlen)
         return;
-    uint_fast8_t max_tpos = (tpos > USB_CDC_EP_BULK_IN_SIZE
-                             ? USB_CDC_EP_BULK_IN_SIZE : tpos);
-    int_fast8_t ret = usb_send_bulk_in(transmit_buf, max_tpos);
+    if (tlen > USB_CDC_EP_BULK_IN_SIZE)
+        tlen = USB_CDC_EP_BULK_IN_SIZE;
+    int_fast8_t ret = usb_send_bulk_in(&transmit_buf[tstart], tlen);
     if (ret <= 0)
         return;
-    uint_fast8_t needcopy = tpos - ret;
-    if (needcopy) {
-        memmove(transmit_buf, &transmit_buf[ret], needcopy);
+    tstart += ret;
+    if (tstart < transmit_pos) {
+        // More to send (the endpoint may have a second buffer free)
+        transmit_start = tstart;
         usb_notify_bulk_in();
+    } else {
+        transmit_start = transmit_pos = 0;
     }
-    transmit_pos = needcopy;
 }
 DECL_TASK(usb_bulk_in_task);
 
@@ -57,9 +60,16 @@ console_sendf(const struct command_encoder *ce, va_list args)
 {
     // Verify space for message
     uint_fast8_t tpos = transmit_pos, max_size = READP(ce->max_size);
-    if (tpos + max_size > sizeof(transmit_buf))
-        // Not enough space for message
-        return;
+    if (tpos + max_size > sizeof(transmit_buf)) {
+        uint_fast8_t tstart = transmit_start;
+        if (tpos - tstart + max_size > sizeof(transmit_buf))
+            // Not enough space for message
+            return;
+        // Move the unsent data to the start of the buffer
+        tpos -= tstart;
+        memmove(transmit_buf, &transmit_buf[tstart], tpos);
+        transmit_start = 0;
+    }
 
     // Generate message
     uint8_t *buf = &transmit_buf[tpos];
@@ -75,8 +85,9 @@ console_sendf(const struct command_encoder *ce, va_list args)
  * Message block reading
  ****************************************************************/
 
+// Data between receive_start and receive_pos has not been processed
 static struct task_wake usb_bulk_out_wake;
-static uint8_t receive_buf[128], receive_pos;
+static uint8_t receive_buf[128], receive_start, receive_pos;
 
 void
 usb_notify_bulk_out(void)
@@ -90,7 +101,13 @@ usb_bulk_out_task(void)
     if (!sched_check_wake(&usb_bulk_out_wake))
         return;
     // Read data
-    uint_fast8_t rpos = receive_pos, pop_count;
+    uint_fast8_t rstart = receive_start, rpos = receive_pos, pop_count;
+    if (rpos + USB_CDC_EP_BULK_OUT_SIZE > sizeof(receive_buf) && rstart) {
+        // Only move the unprocessed data when a packet doesn't fit
+        rpos -= rstart;
+        memmove(receive_buf, &receive_buf[rstart], rpos);
+        rstart = 0;
+    }
     if (rpos + USB_CDC_EP_BULK_OUT_SIZE <= sizeof(receive_buf)) {
         int_fast8_t ret = usb_read_bulk_out(
             &receive_buf[rpos], USB_CDC_EP_BULK_OUT_SIZE);
@@ -101,17 +118,17 @@ usb_bulk_out_task(void)
     } else {
         usb_notify_bulk_out();
     }
-    // Process a message block
-    int_fast8_t ret = command_find_and_dispatch(receive_buf, rpos, &pop_count);
+    // Process a message block (in place)
+    int_fast8_t ret = command_find_and_dispatch(
+        &receive_buf[rstart], rpos - rstart, &pop_count);
     if (ret) {
-        // Move buffer
-        uint_fast8_t needcopy = rpos - pop_count;
-        if (needcopy) {
-            memmove(receive_buf, &receive_buf[pop_count], needcopy);
+        rstart += pop_count;
+        if (rstart < rpos)
             usb_notify_bulk_out();
-        }
-        rpos = needcopy;
+        else
+            rstart = rpos = 0;
     }
+    receive_start = rstart;
     receive_pos = rpos;
 }
 DECL_TASK(usb_bulk_out_task);
@@ -10,6 +10,7 @@
 #include "board/gpio.h" // i2c_setup, i2c_write, i2c_read
 #include "autoconf.h" // CONFIG_CLOCK_FREQ
 #include "board/misc.h" // timer_read_time
+#include "trace.h" // trace_event
 
 #define PLASMA_OFF 0
 #define PLASMA_ON  1
@@ -104,12 +105,14 @@ void start_plasma(struct plasma *p)
 
     // freeze time while waiting for arc transfer
     uint8_t transfer = 0;
+    trace_event(TE_FREEZE, 0, p->ticks_to_timeout);
     time_freeze(p->ticks_to_timeout);
     while(!transfer && is_time_frozen()) {
         time_frozen_idle();
         transfer = !!(gpio_in_read(p->transfer_pin)) != p->transfer_invert;
     }
     uint32_t clock_drift = time_unfreeze();
+    trace_event(TE_UNFREEZE, 0, clock_drift);
     sendf("clock_drift clock=%u", clock_drift);
 
     // check if wait has timed out or not
@@ -14,14 +14,14 @@
 #include "command.h" // shutdown
 #include "sched.h" // sched_check_periodic
 #include "stepper.h" // stepper_event
+#include "trace.h" // trace_event
 
 
 /****************************************************************
  * Timers
  ****************************************************************/
 
-static struct timer periodic_timer, *timer_list = &periodic_timer;
-static struct timer sentinel_timer, deleted_timer;
+static struct timer periodic_timer, sentinel_timer, deleted_timer;
 
 // The periodic_timer simplifies the timer code by ensuring there is
 // always a timer on the timer list and that there is always a timer
@@ -58,6 +58,21 @@ static struct timer sentinel_timer = {
     .waketime = 0x80000000,
 };
 
+// The deleted timer is used when deleting an active timer.
+static uint_fast8_t
+deleted_event(struct timer *t)
+{
+    return SF_DONE;
+}
+
+static struct timer deleted_timer = {
+    .func = deleted_event,
+};
+
+#if !CONFIG_SCHED_TIMER_HEAP
+
+static struct timer *timer_list = &periodic_timer;
+
 // Find position for a timer in timer_list and insert it
 static void __always_inline
 insert_timer(struct timer *t, uint32_t waketime)
@@ -101,17 +116,6 @@ sched_add_timer(struct timer *add)
     irq_restore(flag);
 }
 
-// The deleted timer is used when deleting an active timer.
-static uint_fast8_t
-deleted_event(struct timer *t)
-{
-    return SF_DONE;
-}
-
-static struct timer deleted_timer = {
-    .func = deleted_event,
-};
-
 // Remove a timer that may be live.
 void
 sched_del_timer(struct timer *del)
@@ -143,6 +147,7 @@ sched_timer_dispatch(void)
     struct timer *t = timer_list;
     uint_fast8_t res;
     uint32_t updated_waketime;
+    trace_event(TE_TIMER, 0, t->waketime);
     if (CONFIG_INLINE_STEPPER_HACK && likely(!t->func)) {
         res = stepper_event(t);
         updated_waketime = t->waketime;
@@ -176,12 +181,187 @@ sched_timer_reset(void)
     timer_kick();
 }
 
+#else // CONFIG_SCHED_TIMER_HEAP
+
+// On 32bit micro-controllers the timers may be kept in a binary
+// min-heap so that adding and rescheduling a timer has a cost that
+// grows with log2 of the number of live timers (instead of linearly
+// as with the sorted timer_list).  A rescheduled timer that is still
+// the next timer to run is only compared with the two timers below
+// it.  The heap always holds the periodic_timer, so it is never empty
+// and no sentinel is needed.  The deleted_timer is used the same way
+// as with timer_list.
+
+static struct timer *timer_heap[CONFIG_SCHED_TIMER_HEAP_SIZE] = {
+    &periodic_timer
+};
+static uint_fast16_t timer_heap_count = 1;
+
+// Move a timer towards the top of the heap
+static void
+timer_heap_sift_up(uint_fast16_t pos, struct timer *t)
+{
+    uint32_t waketime = t->waketime;
+    while (pos) {
+        uint_fast16_t parent = (pos - 1) / 2;
+        struct timer *p = timer_heap[parent];
+        if (!timer_is_before(waketime, p->waketime))
+            break;
+        timer_heap[pos] = p;
+        pos = parent;
+    }
+    timer_heap[pos] = t;
+}
+
+// Move a timer towards the bottom of the heap
+static void
+timer_heap_sift_down(uint_fast16_t pos, struct timer *t)
+{
+    uint32_t waketime = t->waketime;
+    uint_fast16_t count = timer_heap_count;
+    for (;;) {
+        uint_fast16_t child = pos * 2 + 1;
+        if (child >= count)
+            break;
+        struct timer *c = timer_heap[child];
+        if (child + 1 < count) {
+            struct timer *c2 = timer_heap[child + 1];
+            if (timer_is_before(c2->waketime, c->waketime)) {
+                child++;
+                c = c2;
+            }
+        }
+        if (!timer_is_before(c->waketime, waketime))
+            break;
+        timer_heap[pos] = c;
+        pos = child;
+    }
+    timer_heap[pos] = t;
+}
+
+// Find the position of a timer in the heap (or -1 if not present)
+static int_fast16_t
+timer_heap_find(struct timer *t)
+{
+    int_fast16_t pos;
+    for (pos = timer_heap_count - 1; pos >= 0; pos--)
+        if (timer_heap[pos] == t)
+            break;
+    return pos;
+}
+
+// Add a timer to the heap
+static void
+timer_heap_insert(struct timer *t)
+{
+    if (timer_heap_count >= ARRAY_SIZE(timer_heap))
+        shutdown("Too many timers");
+    timer_heap_sift_up(timer_heap_count++, t);
+}
+
+// Remove the timer at the given heap position
+static void
+timer_heap_remove(uint_fast16_t pos)
+{
+    struct timer *last = timer_heap[--timer_heap_count];
+    if (pos == timer_heap_count)
+        return;
+    if (pos && timer_is_before(last->waketime
+                               , timer_heap[(pos - 1) / 2]->waketime))
+        timer_heap_sift_up(pos, last);
+    else
+        timer_heap_sift_down(pos, last);
+}
+
+// Make deleted_timer the next timer to run (at the given time)
+static void
+timer_heap_set_deleted(uint32_t waketime)
+{
+    int_fast16_t pos = timer_heap_find(&deleted_timer);
+    if (pos >= 0)
+        timer_heap_remove(pos);
+    deleted_timer.waketime = waketime;
+    timer_heap_insert(&deleted_timer);
+}
+
+// Schedule a function call at a supplied time.
+void
+sched_add_timer(struct timer *add)
+{
+    uint32_t waketime = add->waketime;
+    irqstatus_t flag = irq_save();
+    if (unlikely(timer_is_before(waketime, timer_heap[0]->waketime))) {
+        // This timer is before all other scheduled timers - the
+        // deleted_timer runs first to absorb the timer_kick() irq
+        if (timer_is_before(waketime, timer_read_time()))
+            try_shutdown("Timer too close");
+        timer_heap_set_deleted(waketime);
+        timer_heap_insert(add);
+        timer_kick();
+    } else {
+        timer_heap_insert(add);
+    }
+    irq_restore(flag);
+}
+
+// Remove a timer that may be live.
+void
+sched_del_timer(struct timer *del)
+{
+    irqstatus_t flag = irq_save();
+    int_fast16_t pos = timer_heap_find(del);
+    if (pos >= 0) {
+        timer_heap_remove(pos);
+        if (!pos)
+            // Deleting the next active timer - replace with deleted_timer
+            timer_heap_set_deleted(del->waketime);
+    }
+    irq_restore(flag);
+}
+
+// Invoke the next timer - called from board hardware irq code.
+unsigned int
+sched_timer_dispatch(void)
+{
+    // Invoke timer callback
+    struct timer *t = timer_heap[0];
+    uint_fast8_t res;
+    trace_event(TE_TIMER, 0, t->waketime);
+    if (CONFIG_INLINE_STEPPER_HACK && likely(!t->func))
+        res = stepper_event(t);
+    else
+        res = t->func(t);
+
+    // Update timer_heap (rescheduling current timer if necessary)
+    if (unlikely(res == SF_DONE))
+        timer_heap_remove(0);
+    else
+        timer_heap_sift_down(0, t);
+
+    return timer_heap[0]->waketime;
+}
+
+// Remove all user timers
+void
+sched_timer_reset(void)
+{
+    timer_heap_count = 0;
+    deleted_timer.waketime = periodic_timer.waketime;
+    timer_heap_insert(&deleted_timer);
+    timer_heap_insert(&periodic_timer);
+    timer_kick();
+}
+
+#endif // CONFIG_SCHED_TIMER_HEAP
+
 
 /****************************************************************
  * Tasks
  ****************************************************************/
 
 static int_fast8_t tasks_status;
+static uint8_t priority_pending, priority_task_ran;
+static uint32_t priority_wake_time;
 
 #define TS_IDLE      -1
 #define TS_REQUESTED 0
@@ -209,6 +389,20 @@ sched_wake_task(struct task_wake *w)
     writeb(&w->wake, 1);
 }
 
+// Note that a high priority task (as declared by DECL_PRIORITY_TASK)
+// is ready to run
+void
+sched_wake_priority_task(struct task_wake *w)
+{
+    irqstatus_t flag = irq_save();
+    if (!priority_pending) {
+        priority_pending = 1;
+        priority_wake_time = timer_read_time();
+    }
+    irq_restore(flag);
+    sched_wake_task(w);
+}
+
 // Check if a task is ready to run (as indicated by sched_wake_task)
 uint8_t
 sched_check_wake(struct task_wake *w)
@@ -219,6 +413,65 @@ sched_check_wake(struct task_wake *w)
     return 1;
 }
 
+// Check if a high priority task is ready to run (as indicated by
+// sched_wake_priority_task)
+uint8_t
+sched_check_priority_wake(struct task_wake *w)
+{
+    if (!sched_check_wake(w))
+        return 0;
+    priority_task_ran = 1;
+    return 1;
+}
+
+// Run the high priority tasks if any of them were woken - called
+// between each regular task by the generated ctr_run_taskfuncs()
+void
+sched_run_priority_tasks(void)
+{
+    if (likely(!readb(&priority_pending)))
+        return;
+    irq_disable();
+    uint32_t wake_time = priority_wake_time;
+    priority_pending = 0;
+    irq_enable();
+    priority_task_ran = 0;
+    extern void ctr_run_priority_taskfuncs(uint32_t wake_time);
+    ctr_run_priority_taskfuncs(wake_time);
+}
+
+extern uint32_t priority_task_latency[];
+extern const uint8_t priority_task_count;
+
+// Track the worst case time from the wake up of a high priority task
+// until it completed - called by the generated
+// ctr_run_priority_taskfuncs()
+void
+sched_note_priority_task(uint_fast8_t id, uint32_t wake_time)
+{
+    if (!priority_task_ran)
+        return;
+    priority_task_ran = 0;
+    uint32_t latency = timer_read_time() - wake_time;
+    trace_event(TE_PRIORITY_TASK, id, latency);
+    if (CONFIG_WANT_TASK_STATS && latency > priority_task_latency[id])
+        priority_task_latency[id] = latency;
+}
+
+// Report (and reset) the high priority task latencies
+void
+sched_report_priority_tasks(void)
+{
+#if CONFIG_WANT_TASK_STATS
+    uint_fast8_t i, count = READP(priority_task_count);
+    for (i=0; i<count; i++) {
+        sendf("task_stats id=%c max_latency=%u"
+              , i, priority_task_latency[i]);
+        priority_task_latency[i] = 0;
+    }
+#endif
+}
+
 // Main task dispatch loop
 static void
 run_tasks(void)
@@ -247,6 +500,7 @@ run_tasks(void)
 
         // Update statistics
         uint32_t cur = timer_read_time();
+        trace_event(TE_TASKS, 0, start);
         stats_update(start, cur);
         start = cur;
     }
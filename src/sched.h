@@ -8,6 +8,10 @@
 #define DECL_INIT(FUNC) _DECL_CALLLIST(ctr_run_initfuncs, FUNC)
 // Declare a task function (called periodically during normal runtime)
 #define DECL_TASK(FUNC) _DECL_CALLLIST(ctr_run_taskfuncs, FUNC)
+// Declare a high priority task function (called before and between the
+// regular task functions after a sched_wake_priority_task() - it must
+// test its wake flag with sched_check_priority_wake() )
+#define DECL_PRIORITY_TASK(FUNC) _DECL_PRIORITY_TASK(FUNC)
 // Declare a shutdown function (called on an emergency stop)
 #define DECL_SHUTDOWN(FUNC) _DECL_CALLLIST(ctr_run_shutdownfuncs, FUNC)
 
@@ -33,7 +37,12 @@ void sched_timer_reset(void);
 void sched_wake_tasks(void);
 uint8_t sched_tasks_busy(void);
 void sched_wake_task(struct task_wake *w);
+void sched_wake_priority_task(struct task_wake *w);
 uint8_t sched_check_wake(struct task_wake *w);
+uint8_t sched_check_priority_wake(struct task_wake *w);
+void sched_run_priority_tasks(void);
+void sched_note_priority_task(uint_fast8_t id, uint32_t wake_time);
+void sched_report_priority_tasks(void);
 uint8_t sched_is_shutdown(void);
 void sched_clear_shutdown(void);
 void sched_try_shutdown(uint_fast8_t reason);
@@ -44,5 +53,7 @@ void sched_main(void);
 // Compiler glue for DECL_X macros above.
 #define _DECL_CALLLIST(NAME, FUNC)                                      \
     DECL_CTR("_DECL_CALLLIST " __stringify(NAME) " " __stringify(FUNC))
+#define _DECL_PRIORITY_TASK(FUNC)                                       \
+    DECL_CTR("_DECL_PRIORITY_TASK " __stringify(FUNC))
 
 #endif // sched.h
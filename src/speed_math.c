@@ -0,0 +1,131 @@
+// Integer math for the stepper speed mode
+//
+// Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// These functions avoid the float and 32bit division routines that
+// are slow on the AVR.  They only depend on CONFIG_CLOCK_FREQ so that
+// they can be checked against float math on the host (see
+// scripts/check_speed_math.py).
+
+#include "autoconf.h" // CONFIG_CLOCK_FREQ
+#include "board/pgm.h" // READP
+#include "speed_math.h" // speed_period
+
+// Integer square root (rounded down)
+uint32_t
+speed_isqrt(uint32_t v)
+{
+    uint32_t res = 0, bit = 1UL << 30;
+    while (bit > v)
+        bit >>= 2;
+    while (bit) {
+        if (v >= res + bit) {
+            v -= res + bit;
+            res = (res >> 1) + bit;
+        } else {
+            res >>= 1;
+        }
+        bit >>= 2;
+    }
+    return res;
+}
+
+
+/****************************************************************
+ * Step period
+ ****************************************************************/
+
+// CONFIG_CLOCK_FREQ / (1 + i/64) for speeds normalized to 1.0-2.0
+#define RECIP(i) ((uint32_t)(((uint64_t)CONFIG_CLOCK_FREQ * 64      \
+                              + (64 + (i)) / 2) / (64 + (i))))
+#define RECIP4(i) RECIP(i), RECIP(i+1), RECIP(i+2), RECIP(i+3)
+#define RECIP16(i) RECIP4(i), RECIP4(i+4), RECIP4(i+8), RECIP4(i+12)
+
+static const uint32_t recip_table[] PROGMEM = {
+    RECIP16(0), RECIP16(16), RECIP16(32), RECIP16(48), RECIP(64)
+};
+
+// Return CONFIG_CLOCK_FREQ / speed (speed must not be zero).  The
+// reciprocal is interpolated from a table (error below 0.01%).
+uint32_t
+speed_period(uint32_t speed)
+{
+    // Normalize the speed to 0x8000-0xffff
+    uint_fast8_t shift = 15;
+    while (speed < 0x8000) {
+        speed <<= 1;
+        shift--;
+    }
+    while (speed >= 0x10000) {
+        speed >>= 1;
+        shift++;
+    }
+    uint_fast8_t idx = (speed - 0x8000) >> 9, frac = (speed >> 1) & 0xff;
+    uint32_t r0 = READP(recip_table[idx]), r1 = READP(recip_table[idx + 1]);
+    uint32_t period = r0 - (((r0 - r1) * frac) >> 8);
+    return period >> shift;
+}
+
+
+/****************************************************************
+ * Stop distance speed limit
+ ****************************************************************/
+
+// Fill the table of sqrt(max_acc * dist) for dist up to max_dist
+void
+speed_limit_init(struct speed_limit *sl, uint32_t max_acc, uint32_t max_dist)
+{
+    sl->max_acc = max_acc;
+    sl->max_dist = max_dist;
+    uint_fast8_t shift = 0;
+    while ((max_dist >> shift) >= SPEED_LIMIT_SEGMENTS)
+        shift++;
+    sl->shift = shift;
+    uint_fast8_t i;
+    for (i = 0; i <= SPEED_LIMIT_SEGMENTS; i++) {
+        uint64_t v = (uint64_t)max_acc * ((uint64_t)i << shift);
+        uint_fast8_t vshift = 0;
+        while (v >> (2 * vshift) > 0xffffffff)
+            vshift++;
+        sl->speeds[i] = speed_isqrt(v >> (2 * vshift)) << vshift;
+    }
+}
+
+// Return the highest speed that can be stopped within 'dist' steps
+// (never more than sqrt(max_acc * dist))
+uint32_t
+speed_limit_lookup(struct speed_limit *sl, uint32_t dist)
+{
+    if (dist >= sl->max_dist)
+        dist = sl->max_dist;
+    uint_fast8_t shift = sl->shift;
+    uint32_t idx = dist >> shift, frac = dist & ((1UL << shift) - 1);
+    uint32_t s0 = sl->speeds[idx];
+    if (!frac)
+        return s0;
+    if (!idx) {
+        // sqrt() is steep near zero - compute it (with both factors
+        // reduced to 16 bits)
+        uint32_t acc = sl->max_acc;
+        uint_fast8_t k = 0;
+        while (acc >= 0x10000) {
+            acc >>= 2;
+            k++;
+        }
+        while (frac >= 0x10000) {
+            frac >>= 2;
+            k++;
+        }
+        return speed_isqrt(acc * frac) << k;
+    }
+    uint32_t s1 = sl->speeds[idx + 1];
+    // Linear interpolation (sqrt() is concave, so this is below it)
+    uint32_t diff = s1 - s0;
+    while (diff > (0xffffffff >> shift)) {
+        frac >>= 1;
+        shift--;
+    }
+    return s0 + ((diff * frac) >> shift);
+}
@@ -0,0 +1,21 @@
+#ifndef __SPEED_MATH_H
+#define __SPEED_MATH_H
+
+#include <stdint.h> // uint32_t
+
+#define SPEED_LIMIT_SEGMENTS 32
+
+// Highest speed (in steps/s) that can be stopped within a distance
+struct speed_limit {
+    uint32_t max_acc, max_dist;
+    uint8_t shift;
+    uint32_t speeds[SPEED_LIMIT_SEGMENTS + 1];
+};
+
+uint32_t speed_isqrt(uint32_t v);
+uint32_t speed_period(uint32_t speed);
+void speed_limit_init(struct speed_limit *sl, uint32_t max_acc
+                      , uint32_t max_dist);
+uint32_t speed_limit_lookup(struct speed_limit *sl, uint32_t dist);
+
+#endif // speed_math.h
@@ -9,10 +9,13 @@
 #include "board/gpio.h" // gpio_out_write
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_is_before
+#include "board/step_dma.h" // step_dma_get_block
+#include "board/step_freq.h" // step_freq_set
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // struct timer
+#include "speed_math.h" // speed_period
 #include "stepper.h" // command_config_stepper
-#include <math.h> // sqrt
+#include "trace.h" // trace_event
 
 #define abs_clamp(x, t) (((x) > (t)) ? (t) : (((x) < (-t)) ? (-t) : (x)))
 #define max(a, b) (((a) > (b)) ? (a) : (b))
@@ -40,17 +43,24 @@ struct speed_mode {
     uint32_t update_interval, min_freq, max_freq, max_acc;
 
     int32_t max_delta_freq, freq_limiter;
+    uint32_t steps_to_stop;
+    struct speed_limit *limit;
     int32_t current_speed, target_speed;
-    uint32_t current_period;
+    uint32_t current_period, target_period;
+    int32_t period_add;
 
     int32_t position, min_pos, max_pos;
+#if CONFIG_STEP_FREQ
+    uint16_t freq_count;
+    uint8_t step_pin_id;
+#endif
     // gcc (pre v6) does better optimization when uint8_t are bitfields
     uint8_t flags : 8;
 };
 
 enum {
     SM_SLOWING_DOWN=1<<0, SM_DIR_SAVE=1<<1, SM_CUR_DIR=1<<2,
-    SM_NEED_UPDATE=1<<3, SM_NEED_SLOWDOWN=1<<4
+    SM_NEED_UPDATE=1<<3, SM_NEED_SLOWDOWN=1<<4, SM_STEP_FREQ=1<<5
 };
 
 struct stepper {
@@ -70,6 +80,14 @@ struct stepper {
     uint32_t position;
     struct stepper_move *first, **plast;
     uint32_t min_stop_interval;
+#if CONFIG_STEPPER_GROUP
+    struct stepper *group_next;
+#endif
+#if CONFIG_STEP_DMA
+    struct stepper *dma_next;
+    uint32_t dma_set_mask, dma_reset_mask, dma_dir_bit, dma_reset_time;
+    uint8_t dma_flags;
+#endif
     // gcc (pre v6) does better optimization when uint8_t are bitfields
     uint8_t flags : 8;
 };
@@ -214,6 +232,448 @@ reschedule_min:
     return SF_RESCHEDULE;
 }
 
+
+
+/****************************************************************
+ * Stepper group
+ ****************************************************************/
+
+#if CONFIG_STEPPER_GROUP
+
+// On 32bit micro-controllers all the steppers may be driven from a
+// single timer.  Each active stepper keeps its next step (or unstep)
+// time in s->time.waketime, but only the group_timer is scheduled.
+// When it fires, every stepper due within the grouping window is
+// stepped in the same irq, which avoids a timer dispatch (and timer
+// list update) per step and per axis at high step rates.
+
+static struct timer group_timer;
+static struct stepper *group_list;
+static uint8_t group_active;
+
+// Timer callback - step all steppers that are due
+static uint_fast8_t
+stepper_group_event(struct timer *t)
+{
+    uint32_t window = timer_from_us(CONFIG_STEPPER_GROUP_WINDOW);
+    for (;;) {
+        uint32_t now = timer_read_time(), limit = now + window, next = 0;
+        uint_fast8_t active = 0;
+        struct stepper *s;
+        for (s = group_list; s; s = s->group_next) {
+            if (!s->count)
+                continue;
+            // Steps may be issued early (within the window), but an
+            // unstep must not shorten the step pulse
+            uint32_t due = (CONFIG_STEP_DELAY > 0 && s->count & 1
+                            ? now : limit);
+            if (!timer_is_before(due, s->time.waketime)
+                && stepper_event(&s->time) == SF_DONE)
+                continue;
+            if (!active || timer_is_before(s->time.waketime, next))
+                next = s->time.waketime;
+            active = 1;
+        }
+        if (!active) {
+            group_active = 0;
+            return SF_DONE;
+        }
+        if (timer_is_before(timer_read_time() + window, next)) {
+            t->waketime = next;
+            return SF_RESCHEDULE;
+        }
+    }
+}
+
+// Start stepping a stepper whose first step time is in s->time.waketime
+static void
+stepper_group_start(struct stepper *s)
+{
+    uint32_t waketime = s->time.waketime;
+    if (group_active) {
+        if (!timer_is_before(waketime, group_timer.waketime))
+            return;
+        sched_del_timer(&group_timer);
+    }
+    group_active = 1;
+    group_timer.waketime = waketime;
+    sched_add_timer(&group_timer);
+}
+
+// Add a stepper to the list of steppers driven by the group_timer
+static void
+stepper_group_add(struct stepper *s)
+{
+    group_timer.func = stepper_group_event;
+    s->group_next = group_list;
+    group_list = s;
+}
+
+// Note that the group_timer was removed by a shutdown
+static void
+stepper_group_reset(void)
+{
+    group_active = 0;
+}
+
+#else // CONFIG_STEPPER_GROUP
+
+static void
+stepper_group_start(struct stepper *s)
+{
+    sched_add_timer(&s->time);
+}
+
+static void
+stepper_group_add(struct stepper *s)
+{
+}
+
+static void
+stepper_group_reset(void)
+{
+}
+
+#endif // CONFIG_STEPPER_GROUP
+
+/****************************************************************
+ * Step DMA
+ ****************************************************************/
+
+#if CONFIG_STEP_DMA
+
+// Steppers whose step and dir pins are on the port driven by the
+// board's step DMA don't use their timer.  Instead, a task expands
+// their moves into the set/reset words of the DMA buffer a block
+// ahead of the DMA.  The steps of a move are removed from s->count
+// as they are written to the buffer (and step_dma_pending() reports
+// those not yet output), so stepper_get_position() and stepper_stop()
+// keep working mid-move.
+
+static struct stepper *dma_list;
+static struct task_wake step_dma_wake;
+static struct timer step_dma_timer;
+
+enum { DF_DIR_HIGH=1<<0, DF_DIR_CHANGE=1<<1, DF_RESET_PENDING=1<<2 };
+
+#define DMA_BLOCK_TICKS (CONFIG_STEP_DMA_BLOCK_SIZE * STEP_DMA_SLOT_TICKS)
+#define DMA_PULSE_SLOTS DIV_ROUND_UP(max(CONFIG_STEP_DELAY, 1)          \
+                                     * CONFIG_STEP_DMA_FREQ, 1000000)
+
+static inline int
+stepper_is_dma(struct stepper *s)
+{
+    return !!s->dma_set_mask;
+}
+
+// Setup a DMA driven stepper for the next move in its queue
+static void
+step_dma_load_next(struct stepper *s)
+{
+    struct stepper_move *m = s->first;
+    if (!m) {
+        if (s->interval - s->add < s->min_stop_interval
+            && !(s->flags & SF_NO_NEXT_CHECK))
+            shutdown("No next step");
+        s->count = 0;
+        return;
+    }
+    s->next_step_time += m->interval;
+    s->add = m->add;
+    s->interval = m->interval + m->add;
+    s->count = m->count;
+    if (m->flags & MF_DIR) {
+        // The dir pin is changed in the buffer before the next step
+        s->position = -s->position + m->count;
+        s->dma_flags ^= DF_DIR_HIGH | DF_DIR_CHANGE;
+    } else {
+        s->position += m->count;
+    }
+    s->first = m->next;
+    move_free(m);
+}
+
+// Write the steps of a stepper that fall in a block to the buffer
+static void
+step_dma_fill(struct stepper *s, uint32_t *block, uint32_t bstart)
+{
+    uint32_t bend = bstart + DMA_BLOCK_TICKS;
+    if (s->dma_flags & DF_RESET_PENDING) {
+        // The last step pulse ends in this block
+        if (!timer_is_before(s->dma_reset_time, bend))
+            return;
+        block[(s->dma_reset_time - bstart) / STEP_DMA_SLOT_TICKS]
+            |= s->dma_reset_mask;
+        s->dma_flags &= ~DF_RESET_PENDING;
+    }
+    for (;;) {
+        irq_disable();
+        uint32_t step_time = s->next_step_time;
+        if (!s->count || !timer_is_before(step_time, bend)) {
+            irq_enable();
+            return;
+        }
+        if (timer_is_before(step_time, bstart))
+            shutdown("Step DMA underrun");
+        uint32_t slot = (step_time - bstart) / STEP_DMA_SLOT_TICKS;
+        if (s->dma_flags & DF_DIR_CHANGE) {
+            // Change the dir pin when the last step pulse ends (but
+            // at least one slot before the next step)
+            uint32_t dir_slot = 0;
+            if (!timer_is_before(s->dma_reset_time, bstart))
+                dir_slot = (s->dma_reset_time - bstart) / STEP_DMA_SLOT_TICKS;
+            if (!slot)
+                slot = 1;
+            if (dir_slot >= slot)
+                dir_slot = slot - 1;
+            block[dir_slot] |= (s->dma_flags & DF_DIR_HIGH
+                                ? s->dma_dir_bit : s->dma_dir_bit << 16);
+            s->dma_flags &= ~DF_DIR_CHANGE;
+        }
+        block[slot] |= s->dma_set_mask;
+        slot += DMA_PULSE_SLOTS;
+        s->dma_reset_time = bstart + slot * STEP_DMA_SLOT_TICKS;
+        if (slot < CONFIG_STEP_DMA_BLOCK_SIZE)
+            block[slot] |= s->dma_reset_mask;
+        else
+            s->dma_flags |= DF_RESET_PENDING;
+        if (--s->count) {
+            s->next_step_time += s->interval;
+            s->interval += s->add;
+        } else {
+            step_dma_load_next(s);
+        }
+        irq_enable();
+    }
+}
+
+// Find the earliest time a DMA driven stepper needs the buffer
+static uint_fast8_t
+step_dma_next_time(uint32_t *next_time)
+{
+    uint_fast8_t active = 0;
+    struct stepper *s;
+    irq_disable();
+    for (s = dma_list; s; s = s->dma_next) {
+        uint32_t t;
+        if (s->dma_flags & DF_RESET_PENDING)
+            t = s->dma_reset_time;
+        else if (s->count)
+            t = s->next_step_time;
+        else
+            continue;
+        if (!active || timer_is_before(t, *next_time))
+            *next_time = t;
+        active = 1;
+    }
+    irq_enable();
+    return active;
+}
+
+static uint_fast8_t
+step_dma_timer_event(struct timer *t)
+{
+    sched_wake_task(&step_dma_wake);
+    return SF_DONE;
+}
+
+// Fill the DMA buffer while any DMA driven stepper is active
+void
+step_dma_task(void)
+{
+    if (!sched_check_wake(&step_dma_wake))
+        return;
+    for (;;) {
+        uint32_t start_time;
+        if (!step_dma_next_time(&start_time))
+            return;
+        uint32_t *block = step_dma_get_block(&start_time);
+        if (!block) {
+            if (start_time) {
+                // The first step is far away - check back later
+                irq_disable();
+                sched_del_timer(&step_dma_timer);
+                step_dma_timer.waketime = start_time;
+                sched_add_timer(&step_dma_timer);
+                irq_enable();
+            }
+            return;
+        }
+        struct stepper *s;
+        for (s = dma_list; s; s = s->dma_next)
+            step_dma_fill(s, block, start_time);
+        step_dma_commit();
+    }
+}
+DECL_TASK(step_dma_task);
+
+// A block of the DMA buffer was output
+void
+step_dma_block_free(void)
+{
+    sched_wake_task(&step_dma_wake);
+}
+
+// Start stepping a DMA driven stepper
+static void
+step_dma_start(struct stepper *s)
+{
+    step_dma_load_next(s);
+    sched_wake_task(&step_dma_wake);
+}
+
+// Return the number of steps (in the current direction) still in
+// the DMA buffer, optionally removing them.  Caller must disable irqs.
+static int32_t
+step_dma_stepper_pending(struct stepper *s, uint_fast8_t clear)
+{
+    if (!stepper_is_dma(s))
+        return 0;
+    int32_t net = step_dma_pending(
+        s->dma_set_mask, s->dma_dir_bit | s->dma_dir_bit << 16, clear);
+    if (clear)
+        s->dma_flags = 0;
+    // A pending dir change means the buffered steps are reversed
+    return s->dma_flags & DF_DIR_CHANGE ? -net : net;
+}
+
+// Drive a stepper from the DMA if its pins allow it
+static void
+step_dma_add(struct stepper *s, uint32_t step_pin, uint32_t dir_pin)
+{
+    uint32_t step_bit, dir_bit;
+    if (step_dma_setup_pins(step_pin, dir_pin, &step_bit, &dir_bit))
+        return;
+    uint_fast8_t invert = s->flags & SF_INVERT_STEP;
+    s->dma_set_mask = invert ? step_bit << 16 : step_bit;
+    s->dma_reset_mask = invert ? step_bit : step_bit << 16;
+    s->dma_dir_bit = dir_bit;
+    s->dma_next = dma_list;
+    dma_list = s;
+    step_dma_timer.func = step_dma_timer_event;
+}
+
+// Drive a stepper from its timer (needed for speed mode)
+static void
+step_dma_remove(struct stepper *s)
+{
+    struct stepper **ps;
+    for (ps = &dma_list; *ps; ps = &(*ps)->dma_next) {
+        if (*ps == s) {
+            *ps = s->dma_next;
+            break;
+        }
+    }
+    s->dma_set_mask = s->dma_reset_mask = s->dma_dir_bit = 0;
+}
+
+#else // CONFIG_STEP_DMA
+
+static inline int
+stepper_is_dma(struct stepper *s)
+{
+    return 0;
+}
+
+static void
+step_dma_start(struct stepper *s)
+{
+}
+
+static int32_t
+step_dma_stepper_pending(struct stepper *s, uint_fast8_t clear)
+{
+    return 0;
+}
+
+static void
+step_dma_add(struct stepper *s, uint32_t step_pin, uint32_t dir_pin)
+{
+}
+
+static void
+step_dma_remove(struct stepper *s)
+{
+}
+
+#endif // CONFIG_STEP_DMA
+
+/****************************************************************
+ * Speed mode hardware step output
+ ****************************************************************/
+
+#if CONFIG_STEP_FREQ
+
+// With CONFIG_STEP_FREQ, a stepper whose step pin is a timer output
+// has its speed mode steps generated by that timer (see
+// board/step_freq.h) instead of speed_mode_step_event().  The period
+// is reloaded at each speed_mode_update() and the steps counted by
+// the board are added to spdm.position.
+
+static inline int
+speed_mode_is_freq(struct stepper *s)
+{
+    return s->spdm.flags & SM_STEP_FREQ;
+}
+
+// Use the hardware step output if the step pin allows it
+static void
+speed_mode_freq_setup(struct stepper *s)
+{
+    if (!(s->spdm.flags & SM_STEP_FREQ)
+        && !step_freq_setup(s->spdm.step_pin_id, s->flags & SF_INVERT_STEP))
+        s->spdm.flags |= SM_STEP_FREQ;
+}
+
+// Add the steps output by the timer to the speed mode position.
+// Caller must disable irqs.
+static void
+speed_mode_freq_sync(struct stepper *s)
+{
+    if (!speed_mode_is_freq(s))
+        return;
+    uint16_t count = step_freq_count();
+    uint16_t steps = count - s->spdm.freq_count;
+    s->spdm.freq_count = count;
+    if (s->spdm.flags & SM_CUR_DIR)
+        s->spdm.position -= steps;
+    else
+        s->spdm.position += steps;
+}
+
+// Start the hardware step output when entering speed mode
+static void
+speed_mode_freq_start(struct stepper *s)
+{
+    step_freq_enable();
+    s->spdm.freq_count = step_freq_count();
+}
+
+#else // CONFIG_STEP_FREQ
+
+static inline int
+speed_mode_is_freq(struct stepper *s)
+{
+    return 0;
+}
+
+static void
+speed_mode_freq_setup(struct stepper *s)
+{
+}
+
+static void
+speed_mode_freq_sync(struct stepper *s)
+{
+}
+
+static void
+speed_mode_freq_start(struct stepper *s)
+{
+}
+
+#endif // CONFIG_STEP_FREQ
+
 void
 command_config_stepper(uint32_t *args)
 {
@@ -226,9 +686,16 @@ command_config_stepper(uint32_t *args)
     s->min_stop_interval = args[3];
     s->position = -POSITION_BIAS;
     s->spdm.flags = 0;
+#if CONFIG_STEP_FREQ
+    s->spdm.step_pin_id = args[1];
+#endif
     s->steps_per_mm = args[5]; // This is a rounded value, but it only
                                // slightly affects speed and
                                // acceleration limits.
+    if (CONFIG_STEP_DMA)
+        step_dma_add(s, args[1], args[2]);
+    if (!stepper_is_dma(s))
+        stepper_group_add(s);
     move_request_size(sizeof(struct stepper_move));
 }
 DECL_COMMAND(command_config_stepper,
@@ -239,6 +706,10 @@ void
 command_config_stepper_speed_mode(uint32_t *args)
 {
     struct stepper *s = stepper_oid_lookup(args[0]);
+    if (stepper_is_dma(s)) {
+        step_dma_remove(s);
+        stepper_group_add(s);
+    }
     s->spdm.update_rate = args[1];
     s->spdm.max_freq    = args[2] * s->steps_per_mm; // from mm.s-1 to step.s-1
     s->spdm.max_acc     = args[3] * s->steps_per_mm; // from mm.s-2 to step.s-2
@@ -248,6 +719,16 @@ command_config_stepper_speed_mode(uint32_t *args)
 
     // to ensure start off is possible, min_freq is never above max_delta_freq
     s->spdm.min_freq = min(100, s->spdm.max_delta_freq);
+
+    // distance needed to stop from max_freq (plus two updates)
+    s->spdm.steps_to_stop = ((uint64_t)s->spdm.max_freq * s->spdm.max_freq
+                             / (2 * s->spdm.max_acc)
+                             + 2 * s->spdm.max_freq / s->spdm.update_rate);
+    if (!s->spdm.limit)
+        s->spdm.limit = alloc_chunk(sizeof(*s->spdm.limit));
+    speed_limit_init(s->spdm.limit, s->spdm.max_acc, s->spdm.steps_to_stop);
+
+    speed_mode_freq_setup(s);
 }
 DECL_COMMAND(command_config_stepper_speed_mode,
              "config_stepper_speed_mode oid=%c rate=%hu max_velocity=%u"
@@ -287,18 +768,31 @@ command_queue_step(uint32_t *args)
     flags &= ~SF_LAST_RESET;
     if (s->count) {
         s->flags = flags;
-        if (s->first)
+        if (s->first) {
             *s->plast = m;
-        else
+        } else {
+            // Only the active move remains - note (approximately) when
+            // it completes so the host can see how close to an
+            // underrun the queue was
+            uint32_t count = s->count;
+            if (CONFIG_STEP_DELAY > 0 && !stepper_is_dma(s))
+                count /= 2;
+            trace_event(TE_STEP_MARGIN, args[0]
+                        , s->next_step_time + s->interval * count);
             s->first = m;
+        }
         s->plast = &m->next;
     } else if (flags & SF_NEED_RESET) {
         move_free(m);
     } else {
         s->flags = flags;
         s->first = m;
-        stepper_load_next(s, s->next_step_time + m->interval);
-        sched_add_timer(&s->time);
+        if (stepper_is_dma(s)) {
+            step_dma_start(s);
+        } else {
+            stepper_load_next(s, s->next_step_time + m->interval);
+            stepper_group_start(s);
+        }
     }
     irq_enable();
 }
@@ -338,10 +832,12 @@ stepper_get_position(struct stepper *s)
 {
     uint32_t position = s->position;
     // If stepper is mid-move, subtract out steps not yet taken
-    if (CONFIG_STEP_DELAY <= 0)
+    if (CONFIG_STEP_DELAY <= 0 || stepper_is_dma(s))
         position -= s->count;
     else
         position -= s->count / 2;
+    // DMA driven steppers may also have steps in the buffer
+    position -= step_dma_stepper_pending(s, 0);
     // The top bit of s->position is an optimized reverse direction flag
     if (position & 0x80000000)
         return -position;
@@ -374,8 +870,10 @@ stepper_set_target_speed(struct stepper* s, int32_t target_speed)
 int32_t
 stepper_position(struct stepper *s)
 {
-    if(s->flags & SF_SPEED_MODE)
+    if(s->flags & SF_SPEED_MODE) {
+        speed_mode_freq_sync(s);
         return s->spdm.position;
+    }
     else
         return stepper_get_position(s) - POSITION_BIAS;
 }
@@ -386,32 +884,65 @@ stepper_speed(struct stepper *s)
     return s->count ? CONFIG_CLOCK_FREQ / (s->steps_per_mm * s->interval) : 0;
 }
 
+// Ramp the step period from last_period to period over the next
+// update interval, with a constant change per step (like the 'add'
+// of queue_step).  Starts, stops and direction changes are not
+// ramped.  Caller must disable irqs.
+static void
+speed_mode_set_period(struct stepper *s, uint32_t last_period
+                      , uint32_t period)
+{
+    s->spdm.target_period = period;
+    s->spdm.period_add = 0;
+    if (last_period && period && !speed_mode_is_freq(s)) {
+        uint32_t steps = 2 * s->spdm.update_interval / (last_period + period);
+        int32_t add = (int32_t)(period - last_period) / (int32_t)(steps + 1);
+        if (add) {
+            s->spdm.current_period = last_period + add;
+            s->spdm.period_add = add;
+            return;
+        }
+    }
+    s->spdm.current_period = period;
+}
+
 void
 speed_mode_update(struct stepper *s)
 {
     s->spdm.flags &= ~SM_NEED_UPDATE;
 
+    irq_disable();
+    speed_mode_freq_sync(s);
+    irq_enable();
+
     // apply position based limiter (to avoid stepper max position overrun)
     int32_t dist_to_min = max(0, s->spdm.position - (s->spdm.min_pos + 1));
     int32_t dist_to_max = max(0, (s->spdm.max_pos - 1) - s->spdm.position);
-    uint32_t steps_to_stop = pow(s->spdm.max_freq, 2) / (2 * s->spdm.max_acc)
-                             + 2 * s->spdm.max_freq / s->spdm.update_rate;
+    uint32_t steps_to_stop = s->spdm.steps_to_stop;
 
     if(dist_to_min <= steps_to_stop)
     {
-        int32_t limit = sqrt((float)s->spdm.max_acc * dist_to_min);
+        int32_t limit = speed_limit_lookup(s->spdm.limit, dist_to_min);
         s->spdm.target_speed = max(s->spdm.target_speed, -limit);
     }
     if(dist_to_max <= steps_to_stop)
     {
-        int32_t limit = sqrt((float)s->spdm.max_acc * dist_to_max);
+        int32_t limit = speed_limit_lookup(s->spdm.limit, dist_to_max);
         s->spdm.target_speed = min(s->spdm.target_speed, limit);
     }
 
     // time based limiter (for slowdown)
     if(s->spdm.flags & SM_SLOWING_DOWN) {
         if(s->spdm.freq_limiter < s->spdm.max_delta_freq) {
-            sched_del_timer(&s->spdm.step_timer);
+            if (speed_mode_is_freq(s)) {
+                irq_disable();
+                step_freq_set(0);
+                speed_mode_freq_sync(s);
+                irq_enable();
+                step_freq_disable();
+            } else {
+                sched_del_timer(&s->spdm.step_timer);
+            }
             sched_del_timer(&s->spdm.update_timer);
             if(!!(s->spdm.flags & SM_CUR_DIR) !=
                !!(s->spdm.flags & SM_DIR_SAVE)) {
@@ -444,19 +975,27 @@ speed_mode_update(struct stepper *s)
     uint8_t prev_dir = s->spdm.current_speed < 0;
 
     // compute period according to speed, period of zero means no speed
+    uint32_t period = 0;
     if(abs(s->spdm.current_speed) > 0) {
-        s->spdm.current_period = CONFIG_CLOCK_FREQ / abs(s->spdm.current_speed);
-    }
-    else {
-        s->spdm.current_period = 0;
+        period = speed_period(abs(s->spdm.current_speed));
     }
 
     irq_disable();
+    uint32_t last_period = s->spdm.current_period;
     // possibly apply direction change
     if (!!(prev_dir) != !!(s->spdm.flags & SM_CUR_DIR)) {
+        if (speed_mode_is_freq(s)) {
+            // Count the steps of the old direction before changing it
+            step_freq_set(0);
+            speed_mode_freq_sync(s);
+        }
         gpio_out_toggle_noirq(s->dir_pin);
         s->spdm.flags ^= SM_CUR_DIR;
+        last_period = 0;
     }
+    if (speed_mode_is_freq(s))
+        step_freq_set(period);
+    speed_mode_set_period(s, last_period, period);
     irq_enable();
 }
 
@@ -473,6 +1012,16 @@ speed_mode_step_event(struct timer *t)
         gpio_out_toggle_noirq(s->step_pin);
         t->waketime += s->spdm.current_period;
         s->spdm.position += (s->spdm.flags & SM_CUR_DIR) ? -1 : 1;
+        int32_t add = s->spdm.period_add;
+        if (add) {
+            int32_t next = s->spdm.current_period + add;
+            int32_t target = s->spdm.target_period;
+            if (add > 0 ? next >= target : next <= target) {
+                next = target;
+                s->spdm.period_add = 0;
+            }
+            s->spdm.current_period = next;
+        }
         gpio_out_toggle_noirq(s->step_pin);
     }
     return SF_RESCHEDULE;
@@ -486,7 +1035,7 @@ speed_mode_update_event(struct timer *t)
                         struct stepper, spdm);
     t->waketime += s->spdm.update_interval;
     s->spdm.flags |= SM_NEED_UPDATE;
-    sched_wake_task(&speed_mode_update_wake);
+    sched_wake_priority_task(&speed_mode_update_wake);
     return SF_RESCHEDULE;
 }
 
@@ -538,18 +1087,23 @@ stepper_set_speed_mode(struct stepper *s, int32_t min_pos, int32_t max_pos)
         s->spdm.flags &= ~(SM_CUR_DIR | SM_SLOWING_DOWN);
         s->spdm.position = stepper_get_position(s) - POSITION_BIAS;
         s->spdm.current_period = 0;
+        s->spdm.period_add     = 0;
         s->spdm.current_speed  = 0;
         s->spdm.target_speed   = 0;
 
         uint32_t now = timer_read_time();
-        sched_wake_task(&speed_mode_update_wake);
+        sched_wake_priority_task(&speed_mode_update_wake);
         s->spdm.update_timer.func = speed_mode_update_event;
         s->spdm.update_timer.waketime = now + s->spdm.update_interval;
         sched_add_timer(&s->spdm.update_timer);
 
-        s->spdm.step_timer.func = speed_mode_step_event;
-        s->spdm.step_timer.waketime = now + timer_from_us(200);
-        sched_add_timer(&s->spdm.step_timer);
+        if (speed_mode_is_freq(s)) {
+            speed_mode_freq_start(s);
+        } else {
+            s->spdm.step_timer.func = speed_mode_step_event;
+            s->spdm.step_timer.waketime = now + timer_from_us(200);
+            sched_add_timer(&s->spdm.step_timer);
+        }
 
         s->flags |= SF_SPEED_MODE | SM_NEED_UPDATE;
 }
@@ -559,10 +1113,13 @@ stepper_set_speed_mode(struct stepper *s, int32_t min_pos, int32_t max_pos)
 void
 stepper_stop(struct stepper *s)
 {
-    sched_del_timer(&s->time);
+    // A grouped stepper is skipped by the group_timer once s->count is 0
+    if (!CONFIG_STEPPER_GROUP)
+        sched_del_timer(&s->time);
     s->next_step_time = 0;
     s->position = -stepper_get_position(s);
     s->count = 0;
+    step_dma_stepper_pending(s, 1);
     s->flags = (s->flags & SF_INVERT_STEP) | SF_NEED_RESET;
     gpio_out_write(s->dir_pin, 0);
     gpio_out_write(s->step_pin, s->flags & SF_INVERT_STEP);
@@ -594,7 +1151,7 @@ DECL_TASK(slowdown_task);
 void
 speed_mode_update_task(void)
 {
-    if (!sched_check_wake(&speed_mode_update_wake))
+    if (!sched_check_priority_wake(&speed_mode_update_wake))
         return;
 
     uint8_t i;
@@ -604,7 +1161,7 @@ speed_mode_update_task(void)
             speed_mode_update(s);
     }
 }
-DECL_TASK(speed_mode_update_task);
+DECL_PRIORITY_TASK(speed_mode_update_task);
 
 void
 stepper_shutdown(void)
@@ -615,5 +1172,6 @@ stepper_shutdown(void)
         s->first = NULL;
         stepper_stop(s);
     }
+    stepper_group_reset();
 }
 DECL_SHUTDOWN(stepper_shutdown);
@@ -55,6 +55,15 @@ GPIO_TypeDef * const digital_regs[] = {
 #endif
 };
 
+// Return the gpio port registers of a pin (or NULL if no such port)
+GPIO_TypeDef *
+gpio_pin_regs(uint32_t pin)
+{
+    if (GPIO2PORT(pin) >= ARRAY_SIZE(digital_regs))
+        return NULL;
+    return digital_regs[GPIO2PORT(pin)];
+}
+
 // Convert a register and bit location back to an integer pin identifier
 static int
 regs_to_pin(GPIO_TypeDef *regs, uint32_t bit)
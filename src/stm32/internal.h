@@ -29,7 +29,16 @@ extern GPIO_TypeDef * const digital_regs[];
 void enable_pclock(uint32_t periph_base);
 int is_enabled_pclock(uint32_t periph_base);
 uint32_t get_pclock_frequency(uint32_t periph_base);
+GPIO_TypeDef *gpio_pin_regs(uint32_t pin);
 void gpio_clock_enable(GPIO_TypeDef *regs);
 void gpio_peripheral(uint32_t gpio, uint32_t mode, int pullup);
 
+// Timers run at twice their bus clock when the bus clock is divided
+static inline uint32_t
+get_timer_frequency(uint32_t periph_base)
+{
+    uint32_t pclk = get_pclock_frequency(periph_base);
+    return pclk < CONFIG_CLOCK_FREQ ? 2 * pclk : pclk;
+}
+
 #endif // internal.h
@@ -0,0 +1,281 @@
+// DMA based step pulse generation on stm32
+//
+// Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// A hardware timer triggers a DMA transfer at a fixed rate
+// (CONFIG_STEP_DMA_FREQ) that copies one word of a circular buffer to
+// the BSRR register of a gpio port.  The buffer is split into two
+// blocks that are filled by stepper.c (in task context) with the set
+// and reset bits of the step and dir pins, while the DMA outputs the
+// other block.  A block is cleared and handed back to stepper.c once
+// it has been output.  If the DMA reaches a block that was not filled
+// in time, the DMA is stopped.
+
+#include <string.h> // memset
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
+#include "board/misc.h" // timer_read_time
+#include "board/step_dma.h" // step_dma_get_block
+#include "command.h" // shutdown
+#include "internal.h" // GPIO
+#include "sched.h" // sched_add_timer
+
+#define BLOCK_SIZE CONFIG_STEP_DMA_BLOCK_SIZE
+#define BUF_SIZE (2 * BLOCK_SIZE)
+#define BLOCK_TICKS (BLOCK_SIZE * STEP_DMA_SLOT_TICKS)
+
+#if CONFIG_MACH_STM32F1
+// TIM2 update events trigger DMA1 channel 2
+#define STEP_TIM TIM2
+#define STEP_DMA DMA1_Channel2
+#define STEP_DMA_IRQn DMA1_Channel2_IRQn
+#define DMA_CR_CONFIG (DMA_CCR_DIR | DMA_CCR_CIRC | DMA_CCR_MINC        \
+                       | DMA_CCR_PSIZE_1 | DMA_CCR_MSIZE_1              \
+                       | DMA_CCR_HTIE | DMA_CCR_TCIE)
+#define DMA_CR_EN DMA_CCR_EN
+#define DMA_COUNT CNDTR
+#define DMA_HT_FLAG() (DMA1->ISR & DMA_ISR_HTIF2)
+#define DMA_CLEAR_FLAGS() (DMA1->IFCR = DMA_IFCR_CGIF2)
+#define DMA_SET_ADDR(periph, mem) do {                  \
+        STEP_DMA->CPAR = (periph);                      \
+        STEP_DMA->CMAR = (mem);                         \
+    } while (0)
+#define DMA_CR CCR
+#define enable_step_clocks() do {                       \
+        RCC->AHBENR |= RCC_AHBENR_DMA1EN;               \
+        enable_pclock((uint32_t)STEP_TIM);              \
+    } while (0)
+#else
+// TIM1 update events trigger DMA2 stream 5 (channel 6) - only DMA2
+// can write to the gpio registers
+#define STEP_TIM TIM1
+#define STEP_DMA DMA2_Stream5
+#define STEP_DMA_IRQn DMA2_Stream5_IRQn
+#define DMA_CR_CONFIG ((6 << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_DIR_0       \
+                       | DMA_SxCR_CIRC | DMA_SxCR_MINC                  \
+                       | DMA_SxCR_PSIZE_1 | DMA_SxCR_MSIZE_1            \
+                       | DMA_SxCR_HTIE | DMA_SxCR_TCIE)
+#define DMA_CR_EN DMA_SxCR_EN
+#define DMA_COUNT NDTR
+#define DMA_HT_FLAG() (DMA2->HISR & DMA_HISR_HTIF5)
+#define DMA_CLEAR_FLAGS() (DMA2->HIFCR = (                              \
+        DMA_HIFCR_CTCIF5 | DMA_HIFCR_CHTIF5 | DMA_HIFCR_CTEIF5          \
+        | DMA_HIFCR_CDMEIF5 | DMA_HIFCR_CFEIF5))
+#define DMA_SET_ADDR(periph, mem) do {                  \
+        STEP_DMA->PAR = (periph);                       \
+        STEP_DMA->M0AR = (mem);                         \
+    } while (0)
+#define DMA_CR CR
+#define enable_step_clocks() do {                       \
+        RCC->AHB1ENR |= RCC_AHB1ENR_DMA2EN;             \
+        enable_pclock((uint32_t)STEP_TIM);              \
+    } while (0)
+#endif
+
+static uint32_t step_dma_buf[BUF_SIZE];
+static GPIO_TypeDef *step_dma_regs;
+static struct timer start_timer;
+static uint32_t fill_time;
+static uint8_t fill_block, playing_block, step_dma_state, fill_restart;
+static uint8_t block_status[2];
+static uint32_t timer_mhz;
+
+enum { SS_IDLE, SS_STARTING, SS_RUNNING };
+enum { BS_FREE, BS_FILLING, BS_READY };
+
+// Time between handing out the first block and the start of the DMA
+#define START_DELAY timer_from_us(500)
+
+
+/****************************************************************
+ * DMA control
+ ****************************************************************/
+
+// Stop the timer and the DMA
+static void
+step_dma_stop(void)
+{
+    STEP_TIM->CR1 = 0;
+    STEP_DMA->DMA_CR = 0;
+    DMA_CLEAR_FLAGS();
+    step_dma_state = SS_IDLE;
+}
+
+// Start the DMA so that the first slot is output at the start time
+// of the first block
+static uint_fast8_t
+start_event(struct timer *t)
+{
+    STEP_DMA->DMA_CR = 0;
+    DMA_CLEAR_FLAGS();
+    // Drop any stale update event dma request
+    STEP_TIM->DIER = 0;
+    STEP_TIM->SR = 0;
+    STEP_TIM->DIER = TIM_DIER_UDE;
+    DMA_SET_ADDR((uint32_t)&step_dma_regs->BSRR, (uint32_t)step_dma_buf);
+    STEP_DMA->DMA_COUNT = BUF_SIZE;
+    STEP_DMA->DMA_CR = DMA_CR_CONFIG | DMA_CR_EN;
+    // Account for the irq latency so the update events are aligned
+    // with the block times
+    uint32_t late = timer_read_time() - t->waketime;
+    if (late >= STEP_DMA_SLOT_TICKS)
+        shutdown("Step DMA started too late");
+    STEP_TIM->CNT = late * timer_mhz / (CONFIG_CLOCK_FREQ / 1000000);
+    STEP_TIM->CR1 = TIM_CR1_CEN;
+    playing_block = 0;
+    step_dma_state = SS_RUNNING;
+    return SF_DONE;
+}
+
+// A block was output - clear it and check that the next one is ready
+void
+STEP_DMA_IRQHandler(void)
+{
+    uint32_t done = DMA_HT_FLAG() ? 0 : 1;
+    DMA_CLEAR_FLAGS();
+    memset(&step_dma_buf[done * BLOCK_SIZE], 0
+           , BLOCK_SIZE * sizeof(step_dma_buf[0]));
+    block_status[done] = BS_FREE;
+    playing_block = done ^ 1;
+    if (block_status[playing_block] != BS_READY)
+        // Underrun (or no more steps) - stepper.c notices the former
+        step_dma_stop();
+    step_dma_block_free();
+}
+
+void
+step_dma_init(void)
+{
+    enable_step_clocks();
+    // The timer clock depends on its bus clock divider (it is half of
+    // CONFIG_CLOCK_FREQ for TIM1 on the f4 with its APB2 at /4)
+    uint32_t timer_freq = get_timer_frequency((uint32_t)STEP_TIM);
+    timer_mhz = timer_freq / 1000000;
+    STEP_TIM->CR1 = 0;
+    STEP_TIM->PSC = 0;
+    STEP_TIM->ARR = timer_freq / CONFIG_STEP_DMA_FREQ - 1;
+    STEP_TIM->DIER = TIM_DIER_UDE;
+    STEP_TIM->EGR = TIM_EGR_UG;
+    start_timer.func = start_event;
+    armcm_enable_irq(STEP_DMA_IRQHandler, STEP_DMA_IRQn, 1);
+}
+DECL_INIT(step_dma_init);
+
+void
+step_dma_shutdown(void)
+{
+    step_dma_stop();
+    memset(step_dma_buf, 0, sizeof(step_dma_buf));
+    block_status[0] = block_status[1] = BS_FREE;
+}
+DECL_SHUTDOWN(step_dma_shutdown);
+
+
+/****************************************************************
+ * Interface
+ ****************************************************************/
+
+// Check that the step and dir pins can be driven by the DMA (they
+// must be on the same gpio port as the other DMA driven steppers)
+int
+step_dma_setup_pins(uint32_t step_pin, uint32_t dir_pin
+                    , uint32_t *step_bit, uint32_t *dir_bit)
+{
+    if (GPIO2PORT(step_pin) != GPIO2PORT(dir_pin))
+        return -1;
+    GPIO_TypeDef *regs = gpio_pin_regs(step_pin);
+    if (!regs || (step_dma_regs && regs != step_dma_regs))
+        return -1;
+    step_dma_regs = regs;
+    *step_bit = GPIO2BIT(step_pin);
+    *dir_bit = GPIO2BIT(dir_pin);
+    return 0;
+}
+
+// Return the next block to fill and the time of its first slot.  On
+// entry start_time holds the time of the earliest pending step.  If
+// no block is available NULL is returned and start_time is set to the
+// time to retry at (or 0 to wait for step_dma_block_free()).
+uint32_t *
+step_dma_get_block(uint32_t *start_time)
+{
+    irqstatus_t flag = irq_save();
+    uint32_t *block = NULL;
+    if (step_dma_state == SS_IDLE && block_status[0] == BS_FREE
+        && block_status[1] == BS_FREE) {
+        uint32_t start = timer_read_time() + START_DELAY;
+        if (timer_is_before(start + BLOCK_TICKS, *start_time)) {
+            // Don't start the DMA until the first step is near
+            *start_time -= START_DELAY + BLOCK_TICKS;
+            irq_restore(flag);
+            return NULL;
+        }
+        fill_block = 0;
+        fill_time = start;
+        fill_restart = 1;
+    }
+    if (block_status[fill_block] == BS_FREE) {
+        block_status[fill_block] = BS_FILLING;
+        block = &step_dma_buf[fill_block * BLOCK_SIZE];
+        *start_time = fill_time;
+    } else {
+        *start_time = 0;
+    }
+    irq_restore(flag);
+    return block;
+}
+
+// Queue the block returned by step_dma_get_block() for output
+void
+step_dma_commit(void)
+{
+    irqstatus_t flag = irq_save();
+    uint32_t block_time = fill_time;
+    block_status[fill_block] = BS_READY;
+    fill_block ^= 1;
+    fill_time += BLOCK_TICKS;
+    if (step_dma_state == SS_IDLE) {
+        if (!fill_restart)
+            // The DMA stopped while this block was being filled
+            shutdown("Step DMA underrun");
+        fill_restart = 0;
+        step_dma_state = SS_STARTING;
+        start_timer.waketime = block_time - STEP_DMA_SLOT_TICKS;
+        sched_add_timer(&start_timer);
+    }
+    irq_restore(flag);
+}
+
+// Return the number of steps (in the current direction) that are in
+// the buffer but not yet output, and optionally remove them (and any
+// pending dir changes).  Caller must disable irqs.
+int32_t
+step_dma_pending(uint32_t step_mask, uint32_t dir_mask, uint_fast8_t clear)
+{
+    uint32_t start = 0, end = BUF_SIZE, all_step = step_mask;
+    all_step |= step_mask << 16 | step_mask >> 16;
+    if (step_dma_state == SS_RUNNING)
+        end = playing_block * BLOCK_SIZE + BUF_SIZE;
+    int32_t net = 0, dir = 1;
+    uint32_t pos;
+    for (pos = end; pos-- > start; ) {
+        if (step_dma_state == SS_RUNNING) {
+            // Don't touch slots the DMA is about to output
+            uint32_t cur = BUF_SIZE - STEP_DMA->DMA_COUNT;
+            if (cur < playing_block * BLOCK_SIZE)
+                cur += BUF_SIZE;
+            if (pos <= cur + 1)
+                break;
+        }
+        uint32_t *p = &step_dma_buf[pos % BUF_SIZE], w = *p;
+        if (w & step_mask)
+            net += dir;
+        if (w & dir_mask)
+            dir = -dir;
+        if (clear)
+            *p = w & ~(all_step | dir_mask);
+    }
+    return net;
+}
@@ -0,0 +1,232 @@
+// Hardware timer step output for a stepper in speed mode on stm32
+//
+// Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// The step pin is driven by a timer channel in pwm mode 2, so each
+// timer period ends with a step pulse.  A second timer, clocked by
+// the channel's output reference (TRGO), counts the pulses that were
+// actually output.  New periods are preloaded and take effect at the
+// end of the current period.
+
+#include "autoconf.h" // CONFIG_CLOCK_FREQ
+#include "board/irq.h" // irq_save
+#include "board/step_freq.h" // step_freq_setup
+#include "compiler.h" // ARRAY_SIZE
+#include "internal.h" // GPIO
+#include "sched.h" // DECL_SHUTDOWN
+
+struct step_freq_info {
+    uint8_t pin, timer, channel, function;
+};
+
+enum { FT_TIM2, FT_TIM3, FT_TIM4 };
+
+static const struct step_freq_info step_freq_pins[] = {
+#if !(CONFIG_STEP_DMA && CONFIG_MACH_STM32F1)
+    // TIM2 is used by the step dma on the stm32f1
+    {GPIO('A', 0), FT_TIM2, 1, 1}, {GPIO('A', 1), FT_TIM2, 2, 1},
+    {GPIO('A', 2), FT_TIM2, 3, 1}, {GPIO('A', 3), FT_TIM2, 4, 1},
+#endif
+    {GPIO('A', 6), FT_TIM3, 1, 2}, {GPIO('A', 7), FT_TIM3, 2, 2},
+    {GPIO('B', 0), FT_TIM3, 3, 2}, {GPIO('B', 1), FT_TIM3, 4, 2},
+    {GPIO('B', 6), FT_TIM4, 1, 2}, {GPIO('B', 7), FT_TIM4, 2, 2},
+    {GPIO('B', 8), FT_TIM4, 3, 2}, {GPIO('B', 9), FT_TIM4, 4, 2},
+#if CONFIG_MACH_STM32F4
+    {GPIO('A', 5), FT_TIM2, 1, 1}, {GPIO('A', 15), FT_TIM2, 1, 1},
+    {GPIO('B', 3), FT_TIM2, 2, 1}, {GPIO('B', 10), FT_TIM2, 3, 1},
+    {GPIO('B', 11), FT_TIM2, 4, 1},
+    {GPIO('B', 4), FT_TIM3, 1, 2}, {GPIO('B', 5), FT_TIM3, 2, 2},
+    {GPIO('C', 6), FT_TIM3, 1, 2}, {GPIO('C', 7), FT_TIM3, 2, 2},
+    {GPIO('C', 8), FT_TIM3, 3, 2}, {GPIO('C', 9), FT_TIM3, 4, 2},
+    {GPIO('D', 12), FT_TIM4, 1, 2}, {GPIO('D', 13), FT_TIM4, 2, 2},
+    {GPIO('D', 14), FT_TIM4, 3, 2}, {GPIO('D', 15), FT_TIM4, 4, 2},
+#endif
+};
+
+// The timer counting the pulses and its trigger input (ITRx) for
+// each output timer
+static TIM_TypeDef * const output_timers[] = { TIM2, TIM3, TIM4 };
+static TIM_TypeDef * const count_timers[] = { TIM3, TIM4, TIM3 };
+static const uint8_t count_triggers[] = { 1, 2, 3 };
+
+// Channel output modes (OCxM)
+#define OCM_FORCE_INACTIVE 0x4
+#define OCM_PWM2 0x7
+
+static TIM_TypeDef *out_tim, *count_tim;
+static volatile uint32_t *out_ccr;
+static uint32_t out_pin, pin_function, ccmr_shift, clock_div, pulse_ticks;
+static GPIO_TypeDef *pin_regs;
+static uint32_t pin_bit, pin_active, active_ccr, pending_ccr;
+static uint8_t running;
+
+
+/****************************************************************
+ * Timer control
+ ****************************************************************/
+
+// Set the output mode of the step channel
+static void
+set_output_mode(uint32_t ocm)
+{
+    volatile uint32_t *ccmr = ccmr_shift >= 16 ? &out_tim->CCMR2
+                                               : &out_tim->CCMR1;
+    uint32_t shift = ccmr_shift % 16;
+    *ccmr = ((*ccmr & ~(0xff << shift))
+             | (((ocm << 4) | TIM_CCMR1_OC1PE) << shift));
+}
+
+// Note which compare value the timer is using (the last preloaded
+// one once an update event occurred)
+static void
+update_active_ccr(void)
+{
+    if (out_tim->SR & TIM_SR_UIF) {
+        out_tim->SR = ~TIM_SR_UIF;
+        active_ccr = pending_ccr;
+    }
+}
+
+// Stop the output without truncating a step pulse in progress
+static void
+step_freq_stop(void)
+{
+    if (!running)
+        return;
+    // Pulses start when the counter reaches the compare value and end
+    // at the update event
+    for (;;) {
+        update_active_ccr();
+        if (out_tim->CNT + 1 < active_ccr
+            && (pin_regs->IDR & pin_bit) != pin_active)
+            break;
+    }
+    set_output_mode(OCM_FORCE_INACTIVE);
+    out_tim->CR1 = 0;
+    running = 0;
+}
+
+void
+step_freq_shutdown(void)
+{
+    if (out_tim) {
+        set_output_mode(OCM_FORCE_INACTIVE);
+        out_tim->CR1 = 0;
+        running = 0;
+    }
+}
+DECL_SHUTDOWN(step_freq_shutdown);
+
+
+/****************************************************************
+ * Interface
+ ****************************************************************/
+
+// Claim the timer of a step pin (returns non-zero if the pin can't
+// be driven by a timer)
+int
+step_freq_setup(uint32_t step_pin, uint8_t invert)
+{
+    if (out_tim)
+        return -1;
+    const struct step_freq_info *p = step_freq_pins;
+    for (; ; p++) {
+        if (p >= &step_freq_pins[ARRAY_SIZE(step_freq_pins)])
+            return -1;
+        if (p->pin == step_pin)
+            break;
+    }
+    out_tim = output_timers[p->timer];
+    count_tim = count_timers[p->timer];
+    uint32_t ch = p->channel - 1;
+    out_ccr = &out_tim->CCR1 + ch;
+    ccmr_shift = (ch / 2) * 16 + (ch % 2) * 8;
+    out_pin = step_pin;
+    pin_function = p->function;
+    pin_regs = digital_regs[GPIO2PORT(step_pin)];
+    pin_bit = GPIO2BIT(step_pin);
+    pin_active = invert ? 0 : pin_bit;
+
+    enable_pclock((uint32_t)out_tim);
+    enable_pclock((uint32_t)count_tim);
+    uint32_t timer_freq = get_timer_frequency((uint32_t)out_tim);
+    clock_div = CONFIG_CLOCK_FREQ / timer_freq;
+    uint32_t delay = CONFIG_STEP_DELAY > 0 ? CONFIG_STEP_DELAY : 1;
+    pulse_ticks = delay * (timer_freq / 1000000);
+
+    // Output timer: pwm mode 2 on the step channel, OCxREF on TRGO
+    out_tim->CR1 = 0;
+    set_output_mode(OCM_FORCE_INACTIVE);
+    out_tim->CCER = ((TIM_CCER_CC1E | (invert ? TIM_CCER_CC1P : 0))
+                     << (ch * 4));
+    out_tim->CR2 = (4 + ch) << TIM_CR2_MMS_Pos;
+    // Count timer: external clock mode 1 on the output timer's TRGO
+    count_tim->CR1 = 0;
+    count_tim->PSC = 0;
+    count_tim->ARR = 0xffff;
+    count_tim->SMCR = ((count_triggers[p->timer] << TIM_SMCR_TS_Pos)
+                       | TIM_SMCR_SMS);
+    count_tim->EGR = TIM_EGR_UG;
+    count_tim->CR1 = TIM_CR1_CEN;
+    return 0;
+}
+
+// Route the step pin to the timer
+void
+step_freq_enable(void)
+{
+    gpio_peripheral(out_pin, GPIO_FUNCTION(pin_function), 0);
+}
+
+// Output a step every 'period' clock ticks (or stop if period is 0).
+// A new period takes effect at the end of the current one.
+void
+step_freq_set(uint32_t period)
+{
+    irqstatus_t flag = irq_save();
+    if (!period) {
+        step_freq_stop();
+        irq_restore(flag);
+        return;
+    }
+    uint32_t ticks = period / clock_div;
+    uint32_t psc = (ticks - 1) >> 16;
+    uint32_t arr = ticks / (psc + 1) - 1;
+    uint32_t pulse = DIV_ROUND_UP(pulse_ticks, psc + 1);
+    uint32_t ccr = arr + 1 > pulse + 2 ? arr + 1 - pulse : 2;
+    if (running)
+        update_active_ccr();
+    out_tim->PSC = psc;
+    out_tim->ARR = arr;
+    *out_ccr = pending_ccr = ccr;
+    if (!running) {
+        // Load the new period now - the first step is a period away
+        out_tim->CNT = 0;
+        out_tim->EGR = TIM_EGR_UG;
+        out_tim->SR = 0;
+        active_ccr = ccr;
+        set_output_mode(OCM_PWM2);
+        out_tim->CR1 = TIM_CR1_ARPE | TIM_CR1_CEN;
+        running = 1;
+    }
+    irq_restore(flag);
+}
+
+// Return the (16bit) number of steps output so far
+uint16_t
+step_freq_count(void)
+{
+    return count_tim->CNT;
+}
+
+// Stop the output and give the step pin back to the gpio code
+void
+step_freq_disable(void)
+{
+    irqstatus_t flag = irq_save();
+    step_freq_stop();
+    irq_restore(flag);
+    gpio_peripheral(out_pin, GPIO_OUTPUT, 0);
+}
@@ -10,6 +10,7 @@
 #include "board/armcm_timer.h" // udelay
 #include "board/gpio.h" // gpio_out_setup
 #include "board/io.h" // writeb
+#include "board/irq.h" // irq_disable
 #include "board/usb_cdc.h" // usb_notify_ep0
 #include "board/usb_cdc_ep.h" // USB_CDC_EP_BULK_IN
 #include "command.h" // DECL_CONSTANT_STR
@@ -31,13 +32,15 @@ struct ep_desc {
     epmword_t addr_tx, count_tx, addr_rx, count_rx;
 };
 
+// The bulk endpoints are double buffered - buffer 0 uses the "tx"
+// fields of the descriptor and buffer 1 the "rx" fields
 struct ep_mem {
     struct ep_desc ep0, ep_acm, ep_bulk_out, ep_bulk_in;
     epmword_t ep0_tx[USB_CDC_EP0_SIZE / 2];
     epmword_t ep0_rx[USB_CDC_EP0_SIZE / 2 + 1];
     epmword_t ep_acm_tx[USB_CDC_EP_ACM_SIZE / 2];
-    epmword_t ep_bulk_out_rx[USB_CDC_EP_BULK_OUT_SIZE / 2 + 1];
-    epmword_t ep_bulk_in_tx[USB_CDC_EP_BULK_IN_SIZE / 2];
+    epmword_t ep_bulk_out_rx[2][USB_CDC_EP_BULK_OUT_SIZE / 2 + 1];
+    epmword_t ep_bulk_in_tx[2][USB_CDC_EP_BULK_IN_SIZE / 2];
 };
 
 #define EPM ((struct ep_mem *)USB_PMAADDR)
@@ -58,11 +61,15 @@ btable_configure(void)
     EPM->ep_acm.count_tx = 0;
     EPM->ep_acm.addr_tx = CALC_ADDR(EPM->ep_acm_tx);
 
+    EPM->ep_bulk_out.count_tx = CALC_SIZE(USB_CDC_EP_BULK_OUT_SIZE);
+    EPM->ep_bulk_out.addr_tx = CALC_ADDR(EPM->ep_bulk_out_rx[0]);
     EPM->ep_bulk_out.count_rx = CALC_SIZE(USB_CDC_EP_BULK_OUT_SIZE);
-    EPM->ep_bulk_out.addr_rx = CALC_ADDR(EPM->ep_bulk_out_rx);
+    EPM->ep_bulk_out.addr_rx = CALC_ADDR(EPM->ep_bulk_out_rx[1]);
 
     EPM->ep_bulk_in.count_tx = 0;
-    EPM->ep_bulk_in.addr_tx = CALC_ADDR(EPM->ep_bulk_in_tx);
+    EPM->ep_bulk_in.addr_tx = CALC_ADDR(EPM->ep_bulk_in_tx[0]);
+    EPM->ep_bulk_in.count_rx = 0;
+    EPM->ep_bulk_in.addr_rx = CALC_ADDR(EPM->ep_bulk_in_tx[1]);
 }
 
 // Read a packet stored in dedicated usb memory
@@ -102,12 +109,6 @@ btable_write_packet(epmword_t *dest, const uint8_t *src, int count)
 #define EPR_RWBITS (USB_EPADDR_FIELD | USB_EP_KIND | USB_EP_TYPE_MASK)
 #define EPR_RWCBITS (USB_EP_CTR_RX | USB_EP_CTR_TX)
 
-static uint32_t
-set_stat_rx_bits(uint32_t epr, uint32_t bits)
-{
-    return ((epr & (EPR_RWBITS | USB_EPRX_STAT)) ^ bits) | EPR_RWCBITS;
-}
-
 static uint32_t
 set_stat_tx_bits(uint32_t epr, uint32_t bits)
 {
@@ -121,36 +122,88 @@ set_stat_rxtx_bits(uint32_t epr, uint32_t bits)
     return ((epr & mask) ^ bits) | EPR_RWCBITS;
 }
 
+// Toggle the software buffer (SW_BUF) bit of a double buffered endpoint
+static uint32_t
+toggle_sw_buf_bits(uint32_t epr, uint32_t sw_buf)
+{
+    return (epr & EPR_RWBITS) | EPR_RWCBITS | sw_buf;
+}
+
+// Check if the hardware is waiting for the buffer that software owns
+// (the DTOG bit of the hardware matches SW_BUF)
+static int
+is_dbuf_blocked(uint32_t epr)
+{
+    return !(epr & USB_EP_DTOG_RX) == !(epr & USB_EP_DTOG_TX);
+}
+
 
 /****************************************************************
  * USB interface
  ****************************************************************/
 
+// The bulk endpoints use the hardware double buffering.  The hardware
+// fills (or sends) one buffer while the software reads (or fills) the
+// other one.  Software hands a buffer over by toggling SW_BUF - which
+// is done by the irq handler when the hardware completes a transfer
+// (or directly if the hardware is already waiting for that buffer).
+// A non-zero 'flag' notes that such a toggle is pending.
+static uint32_t bulk_out_pop_count, bulk_out_push_flag;
+static uint32_t bulk_in_push_count, bulk_in_pop_flag;
+
 int_fast8_t
 usb_read_bulk_out(void *data, uint_fast8_t max_len)
 {
-    uint32_t epr = USB_EPR[USB_CDC_EP_BULK_OUT];
-    if ((epr & USB_EPRX_STAT) == USB_EP_RX_VALID)
+    if (readl(&bulk_out_push_flag))
         // No data ready
         return -1;
-    uint32_t count = EPM->ep_bulk_out.count_rx & 0x3ff;
+    uint32_t bufnum = bulk_out_pop_count & 1;
+    bulk_out_pop_count++;
+    struct ep_desc *desc = &EPM->ep_bulk_out;
+    uint32_t count = (bufnum ? desc->count_rx : desc->count_tx) & 0x3ff;
     if (count > max_len)
         count = max_len;
-    btable_read_packet(data, EPM->ep_bulk_out_rx, count);
-    USB_EPR[USB_CDC_EP_BULK_OUT] = set_stat_rx_bits(epr, USB_EP_RX_VALID);
+    btable_read_packet(data, EPM->ep_bulk_out_rx[bufnum], count);
+    writel(&bulk_out_push_flag, USB_EP_DTOG_TX);
+
+    // The next packet may have arrived before the flag was set (irqs
+    // are disabled so the irq handler can't also toggle SW_BUF)
+    irq_disable();
+    uint32_t epr = USB_EPR[USB_CDC_EP_BULK_OUT];
+    if (is_dbuf_blocked(epr) && bulk_out_push_flag) {
+        bulk_out_push_flag = 0;
+        USB_EPR[USB_CDC_EP_BULK_OUT] = toggle_sw_buf_bits(
+            epr, USB_EP_DTOG_TX);
+        usb_notify_bulk_out();
+    }
+    irq_enable();
     return count;
 }
 
 int_fast8_t
 usb_send_bulk_in(void *data, uint_fast8_t len)
 {
-    uint32_t epr = USB_EPR[USB_CDC_EP_BULK_IN];
-    if ((epr & USB_EPTX_STAT) != USB_EP_TX_NAK)
+    if (readl(&bulk_in_pop_flag))
         // No buffer space available
         return -1;
-    btable_write_packet(EPM->ep_bulk_in_tx, data, len);
-    EPM->ep_bulk_in.count_tx = len;
-    USB_EPR[USB_CDC_EP_BULK_IN] = set_stat_tx_bits(epr, USB_EP_TX_VALID);
+    uint32_t bufnum = bulk_in_push_count & 1;
+    bulk_in_push_count++;
+    btable_write_packet(EPM->ep_bulk_in_tx[bufnum], data, len);
+    if (bufnum)
+        EPM->ep_bulk_in.count_rx = len;
+    else
+        EPM->ep_bulk_in.count_tx = len;
+    writel(&bulk_in_pop_flag, USB_EP_DTOG_RX);
+
+    // Start the transfer now if the hardware is idle
+    irq_disable();
+    uint32_t epr = USB_EPR[USB_CDC_EP_BULK_IN];
+    if (is_dbuf_blocked(epr) && bulk_in_pop_flag) {
+        bulk_in_pop_flag = 0;
+        USB_EPR[USB_CDC_EP_BULK_IN] = toggle_sw_buf_bits(
+            epr, USB_EP_DTOG_RX);
+    }
+    irq_enable();
     return len;
 }
 
@@ -224,10 +277,16 @@ usb_reset(void)
     USB_EPR[0] = 0 | USB_EP_CONTROL | USB_EP_RX_VALID | USB_EP_TX_NAK;
     USB_EPR[USB_CDC_EP_ACM] = (USB_CDC_EP_ACM | USB_EP_INTERRUPT
                                | USB_EP_RX_NAK | USB_EP_TX_NAK);
+    // Double buffered bulk endpoints - the hardware receives into
+    // buffer 0 first (software owns buffer 1 until the first packet)
+    bulk_out_pop_count = 0;
+    bulk_out_push_flag = USB_EP_DTOG_TX;
     USB_EPR[USB_CDC_EP_BULK_OUT] = (USB_CDC_EP_BULK_OUT | USB_EP_BULK
-                                    | USB_EP_RX_VALID | USB_EP_TX_NAK);
+                                    | USB_EP_KIND | USB_EP_RX_VALID
+                                    | USB_EP_DTOG_TX);
+    bulk_in_push_count = bulk_in_pop_flag = 0;
     USB_EPR[USB_CDC_EP_BULK_IN] = (USB_CDC_EP_BULK_IN | USB_EP_BULK
-                                   | USB_EP_RX_NAK | USB_EP_TX_NAK);
+                                   | USB_EP_KIND | USB_EP_TX_VALID);
 
     USB->CNTR = USB_CNTR_CTRM | USB_CNTR_RESETM;
     USB->DADDR = USB_DADDR_EF;
@@ -241,8 +300,17 @@ USB_IRQHandler(void)
     if (istr & USB_ISTR_CTR) {
         // Endpoint activity
         uint32_t ep = istr & USB_ISTR_EP_ID;
-        uint32_t epr = USB_EPR[ep];
-        USB_EPR[ep] = epr & EPR_RWBITS;
+        uint32_t epr = USB_EPR[ep], sw_buf = 0;
+        if (ep == USB_CDC_EP_BULK_OUT) {
+            // Hand over the buffer the software is done with
+            sw_buf = bulk_out_push_flag;
+            bulk_out_push_flag = 0;
+        } else if (ep == USB_CDC_EP_BULK_IN) {
+            // Hand over the buffer the software filled
+            sw_buf = bulk_in_pop_flag;
+            bulk_in_pop_flag = 0;
+        }
+        USB_EPR[ep] = (epr & EPR_RWBITS) | sw_buf;
         if (ep == 0) {
             usb_notify_ep0();
             if (epr & USB_EP_CTR_TX && set_address) {
@@ -54,7 +54,7 @@ thc_update_event(struct timer *t)
     struct thc *thc = container_of(t, struct thc, update_timer);
     t->waketime += thc->update_interval;
     thc->flags |= THC_NEED_UPDATE;
-    sched_wake_task(&thc_update_wake);
+    sched_wake_priority_task(&thc_update_wake);
     return SF_RESCHEDULE;
 }
 
@@ -95,7 +95,7 @@ thc_toggle(struct thc* thc)
         sched_add_timer(&thc->update_timer);
 
         thc->flags |=  THC_ACTIVE | THC_NEED_UPDATE;
-        sched_wake_task(&thc_update_wake);
+        sched_wake_priority_task(&thc_update_wake);
 
         if (session->has_end) { // schedule next stop
             schedule_stop(thc, session);
@@ -279,7 +279,7 @@ DECL_TASK(thc_toggle_task);
 void
 thc_update_task(void)
 {
-    if (!sched_check_wake(&thc_update_wake))
+    if (!sched_check_priority_wake(&thc_update_wake))
         return;
 
     uint8_t i;
@@ -289,4 +289,4 @@ thc_update_task(void)
             thc_update(thc);
     }
 }
-DECL_TASK(thc_update_task);
+DECL_PRIORITY_TASK(thc_update_task);
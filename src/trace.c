@@ -0,0 +1,95 @@
+// Timing trace of mcu events
+//
+// Copyright (C) 2020  Lucas Felix <lucas.felix0738@gmail.com>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// Timestamped events (timer dispatch, task runs, command dispatch,
+// time freezes, step queue margins) are stored in a small ring buffer
+// that always holds the most recent events.  Recording stops on a
+// shutdown so that the events leading up to it are preserved, and it
+// is paused while the host reads the buffer.
+
+#include "board/irq.h" // irq_save
+#include "board/misc.h" // timer_read_time
+#include "command.h" // DECL_COMMAND
+#include "sched.h" // DECL_SHUTDOWN
+#include "trace.h" // trace_record
+
+struct trace_entry {
+    uint32_t time, value;
+    uint8_t type, arg;
+};
+
+enum { TRACE_ENTRY_SIZE=10, TRACE_ENTRIES_PER_MSG=4 };
+
+static struct trace_entry trace_buf[CONFIG_TRACE_SIZE];
+static uint16_t trace_pos, trace_count;
+static uint8_t trace_mask = 0xff, trace_paused;
+
+// Add an event to the trace buffer (may be called from irq context)
+void
+trace_record(uint_fast8_t type, uint_fast8_t arg, uint32_t value)
+{
+    if (!(trace_mask & (1 << type)) || trace_paused)
+        return;
+    irqstatus_t flag = irq_save();
+    struct trace_entry *e = &trace_buf[trace_pos];
+    e->time = timer_read_time();
+    e->value = value;
+    e->type = type;
+    e->arg = arg;
+    if (++trace_pos >= ARRAY_SIZE(trace_buf))
+        trace_pos = 0;
+    if (trace_count < ARRAY_SIZE(trace_buf))
+        trace_count++;
+    irq_restore(flag);
+}
+
+// Clear the trace buffer and select the events to record
+void
+command_trace_set(uint32_t *args)
+{
+    irq_disable();
+    trace_mask = args[0];
+    trace_pos = trace_count = trace_paused = 0;
+    irq_enable();
+}
+DECL_COMMAND(command_trace_set, "trace_set events=%c");
+
+// Report the entries of the trace buffer (oldest first).  Recording is
+// paused from the first query until the next trace_set command.
+void
+command_trace_query(uint32_t *args)
+{
+    uint_fast16_t offset = args[0];
+    if (!offset)
+        trace_paused = 1;
+    uint_fast16_t count = trace_count, i, n = 0;
+    uint_fast16_t pos = (trace_pos + ARRAY_SIZE(trace_buf) - count + offset)
+                        % ARRAY_SIZE(trace_buf);
+    uint8_t data[TRACE_ENTRY_SIZE * TRACE_ENTRIES_PER_MSG], *p = data;
+    for (i=offset; i<count && n<TRACE_ENTRIES_PER_MSG; i++, n++) {
+        struct trace_entry *e = &trace_buf[pos];
+        uint32_t t = e->time, v = e->value;
+        p[0] = t; p[1] = t >> 8; p[2] = t >> 16; p[3] = t >> 24;
+        p[4] = v; p[5] = v >> 8; p[6] = v >> 16; p[7] = v >> 24;
+        p[8] = e->type;
+        p[9] = e->arg;
+        p += TRACE_ENTRY_SIZE;
+        if (++pos >= ARRAY_SIZE(trace_buf))
+            pos = 0;
+    }
+    sendf("trace_data offset=%hu count=%hu data=%*s"
+          , offset, count, p - data, data);
+}
+DECL_COMMAND_FLAGS(command_trace_query, HF_IN_SHUTDOWN,
+                   "trace_query offset=%hu");
+
+// Stop recording so the events that led to a shutdown are kept
+void
+trace_shutdown(void)
+{
+    trace_paused = 1;
+}
+DECL_SHUTDOWN(trace_shutdown);
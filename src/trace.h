@@ -0,0 +1,23 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h> // uint32_t
+#include "autoconf.h" // CONFIG_WANT_TRACE
+
+// Trace event types (must match klippy/extras/mcu_trace.py)
+enum {
+    TE_TIMER, TE_TASKS, TE_PRIORITY_TASK, TE_COMMAND, TE_FREEZE,
+    TE_UNFREEZE, TE_STEP_MARGIN,
+};
+
+void trace_record(uint_fast8_t type, uint_fast8_t arg, uint32_t value);
+
+// Record an event in the trace buffer (if enabled at compile time)
+static inline void
+trace_event(uint_fast8_t type, uint_fast8_t arg, uint32_t value)
+{
+    if (CONFIG_WANT_TRACE)
+        trace_record(type, arg, value);
+}
+
+#endif // trace.h